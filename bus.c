@@ -2,6 +2,15 @@
 #include "wago.h"
 #include "bus.h"
 #include "kbusapi.h"
+#include "trace.h"
+#include "metrics.h"
+#include "shm.h"
+#include "mon.h"
+#include "rules.h"
+#include "sched.h"
+#include "history.h"
+#include "datalog.h"
+#include "pub.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -17,38 +26,110 @@ extern char debug;
 //1	750-5xx	0	16	n	0	0	16	0	0	0
 //2	750-5xx	0	16	n	2	0	16	0	0	0
 
+/* Module catalog: the first entry whose name matches wins, so specific
+   numbers go before ranges. Counters (750-404) have a status byte,
+   padded to a word, before the 32-bit value. */
+static const struct bus_module bus_catalog[] = {
+	{ "750-404", BUS_COUNTER,   BUS_ENC_U32, 2 },
+	{ "750-45x", BUS_WORDS_IN,  BUS_ENC_S16, 0 },
+	{ "750-46x", BUS_WORDS_IN,  BUS_ENC_S16, 0 },
+	{ "750-47x", BUS_WORDS_IN,  BUS_ENC_S16, 0 },
+	{ "750-48x", BUS_WORDS_IN,  BUS_ENC_S16, 0 },
+	{ "750-4xx", BUS_BITS_IN,   BUS_ENC_BIT, 0 },
+	{ "750-55x", BUS_WORDS_OUT, BUS_ENC_S16, 0 },
+	{ "750-56x", BUS_WORDS_OUT, BUS_ENC_S16, 0 },
+	{ "750-5xx", BUS_BITS_OUT,  BUS_ENC_BIT, 0 },
+};
+#define N_CATALOG (sizeof(bus_catalog)/sizeof(bus_catalog[0]))
+
+#define PAB_BYTES (sizeof(__u16)*PAB_SIZE)
+#ifdef DEMO
+/* simulated process image for words */
+static unsigned char demo_pab_in[PAB_BYTES], demo_pab_out[PAB_BYTES];
+#define PAB_IN demo_pab_in
+#define PAB_OUT demo_pab_out
+#else
+#define PAB_IN pstPabIN->uc.Pab
+#define PAB_OUT pstPabOUT->uc.Pab
+#endif
+
+static uint32_t get_le(const volatile unsigned char *p, unsigned char bytes)
+{
+	uint32_t v = 0;
+
+	while(bytes--)
+		v = (v << 8) | p[bytes];
+	return v;
+}
+
+static void put_le(volatile unsigned char *p, unsigned char bytes, uint32_t v)
+{
+	unsigned char i;
+
+	for(i = 0; i < bytes; i++, v >>= 8)
+		p[i] = v & 0xFF;
+}
+
 struct _bus_priv;
 struct _bus_priv {
 	struct _bus bus;
 	struct _bus_priv *next;
-	unsigned char byte_offset, bit_offset;
+	const struct bus_module *mod;
+	unsigned short byte_offset;
+	unsigned char bit_offset;
 };
 static struct _bus_priv *bus_list = NULL;
+static struct _bus_priv *bus_prev = NULL; /* the old list, while reloading */
 static const char *bus_file = NULL;
+static char *bus_cfg = NULL;
 
-/* Initialize/free data */
-int bus_init_data(const char *fn)
+static const struct bus_module *bus_module(const char *name)
 {
-	FILE *f;
-	int res = 0;
-#ifdef DEMO
-	if(fn == NULL)
-		return 0;
-	bus_file = strdup(fn);
-#else
-	if(fn == NULL) {
-		fn = "/proc/driver/kbus/config.csv";
-		bus_file = "/proc/driver/kbus/config";
+	unsigned int i,j;
+
+	for(i = 0; i < N_CATALOG; i++) {
+		const char *p = bus_catalog[i].name;
+		for(j = 0; p[j] && name[j]; j++)
+			if (p[j] != 'x' && p[j] != name[j])
+				break;
+		if (!p[j] && !name[j])
+			return &bus_catalog[i];
 	}
+	return NULL;
+}
 
-	res = KbusOpen();
-	if(res < 0)
-		return res;
-#endif
+static unsigned char enc_width(enum bus_enc enc)
+{
+	switch(enc) {
+	case BUS_ENC_S16:
+		return 16;
+	case BUS_ENC_U32:
+		return 32;
+	default:
+		return 1;
+	}
+}
+
+/* A word module at byte OFF, SIZ bits long (including control bytes) */
+static void set_words(struct _bus_priv *dev, int off, int siz)
+{
+	unsigned char width = enc_width(dev->mod->enc);
+	int n = (siz - 8*dev->mod->skip) / width;
+
+	if (n <= 0 || n > 255 || off < 0 || off + dev->mod->skip + n*width/8 > PAB_BYTES) {
+		dev->bus.typ = BUS_UNKNOWN;
+		return;
+	}
+	dev->byte_offset = off;
+	dev->bus.bits = n;
+	dev->bus.width = width;
+}
+
+/* Parse the configuration; the slots are prepended to *LIST */
+static int bus_parse(FILE *f, struct _bus_priv **list)
+{
+	int res = 0;
 
-	f = fopen(fn,"r");
-	if (f == NULL)
-		return -errno;
 	while(1) {
 		struct _bus_priv *dev;
 		char devtyp[BUS_TYPNAME_LEN],x3[3];
@@ -62,7 +143,7 @@ int bus_init_data(const char *fn)
 		if (len != 11) {
 			if (len > 0)
 				res = -EINVAL;
-			return res;
+			break;
 		}
 		dev = malloc(sizeof(*dev));
 		if (dev == NULL) {
@@ -73,33 +154,152 @@ int bus_init_data(const char *fn)
 		dev->bus.id = i;
 		strcpy(dev->bus.typname,devtyp);
 
-		if(!strcmp(devtyp,"750-5xx")) { // digital output
-			dev->bus.typ = BUS_BITS_OUT;
+		dev->mod = bus_module(devtyp);
+		dev->bus.typ = dev->mod ? dev->mod->typ : BUS_UNKNOWN;
+		switch(dev->bus.typ) {
+		case BUS_BITS_OUT:
 			dev->byte_offset = woff;
 			dev->bit_offset = wboff;
 			dev->bus.bits = wsiz;
-		} else if(!strcmp(devtyp,"750-4xx")) { // digital output
-			dev->bus.typ = BUS_BITS_IN;
+			dev->bus.width = 1;
+			break;
+		case BUS_BITS_IN:
 			dev->byte_offset = roff;
 			dev->bit_offset = rboff;
 			dev->bus.bits = rsiz;
-		} else {
-			dev->bus.typ = BUS_UNKNOWN;
+			dev->bus.width = 1;
+			break;
+		case BUS_WORDS_OUT:
+			set_words(dev, woff, wsiz);
+			break;
+		case BUS_WORDS_IN:
+		case BUS_COUNTER:
+			set_words(dev, roff, rsiz);
+			break;
+		default:
+			break;
 		}
-		dev->next = bus_list;
-		bus_list = dev;
+		dev->next = *list;
+		*list = dev;
+	}
+	return res;
+}
+
+static void bus_free_list(struct _bus_priv *list)
+{
+	while(list) {
+		struct _bus_priv *bus = list;
+		list = bus->next;
+		free(bus);
+	}
+}
+
+/* Initialize/free data */
+int bus_init_data(const char *fn)
+{
+	FILE *f;
+	int res = 0;
+#ifdef DEMO
+	if(fn == NULL)
+		return 0;
+	bus_file = strdup(fn);
+#else
+	if(fn == NULL) {
+		fn = "/proc/driver/kbus/config.csv";
+		bus_file = "/proc/driver/kbus/config";
 	}
+
+	res = KbusOpen();
+	if(res < 0)
+		return res;
+#endif
+	bus_cfg = strdup(fn);
+
+	f = fopen(fn,"r");
+	if (f == NULL)
+		return -errno;
+	res = bus_parse(f, &bus_list);
 	fclose(f);
 	return res;
 }
 
 void bus_free_data()
 {
+	bus_free_list(bus_list);
+	bus_list = NULL;
+	free(bus_cfg);
+	bus_cfg = NULL;
 #ifndef DEMO
 	KbusClose();
 #endif
 }
 
+static struct _bus_priv *find_slot(struct _bus_priv *list, unsigned char id)
+{
+	for(; list; list = list->next)
+		if (list->bus.id == id)
+			return list;
+	return NULL;
+}
+
+/* Re-read the configuration file. The new slot list is built on the side
+   and swapped in between two bus cycles; then everything which holds a
+   hardware address checks it with bus_bit_kept(). */
+int bus_reload(void)
+{
+	struct _bus_priv *list = NULL;
+	FILE *f;
+	int res;
+
+	if (bus_cfg == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+	f = fopen(bus_cfg,"r");
+	if (f == NULL)
+		return -1;
+	res = bus_parse(f, &list);
+	fclose(f);
+	if (res == 0 && list == NULL)
+		res = -EINVAL; /* not a configuration file */
+	if (res < 0) {
+		bus_free_list(list);
+		errno = -res;
+		return -1;
+	}
+
+	bus_prev = bus_list;
+	bus_list = list;
+	res = mon_reload() + rule_reload() + sched_reload() + hist_reload();
+	dlog_reload();
+	pub_reload();
+	shm_reload();
+	bus_free_list(bus_prev);
+	bus_prev = NULL;
+
+	bus_sync();
+	return res;
+}
+
+int bus_bit_kept(unsigned short _port,unsigned short _offset, enum bus_type typ)
+{
+	struct _bus_priv *old,*new;
+	unsigned int bit = _port*8 + _offset;
+
+	if (bus_prev == NULL)
+		return 1;
+	for(old = bus_prev; old; old = old->next) {
+		unsigned int first = old->byte_offset*8 + old->bit_offset;
+		if (old->bus.typ == typ && bit >= first && bit < first + old->bus.bits)
+			break;
+	}
+	if (old == NULL)
+		return 0;
+	new = find_slot(bus_list, old->bus.id);
+	return new && new->mod == old->mod && new->bus.bits == old->bus.bits &&
+		new->byte_offset == old->byte_offset && new->bit_offset == old->bit_offset;
+}
+
 /* return a file with data describing the bus */
 FILE *bus_description(void)
 {
@@ -132,17 +332,58 @@ const char *bus_typname(enum bus_type typ)
 		return "digital input";
 	case BUS_BITS_OUT:
 		return "digital output";
+	case BUS_WORDS_IN:
+		return "analog input";
+	case BUS_WORDS_OUT:
+		return "analog output";
+	case BUS_COUNTER:
+		return "counter";
 	default:
 		return "???";
 	}
 }
 
+#ifdef DEMO
+/* some pulses on each counter */
+static void demo_count(void)
+{
+	struct _bus_priv *bus;
+	unsigned short port;
+
+	for(bus = bus_list; bus; bus = bus->next) {
+		if (bus->bus.typ != BUS_COUNTER)
+			continue;
+		port = bus->byte_offset + bus->mod->skip;
+		put_le(demo_pab_in+port, 4, get_le(demo_pab_in+port, 4) + rand()%4);
+	}
+}
+#endif
+
 /* sync bus state */
 void bus_sync()
 {
+	int res = 0;
+	uint32_t t;
+
+	trace_stamp();
+	t = trace_now;
 #ifndef DEMO
-	KbusUpdate();
+	res = KbusUpdate();
+#else
+	if (demo_rand)
+		demo_count();
 #endif
+	trace_stamp();
+	t = trace_now - t;
+	trace(TR_SYNC, 0,0, res);
+
+	metrics.kbus_updates++;
+	metrics.kbus_usec_sum += t;
+	if (metrics.kbus_usec_max < t)
+		metrics.kbus_usec_max = t;
+	if (res < 0)
+		metrics.kbus_errors++;
+	shm_publish(t);
 }
 
 
@@ -164,13 +405,13 @@ int _bus_find_bit(unsigned short *_port,unsigned short *_offset, enum bus_type t
 
 		if (bus->bus.typ != typ) {
 			errno = EINVAL;
-			if(debug) printf("Check %d %d for %s FAILED: wrong device\n",port,offset,bus_typname(typ));
+			trace(TR_FIND_FAIL, port,TR_POS(offset), errno);
 			return -1;
 		}
 
 		if (offset == 0 || offset > bus->bus.bits) {
 			errno = EINVAL;
-			if(debug) printf("Check %d %d for %s FAILED: max %d bits\n",port,offset,bus_typname(typ), bus->bus.bits);
+			trace(TR_FIND_FAIL, port,TR_POS(offset), errno);
 			return -1;
 		}
 
@@ -180,8 +421,8 @@ int _bus_find_bit(unsigned short *_port,unsigned short *_offset, enum bus_type t
 		return 0;
 	}
 		
-	if(debug) printf("Check %d %d for %s FAILED: ID not found\n",port,offset,bus_typname(typ));
 	errno = ENODEV;
+	trace(TR_FIND_FAIL, port,TR_POS(offset), errno);
 	return -1;
 }
 
@@ -195,6 +436,74 @@ int bus_is_write_bit(unsigned short *port,unsigned short *offset)
 	return _bus_find_bit(port,offset,BUS_BITS_OUT);
 }
 
+static int _bus_find_slot(unsigned short *port,unsigned short *offset, unsigned char *bits, enum bus_type typ)
+{
+	struct _bus_priv *bus;
+
+	for(bus = bus_list; bus; bus = bus->next)
+		if (bus->bus.id == *port)
+			break;
+	if (bus == NULL) {
+		errno = ENODEV;
+		return -1;
+	}
+	if (bus->bus.typ != typ || bus->bus.bits > 8*sizeof(unsigned long)) {
+		errno = EINVAL;
+		return -1;
+	}
+	*port = bus->byte_offset;
+	*offset = bus->bit_offset;
+	*bits = bus->bus.bits;
+	return 0;
+}
+
+int bus_is_read_slot(unsigned short *port,unsigned short *offset, unsigned char *bits)
+{
+	return _bus_find_slot(port,offset,bits,BUS_BITS_IN);
+}
+
+int bus_is_write_slot(unsigned short *port,unsigned short *offset, unsigned char *bits)
+{
+	return _bus_find_slot(port,offset,bits,BUS_BITS_OUT);
+}
+
+unsigned long _bus_read_slot(unsigned short port,unsigned short offset, unsigned char bits)
+{
+	unsigned long res = 0;
+	unsigned char i;
+
+	for(i = 0; i < bits; i++, offset++) {
+#ifdef DEMO
+		char b = demo_rand ? (rand() < RAND_MAX/10) : 0;
+		if (b ? !demo_state_r : demo_state_r)
+			res |= 1UL << i;
+#else
+		if (pstPabIN->uc.Pab[port + (offset>>3)] & (1<<(offset&7)))
+			res |= 1UL << i;
+#endif
+	}
+	trace(TR_READ, port,TR_BIT_SLOT, res);
+	return res;
+}
+
+unsigned long _bus_read_wslot(unsigned short port,unsigned short offset, unsigned char bits)
+{
+	unsigned long res = 0;
+	unsigned char i;
+
+	for(i = 0; i < bits; i++, offset++) {
+#ifdef DEMO
+		char b = demo_rand ? (rand() < RAND_MAX/10) : 0;
+		if (b ? !demo_state_w : demo_state_w)
+			res |= 1UL << i;
+#else
+		if (pstPabOUT->uc.Pab[port + (offset>>3)] & (1<<(offset&7)))
+			res |= 1UL << i;
+#endif
+	}
+	trace(TR_READ_W, port,TR_BIT_SLOT, res);
+	return res;
+}
 
 /* read a bit, or return a bit's write status */
 char _bus_read_bit(unsigned short port,unsigned short offset)
@@ -212,8 +521,7 @@ char _bus_read_bit(unsigned short port,unsigned short offset)
 #else
 	res = (pstPabIN->uc.Pab[port] & (1<<offset)) ? 1 : 0;
 #endif
-	if(debug)
-		printf("    bit %d:%d = %d\n", port,offset, res);
+	trace(TR_READ, port,offset, res);
 	return res;
 }
 
@@ -232,8 +540,7 @@ char _bus_read_wbit(unsigned short port,unsigned short offset)
 #else
 	res = (pstPabOUT->uc.Pab[port] & (1<<offset)) ? 1 : 0;
 #endif
-	if(debug)
-		printf("   wbit %d:%d = %d\n", port,offset, res);
+	trace(TR_READ_W, port,offset, res);
 	return res;
 }
 
@@ -241,8 +548,7 @@ char _bus_read_wbit(unsigned short port,unsigned short offset)
 /* write a bit */
 void _bus_write_bit(unsigned short port,unsigned short offset, char value)
 {
-	if(debug)
-		printf("Set bit %d:%d = %d\n", port,offset, value);
+	trace(TR_WRITE, port,offset, value);
 #ifdef DEMO
 	demo_state_w = value;
 #else
@@ -254,3 +560,112 @@ void _bus_write_bit(unsigned short port,unsigned short offset, char value)
 #endif
 }
 
+/* write several bits */
+int bus_write_bits(struct bus_wbit *bits, int n)
+{
+	int i;
+
+	for(i = 0; i < n; i++)
+		if (bus_is_write_bit(&bits[i].port,&bits[i].offset) < 0)
+			return -1-i;
+	for(i = 0; i < n; i++)
+		_bus_write_bit(bits[i].port,bits[i].offset, bits[i].value);
+	return 0;
+}
+
+int bus_write_mask(unsigned short port, unsigned long mask, unsigned long value)
+{
+	struct _bus_priv *bus;
+	unsigned short offset;
+
+	for(bus = bus_list; bus; bus = bus->next)
+		if (bus->bus.id == port)
+			break;
+	if (bus == NULL) {
+		errno = ENODEV;
+		return -1;
+	}
+	if (bus->bus.typ != BUS_BITS_OUT || (bus->bus.bits < 8*sizeof(mask) && (mask >> bus->bus.bits))) {
+		errno = EINVAL;
+		return -1;
+	}
+	for(offset = bus->bit_offset; mask; offset++, mask >>= 1, value >>= 1)
+		if (mask & 1)
+			_bus_write_bit(bus->byte_offset + (offset>>3), offset & 7, value & 1);
+	return 0;
+}
+
+static int _bus_find_word(unsigned short *port,unsigned short chan, enum bus_enc *enc, char write)
+{
+	struct _bus_priv *bus = find_slot(bus_list, *port);
+
+	if (bus == NULL) {
+		errno = ENODEV;
+		return -1;
+	}
+	if (!(bus->bus.typ == BUS_WORDS_OUT || (!write && (bus->bus.typ == BUS_WORDS_IN || bus->bus.typ == BUS_COUNTER)))) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (chan == 0 || chan > bus->bus.bits) {
+		errno = EINVAL;
+		return -1;
+	}
+	*port = bus->byte_offset + bus->mod->skip + (chan-1)*bus->bus.width/8;
+	*enc = bus->mod->enc;
+	return 0;
+}
+
+int bus_is_read_word(unsigned short *port,unsigned short chan, enum bus_enc *enc)
+{
+	return _bus_find_word(port,chan,enc,0);
+}
+
+int bus_is_write_word(unsigned short *port,unsigned short chan, enum bus_enc *enc)
+{
+	return _bus_find_word(port,chan,enc,1);
+}
+
+int64_t _bus_read_word(unsigned short port, enum bus_enc enc, char output)
+{
+	const volatile unsigned char *p = (output ? PAB_OUT : PAB_IN) + port;
+	int64_t res;
+
+	if (enc == BUS_ENC_S16)
+		res = (int16_t)get_le(p, 2);
+	else
+		res = get_le(p, 4);
+	trace(output ? TR_READ_W : TR_READ, port,TR_BIT_WORD, res);
+	return res;
+}
+
+void _bus_write_word(unsigned short port, enum bus_enc enc, int64_t value)
+{
+	trace(TR_WRITE, port,TR_BIT_WORD, value);
+	put_le(PAB_OUT + port, (enc == BUS_ENC_S16) ? 2 : 4, value);
+}
+
+int bus_read_word(unsigned short port,unsigned short chan, int64_t *value)
+{
+	struct _bus_priv *bus = find_slot(bus_list, port);
+	enum bus_enc enc;
+
+	if (bus_is_read_word(&port,chan,&enc) < 0)
+		return -1;
+	*value = _bus_read_word(port, enc, bus->bus.typ == BUS_WORDS_OUT);
+	return 0;
+}
+
+int bus_write_word(unsigned short port,unsigned short chan, int64_t value)
+{
+	enum bus_enc enc;
+
+	if (bus_is_write_word(&port,chan,&enc) < 0)
+		return -1;
+	if (enc == BUS_ENC_S16 && (value < -32768 || value > 32767)) {
+		errno = ERANGE;
+		return -1;
+	}
+	_bus_write_word(port, enc, value);
+	return 0;
+}
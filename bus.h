@@ -2,18 +2,39 @@
 #define BUS_H
 
 #include <stdio.h>
+#include <stdint.h>
 
 /* Bus descriptor */
 enum bus_type {
 	BUS_UNKNOWN,
 	BUS_BITS_IN,
 	BUS_BITS_OUT,
+	BUS_WORDS_IN, /* analog inputs */
+	BUS_WORDS_OUT, /* analog outputs */
+	BUS_COUNTER, /* counter modules; read-only */
 };
+
+/* How a channel is stored in the process image. Words are little-endian. */
+enum bus_enc {
+	BUS_ENC_BIT,
+	BUS_ENC_S16,
+	BUS_ENC_U32,
+};
+
+/* Module catalog entry, see bus.c */
+struct bus_module {
+	const char *name; /* 'x' matches any character */
+	enum bus_type typ;
+	enum bus_enc enc;
+	unsigned char skip; /* control/status bytes before the first channel */
+};
+
 #define BUS_TYPNAME_LEN 10
 struct _bus {
 	enum bus_type typ;
 	unsigned char id;
-	unsigned char bits;
+	unsigned char bits; /* digital: number of bits; else number of channels */
+	unsigned char width; /* bits per channel */
 	char typname[BUS_TYPNAME_LEN];
 };
 
@@ -21,6 +42,17 @@ struct _bus {
 int bus_init_data(const char *fn);
 void bus_free_data();
 
+/* Re-read the configuration file given to bus_init_data(), between two
+   bus cycles. Monitors, rules, scheduled changes and recorders on slots
+   which have changed or vanished are dropped; the log, publisher and
+   shared memory pick up the new slot table. Returns the number of
+   dropped items. On error (errno is set) nothing has changed. */
+int bus_reload(void);
+
+/* During bus_reload(): is the hardware bit _PORT/_OFFSET on a slot of
+   type TYP which the reload did not change? */
+int bus_bit_kept(unsigned short _port,unsigned short _offset, enum bus_type typ);
+
 /* return a file with data describing the bus */
 FILE *bus_description(void);
 
@@ -32,12 +64,25 @@ const char *bus_typname(enum bus_type typ);
 /* sync bus state */
 void bus_sync(void);
 
+/* Look up a bit on a device of this type. See bus.c. */
+int _bus_find_bit(unsigned short *port,unsigned short *offset, enum bus_type typ);
+
 /* check if this bit is on the bus for reading/writing.
    This may modify its input values, so call exactly once.
  */
 int bus_is_read_bit(unsigned short *port,unsigned short *offset);
 int bus_is_write_bit(unsigned short *port,unsigned short *offset);
 
+/* Check if this slot is a digital input (output); return its hardware
+   byte/bit offset and width. Modifies its input values like
+   bus_is_read_bit(). */
+int bus_is_read_slot(unsigned short *port,unsigned short *offset, unsigned char *bits);
+int bus_is_write_slot(unsigned short *port,unsigned short *offset, unsigned char *bits);
+/* read all bits of an input slot, or an output slot's write status;
+   bit 0 is position 1 */
+unsigned long _bus_read_slot(unsigned short port,unsigned short offset, unsigned char bits);
+unsigned long _bus_read_wslot(unsigned short port,unsigned short offset, unsigned char bits);
+
 /* read a bit, or return a bit's write status */
 /* The macro version checks for validity: for use in one-off accesses. */
 /* The function version does not check for validity: check manually; for use in timer loops. */
@@ -54,6 +99,22 @@ char _bus_read_wbit(unsigned short port,unsigned short offset);
 		((bus_is_write_bit(&p,&o) == 0) ? _bus_read_wbit(p,o) : -1); \
 	})
 
+/* Check if channel CHAN (1-based) of slot PORT is a word to read (an
+   analog input, counter or analog output) or to write (an analog output).
+   Returns its hardware byte offset in *PORT, and its encoding. */
+int bus_is_read_word(unsigned short *port,unsigned short chan, enum bus_enc *enc);
+int bus_is_write_word(unsigned short *port,unsigned short chan, enum bus_enc *enc);
+
+/* Read a word; outputs are read back from the output image. No checks. */
+int64_t _bus_read_word(unsigned short port, enum bus_enc enc, char output);
+/* Write a word. No checks. */
+void _bus_write_word(unsigned short port, enum bus_enc enc, int64_t value);
+
+/* Checked versions. bus_write_word() fails with ERANGE if VALUE does not
+   fit. */
+int bus_read_word(unsigned short port,unsigned short chan, int64_t *value);
+int bus_write_word(unsigned short port,unsigned short chan, int64_t value);
+
 /* write a bit */
 void _bus_write_bit(unsigned short port,unsigned short offset, char value);
 #define bus_write_bit(_p,_o,_v) ({ \
@@ -62,4 +123,18 @@ void _bus_write_bit(unsigned short port,unsigned short offset, char value);
 		((bus_is_write_bit(&p,&o) == 0) ? _bus_write_bit(p,o,(_v)),0 : -1); \
 	})
 
+/* Write several bits at once. All of them are checked before any is
+   written, so either all change (with the next bus_sync) or none do.
+   Returns 0, or -1-i if entry i is invalid (errno is set).
+   The port/offset fields are modified. */
+struct bus_wbit {
+	unsigned short port,offset;
+	char value;
+};
+int bus_write_bits(struct bus_wbit *bits, int n);
+
+/* Write the bits of output device PORT which are set in MASK.
+   Bit 0 is position 1. */
+int bus_write_mask(unsigned short port, unsigned long mask, unsigned long value);
+
 #endif
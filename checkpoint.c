@@ -0,0 +1,155 @@
+
+#include "wago.h"
+#include "checkpoint.h"
+#include "handoff.h"
+#include "mon.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <event2/buffer.h>
+
+static char *ckpt_name = NULL;
+static char ckpt_changed = 0;
+static uint64_t ckpt_last = 0;
+
+static int ckpt_load(enum ckpt_mode mode)
+{
+	struct ho_hello hello;
+	struct ho_rec rec;
+	unsigned char *data;
+	size_t len,pos;
+	FILE *f;
+	int n = 0;
+
+	f = fopen(ckpt_name,"r");
+	if (f == NULL)
+		return (errno == ENOENT) ? 0 : -1;
+	if (fseek(f,0,SEEK_END) < 0 || (len = ftell(f)) < sizeof(rec)+sizeof(hello)) {
+		fclose(f);
+		errno = EINVAL;
+		return -1;
+	}
+	rewind(f);
+	data = malloc(len);
+	if (data == NULL || fread(data,1,len,f) != len) {
+		free(data);
+		fclose(f);
+		errno = EIO;
+		return -1;
+	}
+	fclose(f);
+
+	memcpy(&rec, data, sizeof(rec));
+	memcpy(&hello, data+sizeof(rec), sizeof(hello));
+	if (rec.typ != HO_HELLO || rec.len != sizeof(hello) ||
+			memcmp(hello.magic, HANDOFF_MAGIC, sizeof(hello.magic)) || hello.version != HANDOFF_VERSION) {
+		free(data);
+		errno = EINVAL;
+		return -1;
+	}
+	for(pos = sizeof(rec)+sizeof(hello); pos+sizeof(rec) <= len; pos += rec.len) {
+		memcpy(&rec, data+pos, sizeof(rec));
+		pos += sizeof(rec);
+		if (len-pos < rec.len)
+			break; /* truncated; can't happen with rename() */
+		if (rec.typ != HO_MON)
+			continue;
+		if (mon_restore(data+pos, rec.len, (mode == CKPT_CLEAR) ? MON_RESTORE_CLEAR : MON_RESTORE_RESUME) < 0)
+			fprintf(stderr,"Could not restore a monitor from %s: %s\n",ckpt_name,strerror(errno));
+		else
+			n++;
+	}
+	free(data);
+	if (debug)
+		printf("%s %d output monitors from %s.\n", (mode == CKPT_CLEAR) ? "Cleared" : "Resumed", n, ckpt_name);
+	return 0;
+}
+
+static int ckpt_write(void)
+{
+	struct evbuffer *buf, *old;
+	struct ho_hello hello;
+	char *tmp;
+	int fd, res = -1;
+
+	buf = evbuffer_new();
+	tmp = malloc(strlen(ckpt_name)+5);
+	if (buf == NULL || tmp == NULL)
+		goto out;
+	sprintf(tmp,"%s.tmp",ckpt_name);
+
+	memcpy(hello.magic, HANDOFF_MAGIC, sizeof(hello.magic));
+	hello.version = HANDOFF_VERSION;
+	old = handoff_target(buf);
+	if (evbuffer_add(handoff_rec(HO_HELLO, sizeof(hello)), &hello, sizeof(hello)) < 0 || mon_save(1) < 0) {
+		handoff_target(old);
+		goto out;
+	}
+	handoff_target(old);
+
+	fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd < 0)
+		goto out;
+	while(evbuffer_get_length(buf))
+		if (evbuffer_write(buf, fd) < 0)
+			break;
+	if (evbuffer_get_length(buf) || fsync(fd) < 0) {
+		close(fd);
+		unlink(tmp);
+		goto out;
+	}
+	if (close(fd) < 0 || rename(tmp, ckpt_name) < 0)
+		goto out;
+	res = 0;
+out:
+	if (buf)
+		evbuffer_free(buf);
+	free(tmp);
+	return res;
+}
+
+int ckpt_open(const char *fn, enum ckpt_mode mode, char load)
+{
+	ckpt_name = strdup(fn);
+	if (ckpt_name == NULL)
+		return -1;
+	if (load && ckpt_load(mode) < 0) {
+		free(ckpt_name);
+		ckpt_name = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+void ckpt_close(void)
+{
+	if (ckpt_name && ckpt_changed && ckpt_write() < 0)
+		fprintf(stderr,"Could not write %s: %s\n",ckpt_name,strerror(errno));
+	free(ckpt_name);
+	ckpt_name = NULL;
+}
+
+void ckpt_dirty(void)
+{
+	ckpt_changed = 1;
+}
+
+void ckpt_sync(const struct timeval *tv)
+{
+	uint64_t now = tv->tv_sec*1000000ULL + tv->tv_usec;
+
+	if (ckpt_name == NULL || !ckpt_changed)
+		return;
+	if (ckpt_last && now - ckpt_last < CKPT_INTERVAL*1000000ULL)
+		return;
+	ckpt_last = now;
+	if (ckpt_write() < 0)
+		fprintf(stderr,"Could not write %s: %s\n",ckpt_name,strerror(errno));
+	else
+		ckpt_changed = 0;
+}
@@ -0,0 +1,39 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <sys/time.h>
+
+/* Checkpoints of the output monitors (timed outputs, PWM, sequences),
+   so that they survive a crash.
+
+   The file holds a HO_HELLO record and one HO_MON record per monitor,
+   in the handoff format (see handoff.h). It is rewritten via a temporary
+   file and rename() whenever a monitor has been added or removed, but
+   at most every CKPT_INTERVAL seconds to spare the flash. PWM phases
+   are not saved as they flip; they are recomputed from the saved start
+   time when the file is loaded. Timers which ran out while we were down
+   fire right away.
+
+   On startup, before any connection is accepted, the monitors are
+   either resumed (their outputs set to where they should be by now,
+   timers continuing), or their outputs are cleared and they are dropped.
+   Restored monitors have no connection; clients re-attach with 'm?'. */
+#define CKPT_INTERVAL 10
+
+enum ckpt_mode {
+	CKPT_RESUME,
+	CKPT_CLEAR,
+};
+
+/* Use FN for checkpoints. If LOAD is set, restore its monitors first. */
+int ckpt_open(const char *fn, enum ckpt_mode mode, char load);
+/* Write any pending change. */
+void ckpt_close(void);
+
+/* The set of output monitors has changed. */
+void ckpt_dirty(void);
+
+/* Write the file if it's due. Called from mon_sync(). */
+void ckpt_sync(const struct timeval *now);
+
+#endif
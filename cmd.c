@@ -0,0 +1,1117 @@
+/*
+  Command parser for the line protocol.
+
+  It is available under the GNU General Public license, version 3.
+
+  Copyright © 2011 Matthias Urlichs <matthias@urlichs.de>
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <sys/time.h>
+
+#include "wago.h"
+#include "cmd.h"
+#include "bus.h"
+#include "mon.h"
+#include "rules.h"
+#include "sched.h"
+#include "history.h"
+#include "trace.h"
+#include "metrics.h"
+
+#include <event2/bufferevent.h>
+#include <event2/buffer.h>
+#include <event2/event.h>
+
+/* max number of bits in one 'w' command */
+#define MAX_WBITS 32
+
+/* max number of steps in one 'p' command */
+#define MAX_STEPS 64
+
+
+static int report_mon(struct _mon *mon, void *priv)
+{
+	struct evbuffer *out = (struct evbuffer *)priv;
+	const char nix[] = "-";
+	const char *det;
+
+	det = mon_detail(mon);
+	if (det == NULL)
+		det = nix;
+
+	evbuffer_add_printf(out, "%d %s: %d:%d %s\n", mon->id, mon_typname(mon->typ), mon->port,mon->offset, det);
+	if (det != nix)
+		free((char *)det);
+	return 0;
+}
+
+int report_bus(struct _bus *bus, void *priv)
+{
+	struct evbuffer *out = (struct evbuffer *)priv;
+
+	evbuffer_add_printf(out, "%d: %s:%s %d", bus->id,bus_typname(bus->typ),bus->typname, bus->bits);
+	int i;
+	signed char j;
+	int64_t v;
+
+	switch (bus->typ) {
+	case BUS_BITS_IN:
+		evbuffer_add(out, " <=",3);
+		for(i=1; i <= bus->bits; i++) {
+			if ((i%5) == 1) evbuffer_add(out, " ",1);
+			j = bus_read_bit(bus->id,i);
+			evbuffer_add(out, (j < 0) ? "?" : j ? "1" : "0", 1);
+		}
+		
+		break;
+	case BUS_BITS_OUT:
+		evbuffer_add(out, " =>",3);
+		for(i=1; i <= bus->bits; i++) {
+			if ((i%5) == 1) evbuffer_add(out, " ",1);
+			j = bus_read_wbit(bus->id,i);
+			evbuffer_add(out, (j < 0) ? "?" : j ? "1" : "0", 1);
+		}
+
+		break;
+	case BUS_WORDS_IN:
+	case BUS_COUNTER:
+	case BUS_WORDS_OUT:
+		evbuffer_add_printf(out, "x%d %s", bus->width, (bus->typ == BUS_WORDS_OUT) ? "=>" : "<=");
+		for(i=1; i <= bus->bits; i++) {
+			if (bus_read_word(bus->id,i,&v) < 0)
+				evbuffer_add(out, " ?", 2);
+			else
+				evbuffer_add_printf(out, " %lld", (long long)v);
+		}
+		break;
+	default:
+		/* don't know what to do */
+		break;
+	}
+	evbuffer_add(out, "\n",1);
+	return 0;
+}
+
+static int report_rule(struct _rule *rule, void *priv)
+{
+	struct evbuffer *out = (struct evbuffer *)priv;
+
+	evbuffer_add_printf(out, "%d %lu: %s\n", rule->id, rule->count, rule->text);
+	return 0;
+}
+
+static int report_sched(struct _sched *sched, void *priv)
+{
+	struct evbuffer *out = (struct evbuffer *)priv;
+
+	evbuffer_add_printf(out, "%d %s %ld.%06ld: %d:%d %d\n", sched->id,
+		sched->clock == SCHED_MONOTONIC ? "mono" : "wall",
+		(long)sched->when.tv_sec,(long)sched->when.tv_usec, sched->port,sched->offset, sched->value);
+	return 0;
+}
+
+static int report_hist(struct _hist *hist, void *priv)
+{
+	struct evbuffer *out = (struct evbuffer *)priv;
+
+	evbuffer_add_printf(out, "%d: %s %u/%u", hist->port, hist_statename(hist->state), hist->count,hist->size);
+	if (hist->t_edge)
+		evbuffer_add_printf(out, " trigger %d:%d%c %u.%03u", hist->t_port,hist->t_offset,hist->t_edge,
+			hist->t_msec/1000,hist->t_msec%1000);
+	if (hist->t_when)
+		evbuffer_add_printf(out, " at %llu.%06llu", (unsigned long long)hist->t_when/1000000,
+			(unsigned long long)hist->t_when%1000000);
+	evbuffer_add(out, "\n", 1);
+	return 0;
+}
+
+/* The first record has an absolute timestamp, the others are
+   usec after the previous one. */
+struct fetch_state {
+	struct evbuffer *out;
+	uint64_t last;
+};
+static int report_hist_rec(const struct hist_rec *rec, void *priv)
+{
+	struct fetch_state *fs = (struct fetch_state *)priv;
+
+	if (fs->last == 0)
+		evbuffer_add_printf(fs->out, "%llu.%06llu %lx\n", (unsigned long long)rec->t/1000000,
+			(unsigned long long)rec->t%1000000, rec->value);
+	else
+		evbuffer_add_printf(fs->out, "+%llu %lx\n", (unsigned long long)(rec->t-fs->last), rec->value);
+	fs->last = rec->t;
+	return 0;
+}
+
+static int report_trace(const struct trace_rec *rec, void *priv)
+{
+	struct evbuffer *out = (struct evbuffer *)priv;
+	char buf[100];
+
+	trace_decode(rec, trace_now, buf,sizeof(buf));
+	evbuffer_add_printf(out, "%s\n", buf);
+	return 0;
+}
+
+static const char std_help[] = "=\n\
+Known functions:\n\
+h     print help messages\n\
+i A B read bit from input port A, pos B\n\
+I A B report bit from output port A, pos B\n\
+s A B set bit at output port A, pos B\n\
+c A B clear bit at output port A, pos B\n\
+w     set/clear several output bits at once\n\
+W     set/clear masked bits of an output port\n\
+v A B read word B of analog or counter port A\n\
+V     write a word to an analog output port\n\
+m     monitor a bit (see help for subcommands)\n\
+r     local reaction rules\n\
+p     play a sequence on outputs\n\
+a     change outputs at an absolute time\n\
+H     record input history\n\
+d     set/query poll delay\n\
+D     dump port info\n\
+t     trace buffer control\n\
+M     report metrics\n\
+\n\
+Send 'hX' for help on function X.\n\
+.\n";
+static const char std_help_h[] = "=\n\
+h  send a generic help message, list functions\n\
+hX send specific help on function X\n\
+.\n";
+static const char std_help_d[] = "=\n\
+d   report current poll frequency (seconds).\n\
+dc  report poll delay (seconds).\n\
+d X set poll frequency to X (0.001 < X < 1000 seconds).\n\
+.\n";
+static const char std_help_m[] = "=\n\
+m          list current monitor records.\n\
+           This includes timed set/clear commands.\n\
+m+ A B D [I]  report changes of bit on input port A, offset B.\n\
+           D is + - * for positive, negative, or both edges.\n\
+           With I, report at most once per I seconds: changes within\n\
+           the interval are sent at its end as one '!ID H +N' (or L),\n\
+           the current level and the number of changes held back.\n\
+		   The command replies with a monitor ID.\n\
+		   This monitor will be deallocated when the channel closes.\n\
+m# A B D I count changes, report at most every I seconds.\n\
+		   The command replies with a monitor ID.\n\
+		   This monitor will be deallocated when the channel closes.\n\
+           m+ and m# take filter options after their parameters:\n\
+           f=MSEC  the input must be stable for MSEC before it counts\n\
+           w=MSEC  ignore further changes for MSEC after each change\n\
+           k=N     use the majority of the last N samples (N <= 31)\n\
+m~ A B W [P [D]]  measure frequency and pulse widths on input port A,\n\
+           offset B, from the rising edges of the last W seconds.\n\
+           Reports '!ID Hz period min max high low' (times in msec)\n\
+           every P seconds (default: W; 0 for none), and whenever the\n\
+           frequency has moved by more than D Hz since the last report.\n\
+		   This monitor will be deallocated when the channel closes.\n\
+m= A B D   report channel B of analog slot A as '!ID VALUE' whenever\n\
+           it has moved by more than D since the last report.\n\
+m^ A B H L report '!ID H VALUE' when channel B of analog slot A\n\
+           reaches H, and '!ID L VALUE' when it falls back to L (L <= H).\n\
+m% A B P   report '!ID min max mean samples' of channel B of analog\n\
+           slot A every P seconds; it is sampled in every bus cycle.\n\
+           Analog monitors work on inputs, outputs and counters.\n\
+		   They are deallocated when the channel closes.\n\
+m? X       Re-attach to a monitor whose channel has disconnected.\n\
+m- X       delete change monitor with monitor ID X.\n\
+.\n";
+static const char std_help_r[] = "=\n\
+r          list rules: ID, times fired, rule.\n\
+r+ RULE    add a rule which runs in the bus cycle. Replies with a rule ID.\n\
+           Rules persist when the channel closes.\n\
+r- X       delete rule X.\n\
+RULE:      TERM [& TERM …] => ACTION  (or | instead of &, not mixed)\n\
+TERM:      A:B+  A:B-  A:B*  rising, falling, any edge of input A, offset B\n\
+           A:BH  A:BL        input is high, low\n\
+ACTION:    s A B             set output A, offset B\n\
+           c A B             clear it\n\
+           p A B I           set it for I seconds\n\
+           P A B I           clear it for I seconds\n\
+           w A B I J         set for I seconds, clear for J seconds, repeat\n\
+A rule fires when its condition becomes true. A timed action on an\n\
+output which is already running is ignored.\n\
+.\n";
+static const char std_help_p[] = "=\n\
+p R A:B[,A:B…] V T [V T …]\n\
+           play steps on output port A, offset B (up to 16 outputs).\n\
+           Each step sets the outputs to V for T seconds; bit 0 of V is\n\
+           the first output. The steps are played R times, 0: forever.\n\
+           The outputs keep the last step's value when done.\n\
+           This creates a monitor which persists if the channel closes\n\
+           and reports 'DONE' at the end. See 'hm' for reporting.\n\
+.\n";
+static const char std_help_a[] = "=\n\
+a          list scheduled changes: ID, clock, time, output, value.\n\
+a A B V T  set output port A, offset B to V (0 or 1) at time T\n\
+           (seconds since the epoch, wall clock). Replies with an ID.\n\
+am A B V T like 'a', but T is on the controller's monotonic clock.\n\
+a?         report the current wall clock and monotonic time.\n\
+a- X       cancel scheduled change X.\n\
+Changes are checked every bus cycle; all that are due are applied\n\
+together. They persist when the channel closes.\n\
+.\n";
+static const char std_help_H[] = "=\n\
+H          list history recorders: slot, state, records/size, trigger.\n\
+H+ A [N]   record the value of input slot A whenever it changes,\n\
+           keeping the last N changes (default 1024).\n\
+H- A       stop recording slot A.\n\
+Ht A P O E T  freeze slot A's history T seconds after edge E (+ - *)\n\
+           of input P, offset O.\n\
+Hr A       clear slot A's history and start again (re-arms the trigger).\n\
+H? A [F [T]]  report slot A's history from time F to T (seconds since\n\
+           the epoch; if negative, relative to now). The first line has\n\
+           the time and value (hex, bit 0 is offset 1), the others\n\
+           '+USEC VALUE' with the time since the previous line.\n\
+Recorders persist when the channel closes.\n\
+.\n";
+static const char std_help_i[] = "=\n\
+i A B  read a bit on input port A, offset B.\n\
+.\n";
+static const char std_help_I[] = "=\n\
+I A B  read the state of bit on output port A, offset B.\n\
+.\n";
+static const char std_help_s[] = "=\n\
+s A B       set a bit on output port A, offset B.\n\
+s A B I   … for I seconds.\n\
+            This creates a one-shot monitor which persists until the timer\n\
+            runs out.\n\
+s A B I J … then clear for J seconds, repeat.\n\
+            This creates a monitor which persists if the channel closes.\n\
+            See 'hm' for reporting.\n\
+.\n";
+static const char std_help_c[] = "=\n\
+c A B  clear a bit on output port A, offset B.\n\
+c A B I   … for I seconds.\n\
+c A B I J … then set for J seconds, repeat.\n\
+            This creates a monitor which persists if the channel closes.\n\
+            See 'hm' for reporting.\n\
+.\n";
+static const char std_help_w[] = "=\n\
+w A B V …  set output port A, offset B to V (0 or 1); repeat as needed.\n\
+           All bits are checked first, then changed in the same bus cycle.\n\
+.\n";
+static const char std_help_W[] = "=\n\
+W A M V    set the bits of output port A which are set in M to their\n\
+           value in V. Bit 0 is offset 1. Use 0x… for hex values.\n\
+           All bits are changed in the same bus cycle.\n\
+.\n";
+static const char std_help_v[] = "=\n\
+v A B      read channel B of port A: an analog input or output, or a\n\
+           counter module (750-404). Outputs are read back.\n\
+V A B X    write X to channel B of analog output port A.\n\
+           Analog channels are signed 16-bit, counters unsigned 32-bit.\n\
+.\n";
+static const char std_help_D[] = "=\n\
+D   dump port list (human-readable version).\n\
+Da# send a keepalive message every # seconds.\n\
+Dp  dump port list (parsed list).\n\
+Dl  reload the bus configuration (also on SIGHUP). Monitors, rules,\n\
+    scheduled changes and recorders on changed slots are dropped.\n";
+static const char std_help_D2[] = "\
+D-  Disconnect; simulates a connection problem.\n\
+Ds  Read-port read commands will read H.\n\
+Dc  Read-port read commands will read L.\n\
+DS  Write-port read commands will read H.\n\
+DC  Write-port read commands will read L.\n\
+DI  Write-port read commands will read the expected value.\n\
+Dr  Port reads are deterministic.\n\
+DR  Port reads are 10% likely to read the opposite state.\n";
+static const char std_help_t[] = "=\n\
+t     report trace status.\n\
+t+    start tracing.\n\
+t-    stop tracing.\n\
+tc    clear the trace buffer.\n\
+td    dump the trace buffer (oldest first).\n\
+td N  dump the last N trace records.\n\
+tw    write the trace buffer to the trace file (also on SIGUSR1).\n\
+.\n";
+static const char std_help_M[] = "=\n\
+M     report counters and gauges in Prometheus text format.\n\
+      Start with '-M PORT' to also serve them via HTTP on /metrics.\n\
+.\n";
+static const char std_help_unknown[] = "=\n\
+You requested help on an unknown function (%d).\n\
+Send 'h' for a list of known functions.\n\
+.\n";
+
+static void
+send_help(struct evbuffer *out, char h)
+{
+	switch(h) {
+	case 0:
+		evbuffer_add(out,std_help,sizeof(std_help)-1);
+		break;
+	case 'h':
+		evbuffer_add(out,std_help_h,sizeof(std_help_h)-1);
+		break;
+	case 'd':
+		evbuffer_add(out,std_help_d,sizeof(std_help_d)-1);
+		break;
+	case 'm':
+		evbuffer_add(out,std_help_m,sizeof(std_help_m)-1);
+		break;
+	case 'r':
+		evbuffer_add(out,std_help_r,sizeof(std_help_r)-1);
+		break;
+	case 'p':
+		evbuffer_add(out,std_help_p,sizeof(std_help_p)-1);
+		break;
+	case 'a':
+		evbuffer_add(out,std_help_a,sizeof(std_help_a)-1);
+		break;
+	case 'H':
+		evbuffer_add(out,std_help_H,sizeof(std_help_H)-1);
+		break;
+	case 'i':
+		evbuffer_add(out,std_help_i,sizeof(std_help_i)-1);
+		break;
+	case 'I':
+		evbuffer_add(out,std_help_I,sizeof(std_help_I)-1);
+		break;
+	case 's':
+		evbuffer_add(out,std_help_s,sizeof(std_help_s)-1);
+		break;
+	case 'c':
+		evbuffer_add(out,std_help_c,sizeof(std_help_c)-1);
+		break;
+	case 'w':
+		evbuffer_add(out,std_help_w,sizeof(std_help_w)-1);
+		break;
+	case 'W':
+		evbuffer_add(out,std_help_W,sizeof(std_help_W)-1);
+		break;
+	case 'v':
+	case 'V':
+		evbuffer_add(out,std_help_v,sizeof(std_help_v)-1);
+		break;
+	case 't':
+		evbuffer_add(out,std_help_t,sizeof(std_help_t)-1);
+		break;
+	case 'M':
+		evbuffer_add(out,std_help_M,sizeof(std_help_M)-1);
+		break;
+	case 'D':
+		evbuffer_add(out,std_help_D,sizeof(std_help_D)-1);
+#ifdef DEMO
+		evbuffer_add(out,std_help_D2,sizeof(std_help_D2)-1);
+#endif
+		evbuffer_add(out,".\n",2);
+		break;
+	default:
+		evbuffer_add_printf(out,std_help_unknown, h);
+		break;
+	}
+}
+
+enum cmd_class cmd_class(const char *line)
+{
+	switch(line[0]) {
+	case 's':
+	case 'c':
+	case 'w':
+	case 'W':
+	case 'V':
+	case 'p':
+		return CMD_OUTPUT;
+	case 'h':
+	case 'D':
+	case 'M':
+	case 't':
+	case 'H':
+		return CMD_DUMP;
+	case 'm':
+	case 'r':
+	case 'a':
+		/* the lists */
+		return line[1] ? CMD_OTHER : CMD_DUMP;
+	case 'd':
+		/* "dc" runs a bus cycle */
+		return (line[1] == 'c') ? CMD_DUMP : CMD_OTHER;
+	default:
+		return CMD_OTHER;
+	}
+}
+
+void
+parse_input(struct bufferevent *bev, const char *line)
+{
+	struct evbuffer *out = bufferevent_get_output(bev);
+	int p1,p2;
+	float p3,p4;
+	int res = 0;
+
+	metrics_command(*line);
+	switch(*line) {
+	case 'D':
+		if (line[1] == 'p') {
+			bus_sync();
+			evbuffer_add_printf(out,"=Reporting bus data\n");
+			bus_enum(report_bus, out);
+			evbuffer_add(out,".\n",2);
+		} else if(line[1] == 'a') {
+			int mon_id;
+			if(sscanf(line+2,"%g",&p3) != 1) {
+				evbuffer_add_printf(out,"?Da needs a float parameter.\n");
+				break;
+			}
+			mon_id = mon_new(MON_KEEPALIVE,0,0, bev, (int)(p3*1000),0);
+			if(mon_id < 1) {
+				evbuffer_add_printf(out,"?'Da' error creating monitor: %s\n",strerror(errno));
+				return;
+			}
+			evbuffer_add_printf(out,"!+%d monitor created\n",mon_id);
+		} else if(line[1] == 'l') {
+			int n = bus_reload();
+			if (n < 0) {
+				evbuffer_add_printf(out,"?Could not reload the configuration: %s\n",strerror(errno));
+				break;
+			}
+			evbuffer_add_printf(out,"+Reloaded; %d dropped.\n",n);
+
+#ifdef DEMO
+		} else if(line[1] == '-') {
+			struct timeval dly = {0,50000}; /* 1/20 sec */
+
+			if (conn_close(bev, &dly) < 0) {
+				fprintf(stderr, "Could not create/add a timeout event: %s\n",strerror(errno));
+				evbuffer_add_printf(out,"?Could not close: %s\n",strerror(errno));
+				return;
+			}
+			evbuffer_add(out,"+OK\n",4);
+			mon_delbuf(bev);
+			bufferevent_flush(bev,EV_WRITE,BEV_FLUSH);
+		} else if(line[1] == 'r') {
+			demo_rand = 0;
+			evbuffer_add(out,"+OK\n",4);
+		} else if(line[1] == 'R') {
+			demo_rand = 1;
+			evbuffer_add(out,"+OK\n",4);
+		} else if(line[1] == 's') {
+			demo_state_r=1;
+			evbuffer_add(out,"+OK\n",4);
+		} else if(line[1] == 'c') {
+			demo_state_r=0;
+			evbuffer_add(out,"+OK\n",4);
+		} else if(line[1] == 'S') {
+			demo_state_w=1;
+			demo_state_skip=0;
+			evbuffer_add(out,"+OK\n",4);
+		} else if(line[1] == 'C') {
+			demo_state_w=0;
+			demo_state_skip=0;
+			evbuffer_add(out,"+OK\n",4);
+		} else if(line[1] == 'I') {
+			demo_state_skip=1;
+			evbuffer_add(out,"+OK\n",4);
+#endif
+		} else if (!line[1]) {
+			FILE *fd = bus_description(); 
+			int len;
+			char fbuf[4096],*pbuf;
+			char cont = 0;
+			if (fd == NULL) {
+				evbuffer_add_printf(out,"?Could not open description: %s\n",strerror(errno));
+				break;
+			}
+
+			evbuffer_add_printf(out,"=port data\n");
+			while(1) {
+				pbuf = fgets(fbuf,sizeof(fbuf),fd);
+				if (pbuf == NULL)
+					break;
+				len = strlen(pbuf);
+				if (!cont && *pbuf == '.')
+					evbuffer_add(out,".",1);
+				evbuffer_add(out,pbuf,len);
+				cont = pbuf[len-1] != '\n';
+			}
+			fclose(fd);
+			evbuffer_add(out,".\n",2);
+		} else {
+			evbuffer_add_printf(out,"?Unknown subcommand: '%c'. Help with 'hD'.\n",line[1]);
+		}
+		break;
+	case 'd':
+		if (line[1] == 'c') {
+			struct timeval t1,t2;
+			int td;
+			gettimeofday(&t1,NULL);
+			bus_sync();
+			mon_sync();
+			bus_sync();
+			gettimeofday(&t2,NULL);
+			td = (t2.tv_sec-t1.tv_sec)*1000 + (t2.tv_usec-t1.tv_usec)/1000;
+			evbuffer_add_printf(out,"+%d.%03d sec\n",td/1000,td%1000);
+		} else if (line[1]) {
+			if(sscanf(line+1,"%g",&p3) != 1) {
+				evbuffer_add_printf(out,"?d needs a float parameter.\n");
+				break;
+			}
+			if(p3>100000 || p3 < 0.00099) {
+				evbuffer_add_printf(out,"?not a valid timer parameter, 0.001 < DELAY < 10000.\n");
+				break;
+			}
+			if (change_loop_timer(p3) < 0) {
+				evbuffer_add_printf(out,"?changing the timer failed: %s\n",strerror(errno));
+				break;
+			}
+			evbuffer_add_printf(out,"+Loop timer changed.\n");
+		} else {
+			evbuffer_add_printf(out,"+%g seconds per loop.\n", loop_dly.tv_sec+loop_dly.tv_usec/1000000.);
+		}
+		break;
+	case 'm':
+		if(line[1] == 0) {
+			evbuffer_add_printf(out,"=Monitors:\n");
+			mon_enum(report_mon, out);
+			evbuffer_add(out,".\n",2);
+		} else if(line[1] == '+' || line[1] == '#') {
+			unsigned char edge;
+			enum mon_type typ;
+			int mon_id;
+			unsigned int f_deb = 0, f_hold = 0, f_k = 0;
+			const char *lp;
+			int len = 0;
+			int res = sscanf(line+2,"%d %d %c %n",&p1,&p2,&edge,&len);
+			if (res < 3) {
+				evbuffer_add_printf(out,"?'m%c' needs two numeric and one char parameters.\n",line[1]);
+				break;
+			}
+			lp = line+2+len;
+			if (sscanf(lp,"%f %n",&p3,&len) == 1)
+				lp += len;
+			else
+				p3 = (line[1] == '+') ? 0 : 1;
+			if (p3 < 0 || p3 > 2000000) {
+				evbuffer_add_printf(out,"?'m%c' interval must be 0..2000000 seconds.\n",line[1]);
+				return;
+			}
+
+			/* filter options */
+			while(*lp) {
+				unsigned int v;
+				char opt;
+				if (sscanf(lp,"%c=%u %n",&opt,&v,&len) != 2 || !strchr("fwk",opt)) {
+					evbuffer_add_printf(out,"?'m%c' options are f=MSEC w=MSEC k=N.\n",line[1]);
+					return;
+				}
+				switch(opt) {
+				case 'f': f_deb = v; break;
+				case 'w': f_hold = v; break;
+				case 'k': f_k = v; break;
+				}
+				lp += len;
+			}
+			if (f_deb > 65535 || f_hold > 65535 || f_k > 31) {
+				evbuffer_add_printf(out,"?'m%c' filter option out of range.\n",line[1]);
+				return;
+			}
+
+			switch(edge) {
+			case '+':
+				typ = (line[1] == '+' ? MON_REPORT_H : MON_COUNT_H);
+				break;
+			case '-':
+				typ = (line[1] == '+' ? MON_REPORT_L : MON_COUNT_L);
+				break;
+			case '*':
+				typ = (line[1] == '+' ? MON_REPORT : MON_COUNT);
+				break;
+			default:
+				evbuffer_add_printf(out,"?'m%c' last parameter must be one of + - *\n",line[1]);
+				return;
+			}
+			mon_id = mon_new(typ,p1,p2, bev, (int)(p3*1000),0);
+			if(mon_id < 1) {
+				evbuffer_add_printf(out,"?'m%c' error creating monitor: %s\n",line[1],strerror(errno));
+				return;
+			}
+			if((f_deb || f_hold || f_k) && mon_filter(mon_id, f_deb,f_hold,f_k) < 0) {
+				evbuffer_add_printf(out,"?'m%c' error setting the filter: %s\n",line[1],strerror(errno));
+				mon_del(mon_id,NULL);
+				return;
+			}
+			evbuffer_add_printf(out,"!+%d monitor created\n",mon_id);
+		} else if(line[1] == '~') {
+			float p5 = 0;
+			int mon_id;
+			int res = sscanf(line+2,"%d %d %f %f %f",&p1,&p2,&p3,&p4,&p5);
+			if (res < 3 || p3 <= 0 || p3 > 2000000) {
+				evbuffer_add_printf(out,"?'m~' needs two integer parameters and a window length.\n");
+				break;
+			}
+			if (res < 4)
+				p4 = p3;
+			if (p4 < 0 || p4 > 2000000 || (p4 == 0 && p5 <= 0)) {
+				evbuffer_add_printf(out,"?'m~' needs a period P or a change D to report on.\n");
+				break;
+			}
+			mon_id = mon_new_freq(p1,p2, bev, (int)(p3*1000),(int)(p4*1000),p5);
+			if(mon_id < 1) {
+				evbuffer_add_printf(out,"?'m~' error creating monitor: %s\n",strerror(errno));
+				return;
+			}
+			evbuffer_add_printf(out,"!+%d monitor created\n",mon_id);
+		} else if(line[1] == '=' || line[1] == '^' || line[1] == '%') {
+			long long a = 0, b = 0;
+			enum mon_type typ;
+			int mon_id, len = 0;
+
+			switch(line[1]) {
+			case '=':
+				typ = MON_ANALOG_DELTA;
+				if (sscanf(line+2,"%d %d %lli %n",&p1,&p2,&a,&len) < 3 || line[2+len]) {
+					evbuffer_add_printf(out,"?'m=' needs three integer parameters.\n");
+					return;
+				}
+				break;
+			case '^':
+				typ = MON_ANALOG_LEVEL;
+				if (sscanf(line+2,"%d %d %lli %lli %n",&p1,&p2,&a,&b,&len) < 4 || line[2+len]) {
+					evbuffer_add_printf(out,"?'m^' needs four integer parameters.\n");
+					return;
+				}
+				break;
+			default:
+				typ = MON_ANALOG_STATS;
+				if (sscanf(line+2,"%d %d %f %n",&p1,&p2,&p3,&len) < 3 || line[2+len] ||
+						p3 < 0.001 || p3 > 2000000) {
+					evbuffer_add_printf(out,"?'m%%' needs two integer parameters and a period of at most 2000000 seconds.\n");
+					return;
+				}
+				break;
+			}
+			mon_id = mon_new_analog(typ,p1,p2, bev, a,b, (typ == MON_ANALOG_STATS) ? (int)(p3*1000) : 0);
+			if(mon_id < 1) {
+				evbuffer_add_printf(out,"?'m%c' error creating monitor: %s\n",line[1],strerror(errno));
+				return;
+			}
+			evbuffer_add_printf(out,"!+%d monitor created\n",mon_id);
+		} else if(line[1] == '-') {
+			if(sscanf(line+2,"%d",&p1) != 1) {
+				evbuffer_add_printf(out,"?'m-' needs a numeric parameter.\n");
+				return;
+			}
+			if(mon_del(p1,bev) < 0) {
+				evbuffer_add_printf(out,"?'m-' error deleting monitor %d: %s\n",p1,strerror(errno));
+				return;
+			}
+			evbuffer_add_printf(out,"+Monitor %d deleted.\n",p1);
+		} else if(line[1] == '?') {
+			if(sscanf(line+2,"%d",&p1) != 1) {
+				evbuffer_add_printf(out,"?'m?' needs a numeric parameter.\n");
+				return;
+			}
+			if(mon_grab(p1,bev) < 0) {
+				evbuffer_add_printf(out,"?'m?' error taking monitor %d: %s\n",p1,strerror(errno));
+				return;
+			}
+			evbuffer_add_printf(out,"+Monitor %d attached.\n",p1);
+		} else {
+			evbuffer_add_printf(out,"?Unknown subcommand: '%c'. Help with 'hm'.\n",line[1]);
+		}
+		break;
+	case 'r':
+		if(line[1] == 0) {
+			evbuffer_add_printf(out,"=Rules:\n");
+			rule_enum(report_rule, out);
+			evbuffer_add(out,".\n",2);
+		} else if(line[1] == '+') {
+			res = rule_new(line+2);
+			if(res < 0) {
+				evbuffer_add_printf(out,"?'r+' error creating rule: %s\n",strerror(errno));
+				return;
+			}
+			evbuffer_add_printf(out,"+%d rule created\n",res);
+		} else if(line[1] == '-') {
+			if(sscanf(line+2,"%d",&p1) != 1) {
+				evbuffer_add_printf(out,"?'r-' needs a numeric parameter.\n");
+				return;
+			}
+			if(rule_del(p1) < 0) {
+				evbuffer_add_printf(out,"?'r-' error deleting rule %d: %s\n",p1,strerror(errno));
+				return;
+			}
+			evbuffer_add_printf(out,"+Rule %d deleted.\n",p1);
+		} else {
+			evbuffer_add_printf(out,"?Unknown subcommand: '%c'. Help with 'hr'.\n",line[1]);
+		}
+		break;
+	case 'p': {
+		unsigned char ports[MON_SEQ_OUTS], offsets[MON_SEQ_OUTS];
+		struct mon_seq_step steps[MAX_STEPS];
+		const char *lp;
+		int n_out = 0, n_steps = 0, len = 0;
+		unsigned int repeat;
+		long level;
+
+		if (sscanf(line+1,"%u %n",&repeat,&len) != 1)
+			goto p_inval;
+		lp = line+1+len;
+		while(1) {
+			if (n_out == MON_SEQ_OUTS || sscanf(lp,"%d:%d%n",&p1,&p2,&len) != 2 ||
+					p1 < 0 || p1 > 255 || p2 < 0 || p2 > 255)
+				goto p_inval;
+			ports[n_out] = p1;
+			offsets[n_out] = p2;
+			n_out++;
+			lp += len;
+			if (*lp != ',')
+				break;
+			lp++;
+		}
+		while(sscanf(lp," %li %f%n",&level,&p3,&len) == 2) {
+			if (n_steps == MAX_STEPS) {
+				evbuffer_add_printf(out,"?'p' takes at most %d steps.\n",MAX_STEPS);
+				return;
+			}
+			/* levels are 16 bits; p3 must fit in msec */
+			if (p3 < 0.001 || p3 > 4000000 || level < 0 || level > 0xFFFF)
+				goto p_inval;
+			steps[n_steps].level = level;
+			steps[n_steps].msec = p3*1000;
+			n_steps++;
+			lp += len;
+		}
+		while(*lp == ' ')
+			lp++;
+		if (n_steps == 0 || *lp) {
+		p_inval:
+			evbuffer_add_printf(out,"?'p' needs a repeat count, outputs, and value/time pairs. Help with 'hp'.\n");
+			break;
+		}
+		res = mon_new_seq(bev, n_out,ports,offsets, n_steps,steps, repeat);
+		if (res < 0) {
+			evbuffer_add_printf(out,"?'p' error creating monitor: %s\n",strerror(errno));
+			break;
+		}
+		evbuffer_add_printf(out,"!+%d Sequence started.\n", res);
+		break;
+		}
+	case 'a':
+		if(line[1] == 0) {
+			evbuffer_add_printf(out,"=Scheduled:\n");
+			sched_enum(report_sched, out);
+			evbuffer_add(out,".\n",2);
+		} else if(line[1] == '?') {
+			struct timeval tw,tm;
+			sched_now(SCHED_REALTIME,&tw);
+			sched_now(SCHED_MONOTONIC,&tm);
+			evbuffer_add_printf(out,"+%ld.%06ld %ld.%06ld\n",
+				(long)tw.tv_sec,(long)tw.tv_usec, (long)tm.tv_sec,(long)tm.tv_usec);
+		} else if(line[1] == '-') {
+			if(sscanf(line+2,"%d",&p1) != 1) {
+				evbuffer_add_printf(out,"?'a-' needs a numeric parameter.\n");
+				return;
+			}
+			if(sched_del(p1) < 0) {
+				evbuffer_add_printf(out,"?'a-' error deleting entry %d: %s\n",p1,strerror(errno));
+				return;
+			}
+			evbuffer_add_printf(out,"+Entry %d deleted.\n",p1);
+		} else {
+			enum sched_clock clock = SCHED_REALTIME;
+			const char *lp = line+1;
+			struct timeval when;
+			double t;
+			int len = 0;
+
+			if (*lp == 'm') {
+				clock = SCHED_MONOTONIC;
+				lp++;
+			}
+			if (sscanf(lp,"%d %d %d %lf %n",&p1,&p2,&res,&t,&len) != 4 || lp[len] || t < 0 || (res != 0 && res != 1)) {
+				evbuffer_add_printf(out,"?'a' needs three integer parameters (the last is 0 or 1) and a time.\n");
+				break;
+			}
+			when.tv_sec = (long)t;
+			when.tv_usec = (long)((t-when.tv_sec)*1000000);
+			res = sched_new(clock,&when, p1,p2,res);
+			if(res < 0) {
+				evbuffer_add_printf(out,"?'a' error scheduling: %s\n",strerror(errno));
+				break;
+			}
+			evbuffer_add_printf(out,"+%d scheduled\n",res);
+		}
+		break;
+	case 'H':
+		if(line[1] == 0) {
+			evbuffer_add_printf(out,"=History:\n");
+			hist_enum(report_hist, out);
+			evbuffer_add(out,".\n",2);
+		} else if(line[1] == '+') {
+			res = sscanf(line+2,"%d %d",&p1,&p2);
+			if(res < 1) {
+				evbuffer_add_printf(out,"?'H+' needs a numeric parameter.\n");
+				return;
+			}
+			if(res < 2)
+				p2 = 1024;
+			if(hist_new(p1,p2) < 0) {
+				evbuffer_add_printf(out,"?'H+' error recording slot %d: %s\n",p1,strerror(errno));
+				return;
+			}
+			evbuffer_add_printf(out,"+Recording slot %d.\n",p1);
+		} else if(line[1] == '-' || line[1] == 'r') {
+			if(sscanf(line+2,"%d",&p1) != 1) {
+				evbuffer_add_printf(out,"?'H%c' needs a numeric parameter.\n",line[1]);
+				return;
+			}
+			if((line[1] == '-' ? hist_del(p1) : hist_restart(p1)) < 0) {
+				evbuffer_add_printf(out,"?'H%c' error on slot %d: %s\n",line[1],p1,strerror(errno));
+				return;
+			}
+			evbuffer_add(out,"+OK\n",4);
+		} else if(line[1] == 't') {
+			int t_port,t_offset;
+			unsigned char edge;
+			if(sscanf(line+2,"%d %d %d %c %f",&p1,&t_port,&t_offset,&edge,&p3) != 5) {
+				evbuffer_add_printf(out,"?'Ht' needs four numeric and one char parameters.\n");
+				return;
+			}
+			if (p3 < 0 || p3 > 2000000) {
+				evbuffer_add_printf(out,"?'Ht' delay must be 0..2000000 seconds.\n");
+				return;
+			}
+			if(hist_trigger(p1,t_port,t_offset,edge,(int)(p3*1000)) < 0) {
+				evbuffer_add_printf(out,"?'Ht' error on slot %d: %s\n",p1,strerror(errno));
+				return;
+			}
+			evbuffer_add(out,"+OK\n",4);
+		} else if(line[1] == '?') {
+			struct fetch_state fs;
+			double from = 0, to = 0;
+			uint64_t now;
+			struct timeval tv;
+
+			res = sscanf(line+2,"%d %lf %lf",&p1,&from,&to);
+			if(res < 1) {
+				evbuffer_add_printf(out,"?'H?' needs a numeric parameter.\n");
+				return;
+			}
+			gettimeofday(&tv,NULL);
+			now = tv.tv_sec*1000000ULL + tv.tv_usec;
+			if(res < 3)
+				to = now/1e6;
+			if(from < 0)
+				from += now/1e6;
+			if(to < 0)
+				to += now/1e6;
+			fs.out = evbuffer_new();
+			fs.last = 0;
+			if(fs.out == NULL || hist_fetch(p1,(uint64_t)(from*1e6),(uint64_t)(to*1e6), report_hist_rec,&fs) < 0) {
+				evbuffer_add_printf(out,"?'H?' error on slot %d: %s\n",p1,strerror(errno));
+				if(fs.out)
+					evbuffer_free(fs.out);
+				return;
+			}
+			evbuffer_add_printf(out,"=History of slot %d:\n",p1);
+			evbuffer_add_buffer(out,fs.out);
+			evbuffer_add(out,".\n",2);
+			evbuffer_free(fs.out);
+		} else {
+			evbuffer_add_printf(out,"?Unknown subcommand: '%c'. Help with 'hH'.\n",line[1]);
+		}
+		break;
+	case 'M':
+		evbuffer_add_printf(out,"=Metrics:\n");
+		metrics_report(out);
+		evbuffer_add(out,".\n",2);
+		break;
+	case 't':
+		if (line[1] == 0) {
+			evbuffer_add_printf(out,"+Trace %s, %u records.\n", trace_on ? "on" : "off", trace_count());
+		} else if (line[1] == '+') {
+			trace_on = 1;
+			evbuffer_add(out,"+OK\n",4);
+		} else if (line[1] == '-') {
+			trace_on = 0;
+			evbuffer_add(out,"+OK\n",4);
+		} else if (line[1] == 'c') {
+			trace_clear();
+			evbuffer_add(out,"+OK\n",4);
+		} else if (line[1] == 'd') {
+			if(sscanf(line+2,"%d",&p1) != 1)
+				p1 = 0;
+			trace_stamp();
+			evbuffer_add_printf(out,"=Trace:\n");
+			trace_enum(p1, report_trace, out);
+			evbuffer_add(out,".\n",2);
+		} else if (line[1] == 'w') {
+			res = trace_save(trace_file);
+			if (res < 0)
+				evbuffer_add_printf(out,"?Could not write %s: %s\n",trace_file,strerror(-res));
+			else
+				evbuffer_add_printf(out,"+Trace written to %s.\n",trace_file);
+		} else {
+			evbuffer_add_printf(out,"?Unknown subcommand: '%c'. Help with 'ht'.\n",line[1]);
+		}
+		break;
+	case 'i':
+	case 'I':
+	case 's':
+	case 'c':
+		if((res = sscanf(line+1,"%d %d %f %f",&p1,&p2,&p3,&p4)) < 2) {
+			evbuffer_add_printf(out,"?'%c' needs two integer parameters and at most two floats.\n",*line);
+			break;
+		}
+		if (res < 3)
+			p3 = 0;
+		if (res < 4)
+			p4 = 0;
+		switch(*line) {
+		case 'i':
+			bus_sync();
+			res = bus_read_bit(p1,p2);
+			if(res < 0) {
+				evbuffer_add_printf(out,"?error: %s\n",strerror(errno));
+				break;
+			}
+			evbuffer_add_printf(out,"+%d\n",res);
+			break;
+		case 'I':
+			res = bus_read_wbit(p1,p2);
+			if(res < 0) {
+				evbuffer_add_printf(out,"?error: %s\n",strerror(errno));
+				break;
+			}
+			evbuffer_add_printf(out,"+%d\n",res);
+			break;
+		case 's':
+			if (p3)
+				res = mon_new(p4 ? MON_SET_LOOP : MON_SET_ONCE, p1,p2, bev, (int)(p3*1000),(int)(p4*1000));
+			else
+				res = bus_write_bit(p1,p2,1);
+			if (res < 0) {
+				if (errno == EEXIST)
+					evbuffer_add_printf(out,"%calready set\n", p3 ? '?' : '+');
+				else
+					evbuffer_add_printf(out,"?error: %s\n",strerror(errno));
+			} else if (p3)
+				evbuffer_add_printf(out,"!+%d Set, monitor started.\n", res);
+			else
+				evbuffer_add_printf(out,"+Set.\n");
+			bus_sync();
+			break;
+		case 'c':
+			if (p3)
+				res = mon_new(p4 ? MON_CLEAR_LOOP : MON_CLEAR_ONCE, p1,p2, bev, (int)(p3*1000),(int)(p4*1000));
+			else
+				res = bus_write_bit(p1,p2,0);
+			if (res < 0) {
+				if (errno == EEXIST)
+					evbuffer_add_printf(out,"%calready cleared\n", p3 ? '?' : '+');
+				else
+					evbuffer_add_printf(out,"?error: %s\n",strerror(errno));
+			} else if (p3)
+				evbuffer_add_printf(out,"!+%d Cleared, monitor started.\n", res);
+			else
+				evbuffer_add_printf(out,"+Cleared.\n");
+			bus_sync();
+			break;
+		}
+		break;
+	case 'w': {
+		struct bus_wbit bits[MAX_WBITS];
+		const char *lp = line+1;
+		int n = 0, len;
+
+		while(sscanf(lp,"%d %d %d%n",&p1,&p2,&res,&len) == 3) {
+			if (n == MAX_WBITS) {
+				evbuffer_add_printf(out,"?'w' takes at most %d bits.\n",MAX_WBITS);
+				return;
+			}
+			if (res != 0 && res != 1) {
+				evbuffer_add_printf(out,"?'w': value for %d:%d must be 0 or 1.\n",p1,p2);
+				return;
+			}
+			bits[n].port = p1;
+			bits[n].offset = p2;
+			bits[n].value = res;
+			n++;
+			lp += len;
+		}
+		while(*lp == ' ')
+			lp++;
+		if (n == 0 || *lp) {
+			evbuffer_add_printf(out,"?'w' needs triples of integer parameters.\n");
+			break;
+		}
+		res = bus_write_bits(bits,n);
+		if (res < 0) {
+			res = -1-res;
+			evbuffer_add_printf(out,"?error at %d:%d: %s\n",bits[res].port,bits[res].offset,strerror(errno));
+			break;
+		}
+		bus_sync();
+		evbuffer_add_printf(out,"+Changed %d.\n",n);
+		break;
+		}
+	case 'W': {
+		long mask,val;
+		int len = 0;
+
+		if (sscanf(line+1,"%d %li %li %n",&p1,&mask,&val,&len) < 3 || line[1+len]) {
+			evbuffer_add_printf(out,"?'W' needs three integer parameters.\n");
+			break;
+		}
+		if (bus_write_mask(p1,mask,val) < 0) {
+			evbuffer_add_printf(out,"?error: %s\n",strerror(errno));
+			break;
+		}
+		bus_sync();
+		evbuffer_add_printf(out,"+Changed.\n");
+		break;
+		}
+	case 'v': {
+		int64_t v;
+
+		if (sscanf(line+1,"%d %d",&p1,&p2) != 2) {
+			evbuffer_add_printf(out,"?'v' needs two integer parameters.\n");
+			break;
+		}
+		bus_sync();
+		if (bus_read_word(p1,p2,&v) < 0) {
+			evbuffer_add_printf(out,"?error: %s\n",strerror(errno));
+			break;
+		}
+		evbuffer_add_printf(out,"+%lld\n",(long long)v);
+		break;
+		}
+	case 'V': {
+		long long v;
+		int len = 0;
+
+		if (sscanf(line+1,"%d %d %lli %n",&p1,&p2,&v,&len) < 3 || line[1+len]) {
+			evbuffer_add_printf(out,"?'V' needs three integer parameters.\n");
+			break;
+		}
+		if (bus_write_word(p1,p2,v) < 0) {
+			evbuffer_add_printf(out,"?error: %s\n",strerror(errno));
+			break;
+		}
+		bus_sync();
+		evbuffer_add_printf(out,"+Written.\n");
+		break;
+		}
+	case 'h':
+		send_help(out,line[1]);
+		break;
+	case 0:
+		evbuffer_add_printf(out,"?Empty line. Help with 'h'.\n");
+		break;
+	default:
+		evbuffer_add_printf(out,"?Unknown character: '%c'. Help with 'h'.\n",*line);
+		break;
+	}
+}
+
@@ -0,0 +1,24 @@
+#ifndef CMD_H
+#define CMD_H
+
+struct bufferevent;
+struct _bus;
+
+/* Process one command line received on this connection. */
+void parse_input(struct bufferevent *bev, const char *line);
+
+/* How a command line is scheduled when a connection sends more than
+   it may run in one loop turn: output changes go first, dumps and
+   help cost CMD_COST_DUMP commands. */
+enum cmd_class {
+	CMD_OUTPUT,
+	CMD_OTHER,
+	CMD_DUMP,
+};
+#define CMD_COST_DUMP 4
+enum cmd_class cmd_class(const char *line);
+
+/* Bus enumerator: describe a device and its bits. PRIV is an evbuffer. */
+int report_bus(struct _bus *bus, void *priv);
+
+#endif
@@ -0,0 +1,256 @@
+
+#include "wago.h"
+#include "datalog.h"
+#include "bus.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+struct _dlog_slot {
+	unsigned short _port,_offset;
+	unsigned char bits, typ;
+	unsigned long value;
+};
+
+static FILE *dlog_file = NULL;
+static char *dlog_name = NULL;
+static unsigned long dlog_max;
+
+static struct _dlog_slot *slots = NULL;
+static unsigned int n_slots = 0;
+
+/* the current block */
+static unsigned char blk[DLOG_BLOCK];
+static unsigned int blk_len = 0;
+static uint64_t blk_t0, blk_last;
+
+/* the last record, for run-length encoding */
+static int run_slot = -1;
+static uint64_t run_dt;
+static unsigned long run_xor;
+static unsigned int run_n;
+
+static int count_slot(struct _bus *bus, void *priv)
+{
+	struct dlog_slot *ds = (struct dlog_slot *)priv;
+	unsigned short port = bus->id, offset;
+	unsigned char bits;
+	int res;
+
+	if (bus->typ == BUS_BITS_IN)
+		res = bus_is_read_slot(&port,&offset,&bits);
+	else if (bus->typ == BUS_BITS_OUT)
+		res = bus_is_write_slot(&port,&offset,&bits);
+	else
+		return 0;
+	if (res < 0)
+		return 0;
+	if (ds) {
+		ds[n_slots].id = bus->id;
+		ds[n_slots].typ = bus->typ;
+		ds[n_slots].bits = bits;
+		slots[n_slots]._port = port;
+		slots[n_slots]._offset = offset;
+		slots[n_slots].bits = bits;
+		slots[n_slots].typ = bus->typ;
+	}
+	n_slots++;
+	return 0;
+}
+
+static inline unsigned long read_slot(struct _dlog_slot *s)
+{
+	if (s->typ == BUS_BITS_IN)
+		return _bus_read_slot(s->_port,s->_offset,s->bits);
+	return _bus_read_wslot(s->_port,s->_offset,s->bits);
+}
+
+static int write_header(void)
+{
+	struct dlog_hdr hdr;
+	struct dlog_slot *ds;
+	int res = 0;
+
+	ds = malloc(n_slots*sizeof(*ds)+1);
+	if (ds == NULL)
+		return -1;
+	memset(ds,0,n_slots*sizeof(*ds));
+	n_slots = 0;
+	bus_enum(count_slot, ds);
+
+	memset(&hdr,0,sizeof(hdr));
+	memcpy(hdr.magic,DLOG_MAGIC,sizeof(hdr.magic));
+	hdr.version = DLOG_VERSION;
+	hdr.n_slots = n_slots;
+	hdr.time = time(NULL);
+	if (fwrite(&hdr,sizeof(hdr),1,dlog_file) != 1 ||
+			(n_slots && fwrite(ds,sizeof(*ds),n_slots,dlog_file) != n_slots))
+		res = -1;
+	free(ds);
+	return res;
+}
+
+int dlog_open(const char *fn, unsigned long max_size)
+{
+	unsigned int i;
+
+	n_slots = 0;
+	bus_enum(count_slot, NULL);
+	slots = calloc(n_slots+1,sizeof(*slots));
+	if (slots == NULL)
+		return -1;
+	dlog_name = strdup(fn);
+	dlog_file = fopen(fn,"a");
+	if (dlog_name == NULL || dlog_file == NULL || write_header() < 0) {
+		dlog_close();
+		return -1;
+	}
+	for(i = 0; i < n_slots; i++)
+		slots[i].value = read_slot(&slots[i]);
+	dlog_max = max_size;
+	return 0;
+}
+
+static void put_varint(uint64_t v)
+{
+	while(v >= 0x80) {
+		blk[blk_len++] = (v & 0x7F) | 0x80;
+		v >>= 7;
+	}
+	blk[blk_len++] = v;
+}
+
+static void put_run(void)
+{
+	if (run_n) {
+		put_varint((run_slot << 1) | 1);
+		put_varint(run_n);
+		run_n = 0;
+	}
+}
+
+static void rotate(void)
+{
+	char *old;
+
+	old = malloc(strlen(dlog_name)+3);
+	if (old == NULL)
+		return;
+	sprintf(old,"%s.1",dlog_name);
+	fclose(dlog_file);
+	rename(dlog_name,old);
+	free(old);
+	dlog_file = fopen(dlog_name,"a");
+	if (dlog_file == NULL || write_header() < 0)
+		fprintf(stderr,"Could not write %s: %s\n",dlog_name,strerror(errno));
+}
+
+static void flush_block(void)
+{
+	struct dlog_blk hdr;
+
+	if (blk_len == 0)
+		return;
+	put_run();
+	run_slot = -1;
+	if (dlog_file) {
+		memcpy(hdr.magic,DLOG_BLK_MAGIC,sizeof(hdr.magic));
+		hdr.len = blk_len;
+		hdr.t0 = blk_t0;
+		fwrite(&hdr,sizeof(hdr),1,dlog_file);
+		fwrite(blk,1,blk_len,dlog_file);
+		fflush(dlog_file);
+		if (dlog_max && ftell(dlog_file) >= dlog_max)
+			rotate();
+	}
+	blk_len = 0;
+}
+
+void dlog_close(void)
+{
+	flush_block();
+	if (dlog_file)
+		fclose(dlog_file);
+	dlog_file = NULL;
+	free(dlog_name);
+	dlog_name = NULL;
+	free(slots);
+	slots = NULL;
+}
+
+void dlog_reload(void)
+{
+	struct _dlog_slot *s;
+	unsigned int i;
+
+	if (dlog_file == NULL)
+		return;
+	n_slots = 0;
+	bus_enum(count_slot, NULL);
+	s = calloc(n_slots+1,sizeof(*s));
+	if (s == NULL) {
+		fprintf(stderr,"Could not reload %s: %s\n",dlog_name,strerror(errno));
+		dlog_close();
+		return;
+	}
+	free(slots);
+	slots = s;
+	/* The pending block is already encoded; it goes out under the old
+	   header. (A rotation here writes the new one.) */
+	flush_block();
+	if (dlog_file == NULL || write_header() < 0 || fflush(dlog_file))
+		fprintf(stderr,"Could not write %s: %s\n",dlog_name,strerror(errno));
+	for(i = 0; i < n_slots; i++)
+		slots[i].value = read_slot(&slots[i]);
+}
+
+/* worst case: a pending run, plus a record */
+#define DLOG_REC_MAX (2*(3+10) + 10)
+
+void dlog_sync(const struct timeval *tv)
+{
+	uint64_t now = tv->tv_sec*1000000ULL + tv->tv_usec;
+	unsigned int i;
+
+	if (slots == NULL)
+		return;
+	if (blk_len && now - blk_t0 >= DLOG_FLUSH*1000000ULL)
+		flush_block();
+
+	for(i = 0; i < n_slots; i++) {
+		unsigned long value = read_slot(&slots[i]);
+		unsigned long x = value ^ slots[i].value;
+		uint64_t dt;
+
+		if (!x)
+			continue;
+		if (blk_len > DLOG_BLOCK - DLOG_REC_MAX)
+			flush_block();
+		if (blk_len == 0) {
+			/* key frame: the values before this change */
+			unsigned int j;
+
+			blk_t0 = blk_last = now;
+			for(j = 0; j < n_slots; j++)
+				put_varint(slots[j].value);
+		}
+		slots[i].value = value;
+		dt = now - blk_last;
+		blk_last = now;
+
+		if (run_slot == i && run_dt == dt && run_xor == x) {
+			run_n++;
+			continue;
+		}
+		put_run();
+		put_varint(i << 1);
+		put_varint(dt);
+		put_varint(x);
+		run_slot = i;
+		run_dt = dt;
+		run_xor = x;
+	}
+}
@@ -0,0 +1,53 @@
+#ifndef DATALOG_H
+#define DATALOG_H
+
+#include <stdint.h>
+#include <sys/time.h>
+
+/* Change log of all digital slots, written to a local file.
+
+   The file starts with a header and the slot table; it may contain more
+   than one of these (one per daemon start). Changes are collected in
+   blocks which are written when they are full or DLOG_FLUSH seconds old.
+   Each block starts with every slot's value, so blocks decode on their
+   own; then come records of varints:
+     (slot<<1) dt xor   slot changed by XOR, DT usec after the previous record
+     (slot<<1)|1 n      the previous record repeats N more times, DT apart
+   Integers are native byte order, varints are LEB128.
+ */
+#define DLOG_MAGIC "WLOG"
+#define DLOG_BLK_MAGIC "WBLK"
+#define DLOG_VERSION 1
+#define DLOG_BLOCK 4096
+#define DLOG_FLUSH 10
+
+struct dlog_hdr {
+	char magic[4];
+	uint16_t version;
+	uint16_t n_slots; /* struct dlog_slot entries following the header */
+	int64_t time; /* wall clock (sec) when the log was opened */
+};
+struct dlog_slot {
+	uint8_t id;
+	uint8_t typ; /* enum bus_type */
+	uint8_t bits;
+	uint8_t _pad;
+};
+struct dlog_blk {
+	char magic[4];
+	uint32_t len; /* bytes following this header */
+	uint64_t t0; /* usec since the epoch */
+};
+
+/* Start logging to FN. When the file reaches MAX_SIZE bytes it is renamed
+   to FN.1 (replacing an older one) and a new file is started. */
+int dlog_open(const char *fn, unsigned long max_size);
+void dlog_close(void);
+
+/* Record changes. Called from mon_sync() with the cycle's timestamp. */
+void dlog_sync(const struct timeval *now);
+
+/* Called from bus_reload(): start a new header with the new slot table. */
+void dlog_reload(void);
+
+#endif
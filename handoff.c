@@ -0,0 +1,595 @@
+
+#include "wago.h"
+#include "handoff.h"
+#include "bus.h"
+#include "mon.h"
+#include "rules.h"
+#include "sched.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+
+#include <event2/buffer.h>
+#include <event2/event.h>
+
+/* The socket pair is SOCK_SEQPACKET. Messages start with one byte:
+   'F' carries up to HO_FDS file descriptors, 'D' up to HO_CHUNK bytes
+   of records, 'E' ends the state. The new process answers 'A' once it
+   has accepted it; the old one then sends 'G' when the bus is free. */
+#define HO_FDS 64
+#define HO_CHUNK 16384
+
+struct ho_listen {
+	int32_t fd; /* index into the passed descriptors */
+	uint32_t kind;
+};
+struct ho_conn {
+	int32_t fd;
+	uint32_t in_len, out_len; /* followed by that many bytes */
+};
+struct ho_output {
+	uint32_t slot;
+	uint32_t bits;
+	uint64_t value;
+};
+struct ho_word {
+	uint32_t slot;
+	uint32_t chan;
+	int64_t value;
+};
+
+static int ho_fd = -1;
+static int ho_errno = 0; /* an earlier step failed */
+static pid_t ho_pid = 0;
+static struct evbuffer *ho_state = NULL;
+static int *ho_fds = NULL;
+static int n_fds = 0, max_fds = 0;
+static struct bufferevent **ho_bevs = NULL;
+static int n_bevs = 0, max_bevs = 0;
+
+static void ho_free(void)
+{
+	ho_errno = 0;
+	if (ho_state)
+		evbuffer_free(ho_state);
+	ho_state = NULL;
+	free(ho_fds);
+	ho_fds = NULL;
+	n_fds = max_fds = 0;
+	free(ho_bevs);
+	ho_bevs = NULL;
+	n_bevs = max_bevs = 0;
+}
+
+static int add_fd(int fd)
+{
+	if (n_fds == max_fds) {
+		int max = max_fds ? 2*max_fds : HO_FDS;
+		int *fds = realloc(ho_fds, max*sizeof(*fds));
+		if (fds == NULL)
+			return -1;
+		ho_fds = fds;
+		max_fds = max;
+	}
+	ho_fds[n_fds] = fd;
+	return n_fds++;
+}
+
+static int add_bev(struct bufferevent *bev)
+{
+	if (n_bevs == max_bevs) {
+		int max = max_bevs ? 2*max_bevs : 64;
+		struct bufferevent **bevs = realloc(ho_bevs, max*sizeof(*bevs));
+		if (bevs == NULL)
+			return -1;
+		ho_bevs = bevs;
+		max_bevs = max;
+	}
+	ho_bevs[n_bevs] = bev;
+	return n_bevs++;
+}
+
+static void set_timeout(int fd)
+{
+	struct timeval tv = { HANDOFF_TIMEOUT, 0 };
+
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+struct evbuffer *handoff_rec(enum handoff_type typ, size_t len)
+{
+	struct ho_rec rec;
+
+	rec.typ = typ;
+	rec.len = len;
+	if (evbuffer_add(ho_state, &rec, sizeof(rec)) < 0)
+		return NULL;
+	return ho_state;
+}
+
+struct evbuffer *handoff_target(struct evbuffer *buf)
+{
+	struct evbuffer *old = ho_state;
+
+	ho_state = buf;
+	return old;
+}
+
+int handoff_begin(char * const args[])
+{
+	struct ho_hello hello;
+	struct evbuffer *out;
+	char fdbuf[12];
+	char **argv;
+	int sv[2];
+	int n,fd;
+
+	for(n = 0; args[n]; n++)
+		;
+	argv = malloc((n+3)*sizeof(*argv));
+	if (argv == NULL)
+		return -1;
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+		free(argv);
+		return -1;
+	}
+	memcpy(argv, args, n*sizeof(*argv));
+	sprintf(fdbuf, "%d", sv[1]);
+	argv[n] = "-H";
+	argv[n+1] = fdbuf;
+	argv[n+2] = NULL;
+
+	ho_pid = fork();
+	if (ho_pid == 0) {
+		/* Don't leak our sockets into the new process; it gets
+		   the ones it needs over the socket pair. */
+		for(fd = sysconf(_SC_OPEN_MAX)-1; fd > 2; fd--)
+			if (fd != sv[1])
+				close(fd);
+		execv("/proc/self/exe", argv);
+		_exit(1);
+	}
+	free(argv);
+	close(sv[1]);
+	if (ho_pid < 0) {
+		close(sv[0]);
+		return -1;
+	}
+	ho_fd = sv[0];
+	set_timeout(ho_fd);
+
+	ho_state = evbuffer_new();
+	if (ho_state == NULL)
+		goto err;
+	memcpy(hello.magic, HANDOFF_MAGIC, sizeof(hello.magic));
+	hello.version = HANDOFF_VERSION;
+	out = handoff_rec(HO_HELLO, sizeof(hello));
+	if (out == NULL || evbuffer_add(out, &hello, sizeof(hello)) < 0)
+		goto err;
+	return 0;
+err:
+	n = errno;
+	close(ho_fd);
+	ho_fd = -1;
+	kill(ho_pid, SIGKILL);
+	waitpid(ho_pid, NULL, 0);
+	ho_free();
+	errno = n;
+	return -1;
+}
+
+int handoff_listener(int fd, enum handoff_listen kind)
+{
+	struct ho_listen l;
+	struct evbuffer *out;
+
+	l.fd = add_fd(fd);
+	l.kind = kind;
+	if (l.fd < 0)
+		goto err;
+	out = handoff_rec(HO_LISTEN, sizeof(l));
+	if (out == NULL || evbuffer_add(out, &l, sizeof(l)) < 0)
+		goto err;
+	return 0;
+err:
+	ho_errno = errno;
+	return -1;
+}
+
+int handoff_conn(struct bufferevent *bev)
+{
+	struct evbuffer *in = bufferevent_get_input(bev);
+	struct evbuffer *bout = bufferevent_get_output(bev);
+	struct ho_conn c;
+	struct evbuffer *out;
+
+	if (add_bev(bev) < 0)
+		goto err;
+	c.fd = add_fd(bufferevent_getfd(bev));
+	if (c.fd < 0)
+		goto err;
+	c.in_len = evbuffer_get_length(in);
+	c.out_len = evbuffer_get_length(bout);
+	out = handoff_rec(HO_CONN, sizeof(c) + c.in_len + c.out_len);
+	if (out == NULL || evbuffer_add(out, &c, sizeof(c)) < 0)
+		goto err;
+	if (c.in_len && evbuffer_add(out, evbuffer_pullup(in, -1), c.in_len) < 0)
+		goto err;
+	if (c.out_len && evbuffer_add(out, evbuffer_pullup(bout, -1), c.out_len) < 0)
+		goto err;
+	return 0;
+err:
+	ho_errno = errno;
+	return -1;
+}
+
+int handoff_conn_id(struct bufferevent *bev)
+{
+	int i;
+
+	if (bev == NULL)
+		return -1;
+	for(i = 0; i < n_bevs; i++)
+		if (ho_bevs[i] == bev)
+			return i;
+	return -1;
+}
+
+static int save_output(struct _bus *bus, void *priv)
+{
+	struct ho_output o;
+	struct evbuffer *out;
+	unsigned short port = bus->id, offset;
+	unsigned char bits;
+
+	if (bus->typ == BUS_WORDS_OUT) {
+		struct ho_word w;
+
+		w.slot = bus->id;
+		for(w.chan = 1; w.chan <= bus->bits; w.chan++) {
+			if (bus_read_word(bus->id, w.chan, &w.value) < 0)
+				continue;
+			out = handoff_rec(HO_WORD, sizeof(w));
+			if (out == NULL || evbuffer_add(out, &w, sizeof(w)) < 0)
+				return -1;
+		}
+		return 0;
+	}
+	if (bus->typ != BUS_BITS_OUT || bus_is_write_slot(&port,&offset,&bits) < 0)
+		return 0;
+	o.slot = bus->id;
+	o.bits = bits;
+	o.value = _bus_read_wslot(port,offset,bits);
+	out = handoff_rec(HO_OUTPUT, sizeof(o));
+	if (out == NULL)
+		return -1;
+	return evbuffer_add(out, &o, sizeof(o));
+}
+
+#ifdef DEMO
+static int save_demo(void)
+{
+	char d[4] = { demo_rand, demo_state_r, demo_state_w, demo_state_skip };
+	struct evbuffer *out = handoff_rec(HO_DEMO, sizeof(d));
+
+	if (out == NULL)
+		return -1;
+	return evbuffer_add(out, d, sizeof(d));
+}
+#endif
+
+static int send_msg(char typ, const void *data, size_t len, const int *fds, int n)
+{
+	char cbuf[CMSG_SPACE(HO_FDS*sizeof(int))];
+	struct iovec iov[2];
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	iov[0].iov_base = &typ;
+	iov[0].iov_len = 1;
+	iov[1].iov_base = (void *)data;
+	iov[1].iov_len = len;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	if (n) {
+		struct cmsghdr *cmsg;
+
+		memset(cbuf, 0, sizeof(cbuf));
+		msg.msg_control = cbuf;
+		msg.msg_controllen = CMSG_SPACE(n*sizeof(int));
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(n*sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, n*sizeof(int));
+	}
+	return (sendmsg(ho_fd, &msg, MSG_NOSIGNAL) < 0) ? -1 : 0;
+}
+
+int handoff_commit(void)
+{
+	unsigned char *data;
+	size_t len,pos;
+	char ack = 0;
+	int i,n;
+
+	if (ho_errno) {
+		errno = ho_errno;
+		goto err;
+	}
+	if (bus_enum(save_output, NULL) || mon_save(0) < 0 || rule_save() < 0 || sched_save() < 0)
+		goto err;
+#ifdef DEMO
+	if (save_demo() < 0)
+		goto err;
+#endif
+
+	for(i = 0; i < n_fds; i += n) {
+		n = n_fds-i;
+		if (n > HO_FDS)
+			n = HO_FDS;
+		if (send_msg('F', NULL,0, ho_fds+i,n) < 0)
+			goto err;
+	}
+	len = evbuffer_get_length(ho_state);
+	data = evbuffer_pullup(ho_state, -1);
+	for(pos = 0; pos < len; pos += n) {
+		n = (len-pos > HO_CHUNK) ? HO_CHUNK : len-pos;
+		if (send_msg('D', data+pos,n, NULL,0) < 0)
+			goto err;
+	}
+	if (send_msg('E', NULL,0, NULL,0) < 0)
+		goto err;
+	if (recv(ho_fd, &ack, 1, 0) != 1 || ack != 'A') {
+		errno = ECONNABORTED;
+		goto err;
+	}
+
+	/* The new process owns the connections now. */
+	for(i = 0; i < n_bevs; i++)
+		bufferevent_disable(ho_bevs[i], EV_READ|EV_WRITE);
+	ho_free();
+	return 0;
+
+err:
+	n = errno;
+	close(ho_fd);
+	ho_fd = -1;
+	kill(ho_pid, SIGKILL);
+	waitpid(ho_pid, NULL, 0);
+	ho_free();
+	errno = n;
+	return -1;
+}
+
+void handoff_finish(void)
+{
+	if (ho_fd < 0)
+		return;
+	send(ho_fd, "G", 1, MSG_NOSIGNAL);
+	close(ho_fd);
+	ho_fd = -1;
+}
+
+/* Check that the records are complete and refer to descriptors we have. */
+static int check_state(void)
+{
+	unsigned char *data = evbuffer_pullup(ho_state, -1);
+	size_t len = evbuffer_get_length(ho_state);
+	size_t pos = 0;
+	struct ho_rec rec;
+	struct ho_hello hello;
+
+	while(pos < len) {
+		if (len-pos < sizeof(rec))
+			return -1;
+		memcpy(&rec, data+pos, sizeof(rec));
+		pos += sizeof(rec);
+		if (len-pos < rec.len)
+			return -1;
+		if (pos == sizeof(rec)) {
+			if (rec.typ != HO_HELLO || rec.len != sizeof(hello))
+				return -1;
+			memcpy(&hello, data+pos, sizeof(hello));
+			if (memcmp(hello.magic, HANDOFF_MAGIC, sizeof(hello.magic)) || hello.version != HANDOFF_VERSION)
+				return -1;
+		} else if (rec.typ == HO_LISTEN) {
+			struct ho_listen l;
+			if (rec.len != sizeof(l))
+				return -1;
+			memcpy(&l, data+pos, sizeof(l));
+			if (l.fd < 0 || l.fd >= n_fds)
+				return -1;
+		} else if (rec.typ == HO_CONN) {
+			struct ho_conn c;
+			if (rec.len < sizeof(c))
+				return -1;
+			memcpy(&c, data+pos, sizeof(c));
+			if (c.fd < 0 || c.fd >= n_fds || rec.len != sizeof(c) + (uint64_t)c.in_len + c.out_len)
+				return -1;
+		} else if (rec.typ == HO_OUTPUT) {
+			if (rec.len != sizeof(struct ho_output))
+				return -1;
+		} else if (rec.typ == HO_WORD) {
+			if (rec.len != sizeof(struct ho_word))
+				return -1;
+		}
+		pos += rec.len;
+	}
+	return pos ? 0 : -1;
+}
+
+int handoff_receive(int fd)
+{
+	char cbuf[CMSG_SPACE(HO_FDS*sizeof(int))];
+	static char buf[1+HO_CHUNK];
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	ssize_t len;
+	char go;
+	int err;
+
+	ho_fd = fd;
+	set_timeout(fd);
+	ho_state = evbuffer_new();
+	if (ho_state == NULL)
+		return -1;
+	while(1) {
+		memset(&msg, 0, sizeof(msg));
+		iov.iov_base = buf;
+		iov.iov_len = sizeof(buf);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+		len = recvmsg(fd, &msg, 0);
+		if (len <= 0 || (msg.msg_flags & (MSG_TRUNC|MSG_CTRUNC)))
+			goto err;
+		for(cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			int i, n;
+			if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+				continue;
+			n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			for(i = 0; i < n; i++) {
+				int rfd;
+				memcpy(&rfd, CMSG_DATA(cmsg) + i*sizeof(int), sizeof(int));
+				if (add_fd(rfd) < 0)
+					close(rfd);
+			}
+		}
+		if (buf[0] == 'E')
+			break;
+		if (buf[0] == 'D' && evbuffer_add(ho_state, buf+1, len-1) < 0)
+			goto err;
+	}
+	if (check_state() < 0) {
+		errno = EPROTO;
+		goto err;
+	}
+	if (send(fd, "A", 1, MSG_NOSIGNAL) != 1)
+		goto err;
+
+	/* 'G', or EOF: the old process has released the bus either way */
+	if (recv(fd, &go, 1, 0) < 0)
+		goto err;
+	close(fd);
+	ho_fd = -1;
+	return 0;
+
+err:
+	err = errno;
+	close(fd);
+	ho_fd = -1;
+	while(n_fds)
+		close(ho_fds[--n_fds]);
+	ho_free();
+	errno = err;
+	return -1;
+}
+
+struct bufferevent *handoff_conn_bev(int id)
+{
+	if (id < 0 || id >= n_bevs)
+		return NULL;
+	return ho_bevs[id];
+}
+
+int handoff_restore(handoff_listen_fn listen_fn, handoff_conn_fn conn_fn)
+{
+	unsigned char *data;
+	size_t len,pos = 0;
+	struct ho_rec rec;
+	int i;
+
+	if (ho_state == NULL)
+		return 0;
+	data = evbuffer_pullup(ho_state, -1);
+	len = evbuffer_get_length(ho_state);
+	while(pos < len) {
+		unsigned char *p;
+
+		memcpy(&rec, data+pos, sizeof(rec));
+		p = data+pos+sizeof(rec);
+		pos += sizeof(rec) + rec.len;
+
+		switch(rec.typ) {
+		case HO_LISTEN: {
+			struct ho_listen l;
+			memcpy(&l, p, sizeof(l));
+			if ((*listen_fn)(ho_fds[l.fd], l.kind) < 0) {
+				fprintf(stderr,"Could not take over a listener: %s\n",strerror(errno));
+				close(ho_fds[l.fd]);
+			}
+			ho_fds[l.fd] = -1;
+			break; }
+		case HO_CONN: {
+			struct ho_conn c;
+			struct bufferevent *bev;
+			memcpy(&c, p, sizeof(c));
+			bev = (*conn_fn)(ho_fds[c.fd]);
+			if (bev == NULL) {
+				fprintf(stderr,"Could not take over a connection: %s\n",strerror(errno));
+				close(ho_fds[c.fd]);
+			} else {
+				p += sizeof(c);
+				/* the input's end is frozen; it's empty anyway */
+				evbuffer_prepend(bufferevent_get_input(bev), p, c.in_len);
+				evbuffer_add(bufferevent_get_output(bev), p+c.in_len, c.out_len);
+			}
+			ho_fds[c.fd] = -1;
+			add_bev(bev);
+			break; }
+		case HO_OUTPUT: {
+			struct ho_output o;
+			memcpy(&o, p, sizeof(o));
+			if (bus_write_mask(o.slot, (o.bits < 64) ? (1ULL << o.bits)-1 : ~0ULL, o.value) < 0)
+				fprintf(stderr,"Could not restore output %d: %s\n",o.slot,strerror(errno));
+			break; }
+		case HO_WORD: {
+			struct ho_word w;
+			memcpy(&w, p, sizeof(w));
+			if (bus_write_word(w.slot, w.chan, w.value) < 0)
+				fprintf(stderr,"Could not restore output %d.%d: %s\n",w.slot,w.chan,strerror(errno));
+			break; }
+		case HO_MON:
+			if (mon_restore(p, rec.len, MON_RESTORE_HANDOFF) < 0)
+				fprintf(stderr,"Could not restore a monitor: %s\n",strerror(errno));
+			break;
+		case HO_RULE:
+			if (rule_restore(p, rec.len) < 0)
+				fprintf(stderr,"Could not restore a rule: %s\n",strerror(errno));
+			break;
+		case HO_SCHED:
+			if (sched_restore(p, rec.len) < 0)
+				fprintf(stderr,"Could not restore a scheduled change: %s\n",strerror(errno));
+			break;
+#ifdef DEMO
+		case HO_DEMO:
+			if (rec.len == 4) {
+				demo_rand = p[0];
+				demo_state_r = p[1];
+				demo_state_w = p[2];
+				demo_state_skip = p[3];
+			}
+			break;
+#endif
+		default:
+			break;
+		}
+	}
+	for(i = 0; i < n_fds; i++)
+		if (ho_fds[i] >= 0)
+			close(ho_fds[i]);
+	ho_free();
+	return 0;
+}
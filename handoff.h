@@ -0,0 +1,92 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <event2/bufferevent.h>
+#include <event2/buffer.h>
+
+/* Zero-downtime restart.
+
+   On SIGUSR2 the daemon starts /proc/self/exe with its own options plus
+   "-H FD", FD being one end of a Unix socket pair. The old process sends
+   the listening sockets and client connections (SCM_RIGHTS), then its
+   state as a list of records, and waits for the new process to accept
+   it. Then it stops, releases the bus and tells the new process to go
+   ahead; that one restores the output image before its first bus cycle,
+   so outputs don't change, and resumes all timers where they were.
+
+   If the new process does not accept the state within HANDOFF_TIMEOUT,
+   the old one carries on as if nothing had happened.
+
+   Records are in native byte order; both processes run on the same
+   machine. Each is a struct ho_rec followed by LEN bytes. */
+
+#define HANDOFF_MAGIC "WHND"
+#define HANDOFF_VERSION 2
+#define HANDOFF_TIMEOUT 5 /* sec */
+
+enum handoff_type {
+	HO_HELLO = 1, /* magic and version */
+	HO_LISTEN, /* listening socket */
+	HO_CONN, /* client connection, with buffered input and output */
+	HO_OUTPUT, /* one output slot */
+	HO_MON, /* one monitor; see mon_save() */
+	HO_RULE, /* one rule */
+	HO_SCHED, /* one scheduled change */
+	HO_DEMO, /* DEMO build: the simulated bus state */
+	HO_WORD, /* one analog output channel */
+};
+
+/* kinds of listening socket */
+enum handoff_listen {
+	HO_LISTEN_TCP,
+	HO_LISTEN_UNIX,
+};
+
+struct ho_rec {
+	uint32_t typ;
+	uint32_t len;
+};
+struct ho_hello {
+	char magic[4];
+	uint32_t version;
+};
+
+/* Old process: start the new one and collect what to send. Errors
+   are reported again by handoff_commit(). */
+int handoff_begin(char * const args[]);
+int handoff_listener(int fd, enum handoff_listen kind);
+int handoff_conn(struct bufferevent *bev);
+
+/* Send everything and wait for the new process to accept it.
+   On success all connections are disabled; the caller must leave the
+   event loop, release the bus, and call handoff_finish(). On failure
+   the new process is gone and nothing has changed. */
+int handoff_commit(void);
+void handoff_finish(void);
+
+/* Start a record of LEN bytes, to be added to the returned buffer. */
+struct evbuffer *handoff_rec(enum handoff_type typ, size_t len);
+
+/* Collect records in BUF instead (checkpoints use the same format).
+   Returns the previous buffer. */
+struct evbuffer *handoff_target(struct evbuffer *buf);
+
+/* Index of a connection passed to handoff_conn(), or -1 */
+int handoff_conn_id(struct bufferevent *bev);
+
+/* New process: read the state from FD, accept it, and wait until the
+   old process has released the bus. */
+int handoff_receive(int fd);
+
+/* Restore the state, after the bus has been set up. LISTEN_FN and
+   CONN_FN take over the sockets. */
+typedef int (*handoff_listen_fn)(int fd, enum handoff_listen kind);
+typedef struct bufferevent *(*handoff_conn_fn)(int fd);
+int handoff_restore(handoff_listen_fn listen_fn, handoff_conn_fn conn_fn);
+
+/* Connection with this index, while restoring */
+struct bufferevent *handoff_conn_bev(int id);
+
+#endif
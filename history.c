@@ -0,0 +1,275 @@
+
+#include "wago.h"
+#include "history.h"
+#include "bus.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include <event2/event.h>
+
+struct _hist_priv;
+struct _hist_priv {
+	struct _hist hist;
+	struct _hist_priv *next;
+	unsigned short _port,_offset;
+	unsigned char bits;
+	unsigned short _t_port,_t_offset;
+	char t_state;
+	unsigned int pos; /* next record goes here */
+	struct hist_rec *ring;
+};
+static struct _hist_priv *hist_list = NULL;
+
+#define HIST_SIZE_MAX 65536
+
+static struct _hist_priv *hist_find(unsigned char port)
+{
+	struct _hist_priv *hist;
+
+	for(hist = hist_list; hist; hist = hist->next)
+		if (hist->hist.port == port)
+			return hist;
+	errno = ENOENT;
+	return NULL;
+}
+
+static void hist_record(struct _hist_priv *hist, uint64_t t, unsigned long value)
+{
+	struct hist_rec *rec = &hist->ring[hist->pos];
+
+	rec->t = t;
+	rec->value = value;
+	if (++hist->pos == hist->hist.size)
+		hist->pos = 0;
+	if (hist->hist.count < hist->hist.size)
+		hist->hist.count++;
+}
+
+static void hist_start(struct _hist_priv *hist)
+{
+	struct timeval now;
+
+	hist->pos = 0;
+	hist->hist.count = 0;
+	hist->hist.t_when = 0;
+	hist->hist.state = hist->hist.t_edge ? HIST_ARMED : HIST_RUNNING;
+	if (hist->hist.t_edge)
+		hist->t_state = _bus_read_bit(hist->_t_port,hist->_t_offset);
+
+	/* the first record is the current value */
+	event_base_gettimeofday_cached(base, &now);
+	hist_record(hist, now.tv_sec*1000000ULL + now.tv_usec,
+		_bus_read_slot(hist->_port,hist->_offset,hist->bits));
+}
+
+int hist_new(unsigned char port, unsigned int size)
+{
+	struct _hist_priv *hist;
+	unsigned short _port = port, _offset = 0;
+	unsigned char bits;
+
+	if (size < 2 || size > HIST_SIZE_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	for(hist = hist_list; hist; hist = hist->next)
+		if (hist->hist.port == port) {
+			errno = EEXIST;
+			return -1;
+		}
+	if (bus_is_read_slot(&_port,&_offset,&bits) < 0)
+		return -1;
+
+	hist = malloc(sizeof(*hist));
+	if (hist == NULL)
+		return -1;
+	memset(hist,0,sizeof(*hist));
+	hist->ring = malloc(size*sizeof(*hist->ring));
+	if (hist->ring == NULL) {
+		free(hist);
+		return -1;
+	}
+	hist->hist.port = port;
+	hist->hist.size = size;
+	hist->_port = _port;
+	hist->_offset = _offset;
+	hist->bits = bits;
+	hist_start(hist);
+
+	hist->next = hist_list;
+	hist_list = hist;
+	return 0;
+}
+
+int hist_del(unsigned char port)
+{
+	struct _hist_priv **phist = &hist_list;
+
+	while(*phist) {
+		struct _hist_priv *hist = *phist;
+		if (hist->hist.port == port) {
+			*phist = hist->next;
+			free(hist->ring);
+			free(hist);
+			return 0;
+		}
+		phist = &hist->next;
+	}
+	errno = ENOENT;
+	return -1;
+}
+
+int hist_trigger(unsigned char port, unsigned char t_port, unsigned char t_offset, char edge, unsigned int msec)
+{
+	struct _hist_priv *hist = hist_find(port);
+	unsigned short _port = t_port, _offset = t_offset;
+
+	if (hist == NULL)
+		return -1;
+	if (edge != '+' && edge != '-' && edge != '*') {
+		errno = EINVAL;
+		return -1;
+	}
+	if (bus_is_read_bit(&_port,&_offset) < 0)
+		return -1;
+	hist->hist.t_port = t_port;
+	hist->hist.t_offset = t_offset;
+	hist->hist.t_edge = edge;
+	hist->hist.t_msec = msec;
+	hist->_t_port = _port;
+	hist->_t_offset = _offset;
+	hist->t_state = _bus_read_bit(_port,_offset);
+	if (hist->hist.state == HIST_RUNNING)
+		hist->hist.state = HIST_ARMED;
+	return 0;
+}
+
+int hist_restart(unsigned char port)
+{
+	struct _hist_priv *hist = hist_find(port);
+
+	if (hist == NULL)
+		return -1;
+	hist_start(hist);
+	return 0;
+}
+
+/* Enumerate the recorders. Return something != 0 to break the enumerator loop. */
+int hist_enum(hist_enum_fn enum_fn, void *priv)
+{
+	struct _hist_priv *hist;
+	int res = 0;
+
+	for(hist = hist_list; hist; hist = hist->next) {
+		res = (*enum_fn)(&hist->hist, priv);
+		if (res)
+			break;
+	}
+	return res;
+}
+
+const char *hist_statename(enum hist_state state)
+{
+	switch(state) {
+	case HIST_RUNNING:
+		return "running";
+	case HIST_ARMED:
+		return "armed";
+	case HIST_TRIGGERED:
+		return "triggered";
+	case HIST_FROZEN:
+		return "frozen";
+	default:
+		return "???";
+	}
+}
+
+int hist_fetch(unsigned char port, uint64_t from, uint64_t to, hist_fetch_fn fetch_fn, void *priv)
+{
+	struct _hist_priv *hist = hist_find(port);
+	unsigned int i,n;
+	int res = 0;
+
+	if (hist == NULL)
+		return -1;
+	n = hist->hist.count;
+	i = (hist->pos + hist->hist.size - n) % hist->hist.size;
+	for(; n; n--, i = (i+1) % hist->hist.size) {
+		const struct hist_rec *rec = &hist->ring[i];
+		if (rec->t < from)
+			continue;
+		if (rec->t > to)
+			break;
+		res = (*fetch_fn)(rec, priv);
+		if (res)
+			break;
+	}
+	return res;
+}
+
+void hist_sync(const struct timeval *tv)
+{
+	struct _hist_priv *hist;
+	uint64_t now = tv->tv_sec*1000000ULL + tv->tv_usec;
+
+	for(hist = hist_list; hist; hist = hist->next) {
+		unsigned long value;
+		unsigned int last;
+
+		switch(hist->hist.state) {
+		case HIST_FROZEN:
+			continue;
+		case HIST_ARMED: {
+			char state = _bus_read_bit(hist->_t_port,hist->_t_offset);
+			if (state != hist->t_state) {
+				hist->t_state = state;
+				if (hist->hist.t_edge == '*' || (hist->hist.t_edge == '+') == !!state) {
+					hist->hist.state = HIST_TRIGGERED;
+					hist->hist.t_when = now;
+				}
+			}
+			break;
+			}
+		case HIST_TRIGGERED:
+			if (now - hist->hist.t_when >= hist->hist.t_msec*1000ULL) {
+				hist->hist.state = HIST_FROZEN;
+				continue;
+			}
+			break;
+		default:
+			break;
+		}
+
+		value = _bus_read_slot(hist->_port,hist->_offset,hist->bits);
+		last = (hist->pos ? hist->pos : hist->hist.size) - 1;
+		if (value != hist->ring[last].value)
+			hist_record(hist, now, value);
+	}
+}
+
+int hist_reload(void)
+{
+	struct _hist_priv **phist = &hist_list;
+	int n = 0;
+
+	while(*phist) {
+		struct _hist_priv *hist = *phist;
+
+		if (!bus_bit_kept(hist->_port,hist->_offset, BUS_BITS_IN)) {
+			*phist = hist->next;
+			free(hist->ring);
+			free(hist);
+			n++;
+			continue;
+		}
+		if (hist->hist.t_edge && !bus_bit_kept(hist->_t_port,hist->_t_offset, BUS_BITS_IN)) {
+			hist->hist.t_edge = 0;
+			if (hist->hist.state == HIST_ARMED)
+				hist->hist.state = HIST_RUNNING;
+		}
+		phist = &hist->next;
+	}
+	return n;
+}
@@ -0,0 +1,56 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdint.h>
+#include <sys/time.h>
+
+/* Per-slot input history: a ring of the slot's value, recorded in every
+   bus cycle in which it changed. A trigger can freeze the ring some
+   time after an input edge, for pre/post-trigger capture. */
+enum hist_state {
+	HIST_RUNNING,
+	HIST_ARMED, /* waiting for the trigger */
+	HIST_TRIGGERED, /* freezes when the post-trigger time is up */
+	HIST_FROZEN,
+};
+
+struct _hist {
+	unsigned char port;
+	enum hist_state state;
+	unsigned int size, count; /* ring size, records in it */
+	unsigned char t_port,t_offset; /* trigger input */
+	char t_edge; /* + - * */
+	unsigned int t_msec; /* post-trigger time */
+	uint64_t t_when; /* when the trigger fired (usec) */
+};
+
+struct hist_rec {
+	uint64_t t; /* cycle timestamp, usec since the epoch */
+	unsigned long value; /* bit 0 is position 1 */
+};
+
+int hist_new(unsigned char port, unsigned int size);
+int hist_del(unsigned char port);
+
+/* Arm the trigger: freeze MSEC after edge EDGE (+ - *) of input PORT:OFFSET */
+int hist_trigger(unsigned char port, unsigned char t_port, unsigned char t_offset, char edge, unsigned int msec);
+/* Clear the ring and record again; the trigger, if any, is re-armed */
+int hist_restart(unsigned char port);
+
+/* Enumerate the recorders. Return something != 0 to break the enumerator loop. */
+typedef int (*hist_enum_fn)(struct _hist *hist, void *priv);
+int hist_enum(hist_enum_fn, void *priv);
+const char *hist_statename(enum hist_state state);
+
+/* Enumerate the records of slot PORT between FROM and TO (usec), oldest first. */
+typedef int (*hist_fetch_fn)(const struct hist_rec *rec, void *priv);
+int hist_fetch(unsigned char port, uint64_t from, uint64_t to, hist_fetch_fn, void *priv);
+
+/* Record changes. Called from mon_sync() with the cycle's timestamp. */
+void hist_sync(const struct timeval *now);
+
+/* Called from bus_reload(): drop recorders on changed slots, and
+   triggers on changed inputs. Returns how many recorders were dropped. */
+int hist_reload(void);
+
+#endif
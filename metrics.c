@@ -0,0 +1,83 @@
+
+#include "wago.h"
+#include "metrics.h"
+#include "mon.h"
+
+#include <string.h>
+
+#include <event2/buffer.h>
+
+struct metrics metrics;
+
+static int count_mon(struct _mon *mon, void *priv)
+{
+	unsigned long *count = (unsigned long *)priv;
+
+	if (mon->typ < _MON_MAX)
+		count[mon->typ]++;
+	return 0;
+}
+
+void metrics_report(struct evbuffer *out)
+{
+	unsigned long mons[_MON_MAX];
+	int i;
+
+	evbuffer_add_printf(out, "# TYPE wago_bus_cycles_total counter\n");
+	evbuffer_add_printf(out, "wago_bus_cycles_total %lu\n", metrics.cycles);
+	evbuffer_add_printf(out, "# HELP wago_bus_cycle_overruns_total Bus cycles which started more than half a period late.\n");
+	evbuffer_add_printf(out, "# TYPE wago_bus_cycle_overruns_total counter\n");
+	evbuffer_add_printf(out, "wago_bus_cycle_overruns_total %lu\n", metrics.overruns);
+	evbuffer_add_printf(out, "# TYPE wago_bus_cycle_seconds gauge\n");
+	evbuffer_add_printf(out, "wago_bus_cycle_seconds %lu.%06lu\n", metrics.cycle_usec/1000000, metrics.cycle_usec%1000000);
+	evbuffer_add_printf(out, "# TYPE wago_bus_cycle_seconds_max gauge\n");
+	evbuffer_add_printf(out, "wago_bus_cycle_seconds_max %lu.%06lu\n", metrics.cycle_usec_max/1000000, metrics.cycle_usec_max%1000000);
+
+	evbuffer_add_printf(out, "# TYPE wago_kbus_update_errors_total counter\n");
+	evbuffer_add_printf(out, "wago_kbus_update_errors_total %lu\n", metrics.kbus_errors);
+	evbuffer_add_printf(out, "# TYPE wago_kbus_update_seconds summary\n");
+	evbuffer_add_printf(out, "wago_kbus_update_seconds_count %lu\n", metrics.kbus_updates);
+	evbuffer_add_printf(out, "wago_kbus_update_seconds_sum %llu.%06llu\n", metrics.kbus_usec_sum/1000000, metrics.kbus_usec_sum%1000000);
+	evbuffer_add_printf(out, "# TYPE wago_kbus_update_seconds_max gauge\n");
+	evbuffer_add_printf(out, "wago_kbus_update_seconds_max %lu.%06lu\n", metrics.kbus_usec_max/1000000, metrics.kbus_usec_max%1000000);
+
+	memset(mons,0,sizeof(mons));
+	mon_enum(count_mon, mons);
+	evbuffer_add_printf(out, "# TYPE wago_monitors gauge\n");
+	for(i = 0; i < _MON_MAX; i++) {
+		if (i == MON_UNKNOWN || i == _MON_UNKNOWN_IN || i == _MON_UNKNOWN_OUT)
+			continue;
+		evbuffer_add_printf(out, "wago_monitors{type=\"%s\"} %lu\n", mon_typname(i), mons[i]);
+	}
+
+	evbuffer_add_printf(out, "# TYPE wago_events_total counter\n");
+	evbuffer_add_printf(out, "wago_events_total %lu\n", metrics.events);
+	evbuffer_add_printf(out, "# HELP wago_events_dropped_total Monitor signals without a connection to send them to.\n");
+	evbuffer_add_printf(out, "# TYPE wago_events_dropped_total counter\n");
+	evbuffer_add_printf(out, "wago_events_dropped_total %lu\n", metrics.events_dropped);
+
+	evbuffer_add_printf(out, "# TYPE wago_connections gauge\n");
+	evbuffer_add_printf(out, "wago_connections %lu\n", metrics.conns);
+	evbuffer_add_printf(out, "# TYPE wago_connections_total counter\n");
+	evbuffer_add_printf(out, "wago_connections_total %lu\n", metrics.conns_total);
+	evbuffer_add_printf(out, "# TYPE wago_bytes_in_total counter\n");
+	evbuffer_add_printf(out, "wago_bytes_in_total %llu\n", metrics.bytes_in);
+	evbuffer_add_printf(out, "# TYPE wago_bytes_out_total counter\n");
+	evbuffer_add_printf(out, "wago_bytes_out_total %llu\n", metrics.bytes_out);
+	evbuffer_add_printf(out, "# HELP wago_connections_deferred_total Connections which ran out of their per-turn command budget.\n");
+	evbuffer_add_printf(out, "# TYPE wago_connections_deferred_total counter\n");
+	evbuffer_add_printf(out, "wago_connections_deferred_total %lu\n", metrics.conns_deferred);
+	evbuffer_add_printf(out, "# HELP wago_connections_throttled_total Connections held back by the command rate limit.\n");
+	evbuffer_add_printf(out, "# TYPE wago_connections_throttled_total counter\n");
+	evbuffer_add_printf(out, "wago_connections_throttled_total %lu\n", metrics.conns_throttled);
+
+	evbuffer_add_printf(out, "# TYPE wago_commands_total counter\n");
+	for(i = 0x21; i < 0x7F; i++) {
+		if (!metrics.commands[i])
+			continue;
+		if (i == '"' || i == '\\')
+			evbuffer_add_printf(out, "wago_commands_total{cmd=\"\\%c\"} %lu\n", i, metrics.commands[i]);
+		else
+			evbuffer_add_printf(out, "wago_commands_total{cmd=\"%c\"} %lu\n", i, metrics.commands[i]);
+	}
+}
@@ -0,0 +1,46 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+struct evbuffer;
+
+/* Runtime counters. Updated in place by whoever knows about the event;
+   reported in Prometheus text format. */
+struct metrics {
+	/* bus cycles */
+	unsigned long cycles;
+	unsigned long overruns;
+	unsigned long cycle_usec;
+	unsigned long cycle_usec_max;
+
+	/* KbusUpdate */
+	unsigned long kbus_updates;
+	unsigned long kbus_errors;
+	unsigned long long kbus_usec_sum;
+	unsigned long kbus_usec_max;
+
+	/* monitor signals */
+	unsigned long events;
+	unsigned long events_dropped;
+
+	/* connections */
+	unsigned long conns;
+	unsigned long conns_total;
+	unsigned long long bytes_in;
+	unsigned long long bytes_out;
+	unsigned long conns_deferred; /* out of budget: input left for a later turn */
+	unsigned long conns_throttled; /* over the command rate */
+
+	/* commands, by first letter */
+	unsigned long commands[128];
+};
+extern struct metrics metrics;
+
+static inline void metrics_command(char cmd)
+{
+	metrics.commands[cmd & 0x7F]++;
+}
+
+/* Add a Prometheus text report to this buffer. */
+void metrics_report(struct evbuffer *out);
+
+#endif
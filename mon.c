@@ -2,10 +2,21 @@
 #include "wago.h"
 #include "mon.h"
 #include "bus.h"
+#include "trace.h"
+#include "metrics.h"
+#include "rules.h"
+#include "sched.h"
+#include "history.h"
+#include "datalog.h"
+#include "pub.h"
+#include "handoff.h"
+#include "checkpoint.h"
 
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
 
 #include <event2/event.h>
 #include <event2/buffer.h>
@@ -26,15 +37,195 @@ struct _mon_priv {
 	struct timeval last;
 	unsigned short _port,_offset;
 	unsigned long count;
+	unsigned char group; /* enum mon_group */
+	unsigned int idx; /* in mon_tab[group] */
+	struct _mon_seq *seq;
+	struct _mon_freq *freq;
+	struct _mon_analog *ana;
+	struct _mon_filt *filt;
+	struct _mon_watch *watch;
+	struct _mon_priv *next_sub;
+	char sig[12]; /* "!ID " for shared watchers */
+	unsigned char siglen;
+};
+
+/* Plain report monitors on the same bit share one watcher: the bit is
+   read, and each event formatted, once. Subscribers get a copy of the
+   formatted line behind their own "!ID ". */
+struct _mon_watch {
+	struct _mon_watch *next;
+	enum mon_type typ;
+	unsigned short _port,_offset;
+	unsigned char port,offset;
 	unsigned char state;
+	struct _mon_priv *subs;
+};
+
+/* Input filter state. Times are in usec. */
+struct _mon_filt {
+	uint32_t hist; /* last K samples, newest in bit 0 */
+	uint64_t since; /* the majority level last changed */
+	uint64_t edge; /* last accepted change */
+	unsigned short debounce, holdoff; /* msec */
+	unsigned char k, raw;
+};
+
+/* Sequence data, allocated in one piece with the steps */
+struct _mon_seq {
+	unsigned short n_out, n_steps, step;
+	unsigned short level;
+	unsigned int repeat, loop;
+	struct timeval next;
+	unsigned char port[MON_SEQ_OUTS], offset[MON_SEQ_OUTS];
+	unsigned short _port[MON_SEQ_OUTS], _offset[MON_SEQ_OUTS];
+	struct mon_seq_step steps[];
 };
+
+/* Frequency measurement data. Times are in usec. */
+struct _mon_freq {
+	uint64_t edge[MON_FREQ_EDGES]; /* rising edges; ring, indexed by first..head-1 */
+	unsigned int first, head;
+	uint64_t window;
+	uint64_t last_rise, last_fall;
+	uint32_t t_high, t_low;
+	float delta, reported;
+};
+
+/* Analog monitor data */
+struct _mon_analog {
+	enum bus_enc enc;
+	char output; /* an analog output, read back from the output image */
+	int64_t a, b; /* deadband, or high and low threshold */
+	int64_t value, reported; /* last sample, last reported value */
+	int64_t min, max, sum; /* samples in the current period */
+	uint32_t n;
+};
+
+/* The hot state of the monitors is kept apart from struct _mon_priv,
+   in one struct-of-arrays table per group, so that mon_sync() runs a
+   tight loop over each group and only leaves it for a monitor whose
+   input has changed. Entry I of every array belongs to monitor MON[I],
+   whose idx is I; deleting an entry moves the last one into its place.
+   Every monitor is in exactly one table. */
+enum mon_group {
+	MG_IDLE, /* not polled: keepalives, report monitors served by a watcher */
+	MG_IN, /* report and count monitors */
+	MG_FILT, /* the same with an input filter, which runs in every cycle */
+	MG_OUT, /* timed and PWM outputs */
+	MG_SEQ,
+	MG_FREQ,
+	MG_ANALOG,
+	_MG_MAX
+};
+struct mon_tab {
+	unsigned int n, size;
+	unsigned short *_port; /* hardware byte */
+	unsigned char *_offset; /* hardware bit */
+	unsigned char *state; /* last (filtered) level */
+	struct _mon_priv **mon;
+};
+
 static struct _mon_priv *mon_list = NULL;
+static struct _mon_watch *watch_list = NULL;
+static struct mon_tab mon_tab[_MG_MAX];
 static int last_mon_id = 0;
 
+#define mon_state(_m) (mon_tab[(_m)->group].state[(_m)->idx])
+
+/* The group a monitor belongs in */
+static enum mon_group mon_group(struct _mon_priv *mon)
+{
+	if (mon->seq)
+		return MG_SEQ;
+	if (mon->freq)
+		return MG_FREQ;
+	if (mon->ana)
+		return MG_ANALOG;
+	if (mon->watch)
+		return MG_IDLE;
+	if (mon->filt)
+		return MG_FILT;
+	if (mon->mon.typ > _MON_UNKNOWN_OUT)
+		return MG_OUT;
+	if (mon->mon.typ > _MON_UNKNOWN_IN)
+		return MG_IN;
+	return MG_IDLE;
+}
+
+static int tab_grow(struct mon_tab *t)
+{
+	unsigned int size = t->size ? 2*t->size : 16;
+	void *p;
+
+	/* Arrays which are larger than t->size don't hurt. */
+	if ((p = realloc(t->_port, size*sizeof(*t->_port))) == NULL)
+		return -1;
+	t->_port = p;
+	if ((p = realloc(t->_offset, size*sizeof(*t->_offset))) == NULL)
+		return -1;
+	t->_offset = p;
+	if ((p = realloc(t->state, size*sizeof(*t->state))) == NULL)
+		return -1;
+	t->state = p;
+	if ((p = realloc(t->mon, size*sizeof(*t->mon))) == NULL)
+		return -1;
+	t->mon = p;
+	t->size = size;
+	return 0;
+}
+
+static int tab_add(struct _mon_priv *mon, enum mon_group g, unsigned char state)
+{
+	struct mon_tab *t = &mon_tab[g];
+	unsigned int i;
+
+	if (t->n == t->size && tab_grow(t) < 0)
+		return -1;
+	i = t->n++;
+	t->_port[i] = mon->_port;
+	t->_offset[i] = mon->_offset;
+	t->state[i] = state;
+	t->mon[i] = mon;
+	mon->group = g;
+	mon->idx = i;
+	return 0;
+}
+
+static void tab_del(enum mon_group g, unsigned int i)
+{
+	struct mon_tab *t = &mon_tab[g];
+	unsigned int last = --t->n;
+
+	if (i == last)
+		return;
+	t->_port[i] = t->_port[last];
+	t->_offset[i] = t->_offset[last];
+	t->state[i] = t->state[last];
+	t->mon[i] = t->mon[last];
+	t->mon[i]->idx = i;
+}
+
+/* Move a monitor to another group. Nothing changes if that fails. */
+static int tab_move(struct _mon_priv *mon, enum mon_group g)
+{
+	enum mon_group old = mon->group;
+	unsigned int idx = mon->idx;
+
+	if (g == old)
+		return 0;
+	if (tab_add(mon, g, mon_tab[old].state[idx]) < 0)
+		return -1;
+	tab_del(old, idx);
+	return 0;
+}
+
 static void counter_cb(evutil_socket_t sig, short events, void *user_data);
+static void report_cb(evutil_socket_t sig, short events, void *user_data);
 static void once_cb(evutil_socket_t sig, short events, void *user_data);
 static void loop_cb(evutil_socket_t sig, short events, void *user_data);
 static void keepalive_cb(evutil_socket_t sig, short events, void *user_data);
+static void freq_cb(evutil_socket_t sig, short events, void *user_data);
+static void analog_cb(evutil_socket_t sig, short events, void *user_data);
 
 static inline struct evbuffer *outbuf(struct _mon_priv *mon) {
 	if (mon->buf == NULL)
@@ -42,6 +233,103 @@ static inline struct evbuffer *outbuf(struct _mon_priv *mon) {
 	return bufferevent_get_output(mon->buf);
 }
 
+/* Send a signal line ("!ID …") to the monitor's connection, if any. */
+static void mon_signal(struct _mon_priv *mon, const char *fmt, ...)
+{
+	struct evbuffer *out = outbuf(mon);
+	va_list ap;
+
+	if (out == NULL) {
+		metrics.events_dropped++;
+		return;
+	}
+	metrics.events++;
+	evbuffer_add_printf(out, "!%d ", mon->mon.id);
+	va_start(ap, fmt);
+	evbuffer_add_vprintf(out, fmt, ap);
+	va_end(ap);
+	evbuffer_add(out, "\n", 1);
+}
+
+static int watch_attach(struct _mon_priv *mon, unsigned char state)
+{
+	struct _mon_watch *w;
+
+	for(w = watch_list; w; w = w->next)
+		if (w->typ == mon->mon.typ && w->_port == mon->_port && w->_offset == mon->_offset)
+			break;
+	if (w == NULL) {
+		w = malloc(sizeof(*w));
+		if (w == NULL)
+			return -1;
+		memset(w,0,sizeof(*w));
+		w->typ = mon->mon.typ;
+		w->_port = mon->_port;
+		w->_offset = mon->_offset;
+		w->port = mon->mon.port;
+		w->offset = mon->mon.offset;
+		w->state = state;
+		w->next = watch_list;
+		watch_list = w;
+	}
+	mon->siglen = sprintf(mon->sig, "!%d ", mon->mon.id);
+	mon->watch = w;
+	mon->next_sub = w->subs;
+	w->subs = mon;
+	return 0;
+}
+
+/* Make this monitor stand-alone again. The caller moves it to its new
+   group, with the watcher's state. */
+static void watch_detach(struct _mon_priv *mon)
+{
+	struct _mon_watch *w = mon->watch;
+	struct _mon_priv **psub;
+
+	for(psub = &w->subs; *psub != mon; psub = &(*psub)->next_sub)
+		;
+	*psub = mon->next_sub;
+	mon->watch = NULL;
+	mon->next_sub = NULL;
+
+	if (w->subs == NULL) {
+		struct _mon_watch **pw;
+		for(pw = &watch_list; *pw != w; pw = &(*pw)->next)
+			;
+		*pw = w->next;
+		free(w);
+	}
+}
+
+/* Send a signal to every subscriber of a watcher, formatting it only once. */
+static void watch_signal(struct _mon_watch *w, const char *fmt, ...)
+{
+	struct _mon_priv *mon;
+	char line[64];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(line, sizeof(line)-1, fmt, ap);
+	va_end(ap);
+	if (len < 0)
+		return;
+	if (len > sizeof(line)-2)
+		len = sizeof(line)-2;
+	line[len++] = '\n';
+
+	for(mon = w->subs; mon; mon = mon->next_sub) {
+		struct evbuffer *out = outbuf(mon);
+		if (out == NULL) {
+			metrics.events_dropped++;
+			continue;
+		}
+		metrics.events++;
+		evbuffer_add(out, mon->sig, mon->siglen);
+		evbuffer_add(out, line, len);
+	}
+}
+
 int mon_new(enum mon_type typ, unsigned char port, unsigned char offset, struct bufferevent *buf,
 	unsigned int msec, unsigned int msec2)
 {
@@ -86,7 +374,6 @@ int mon_new(enum mon_type typ, unsigned char port, unsigned char offset, struct
 	mon->_port = _port;
 	mon->mon.offset = offset;
 	mon->_offset = _offset;
-	mon->state = state;
 	mon->buf = buf;
 	mon->delay.tv_sec = msec/1000;
 	mon->delay.tv_usec = 1000*(msec-1000*mon->delay.tv_sec);
@@ -119,12 +406,12 @@ int mon_new(enum mon_type typ, unsigned char port, unsigned char offset, struct
 		case MON_SET_LOOP:
 		case MON_SET_ONCE:
 			_bus_write_bit(_port,_offset, 1);
-			mon->state = 1;
+			state = 1;
 			break;
 		case MON_CLEAR_LOOP:
 		case MON_CLEAR_ONCE:
 			_bus_write_bit(_port,_offset, 0);
-			mon->state = 0;
+			state = 0;
 			break;
 		default:
 			break;
@@ -132,11 +419,256 @@ int mon_new(enum mon_type typ, unsigned char port, unsigned char offset, struct
 		bus_sync();
 	}
 
+	if ((typ == MON_REPORT || typ == MON_REPORT_H || typ == MON_REPORT_L) && msec == 0 &&
+			watch_attach(mon, state) < 0) {
+		free(mon);
+		return -1;
+	}
+	if (tab_add(mon, mon_group(mon), state) < 0) {
+		if (mon->watch)
+			watch_detach(mon);
+		if (mon->timer)
+			event_free(mon->timer);
+		free(mon);
+		return -1;
+	}
+
 	mon->next = mon_list;
 	mon_list = mon;
+	if (typ > _MON_UNKNOWN_OUT)
+		ckpt_dirty();
 	if(debug)
 		printf("New Monitor %s:%d: %d:%d > %d:%d %d\n",
-			mon_typname(mon->mon.typ),mon->mon.id, port,offset, _port,_offset, mon->state);
+			mon_typname(mon->mon.typ),mon->mon.id, port,offset, _port,_offset, state);
+	return mon->mon.id;
+}
+
+/* evutil_timeradd() needs the BSD timeradd macro */
+static inline void tv_add(const struct timeval *a, const struct timeval *b, struct timeval *res)
+{
+	res->tv_sec = a->tv_sec + b->tv_sec;
+	res->tv_usec = a->tv_usec + b->tv_usec;
+	if (res->tv_usec >= 1000000) {
+		res->tv_usec -= 1000000;
+		res->tv_sec++;
+	}
+}
+
+static void seq_write(struct _mon_seq *seq)
+{
+	int i;
+
+	for(i = 0; i < seq->n_out; i++)
+		_bus_write_bit(seq->_port[i],seq->_offset[i], (seq->level >> i) & 1);
+}
+
+int mon_new_seq(struct bufferevent *buf, int n_out, const unsigned char *port, const unsigned char *offset,
+	int n_steps, const struct mon_seq_step *steps, unsigned int repeat)
+{
+	struct _mon_priv *mon;
+	struct _mon_seq *seq;
+	int i;
+
+	if (n_out < 1 || n_out > MON_SEQ_OUTS || n_steps < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+	for(i = 0; i < n_steps; i++) {
+		if (steps[i].msec == 0 || (steps[i].level >> n_out)) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+	seq = malloc(sizeof(*seq) + n_steps*sizeof(*steps));
+	if (seq == NULL)
+		return -1;
+	memset(seq,0,sizeof(*seq));
+	for(i = 0; i < n_out; i++) {
+		seq->port[i] = port[i];
+		seq->offset[i] = offset[i];
+		seq->_port[i] = port[i];
+		seq->_offset[i] = offset[i];
+		if (bus_is_write_bit(&seq->_port[i],&seq->_offset[i]) < 0) {
+			free(seq);
+			return -1;
+		}
+	}
+	memcpy(seq->steps, steps, n_steps*sizeof(*steps));
+	seq->n_out = n_out;
+	seq->n_steps = n_steps;
+	seq->repeat = repeat;
+
+	mon = malloc(sizeof(*mon));
+	if (mon == NULL) {
+		free(seq);
+		return -1;
+	}
+	memset(mon,0,sizeof(*mon));
+	mon->mon.id = ++last_mon_id;
+	mon->mon.typ = MON_SEQUENCE;
+	mon->mon.port = port[0];
+	mon->mon.offset = offset[0];
+	mon->_port = seq->_port[0];
+	mon->_offset = seq->_offset[0];
+	mon->buf = buf;
+	mon->seq = seq;
+	if (tab_add(mon, MG_SEQ, steps[0].level & 1) < 0) {
+		free(seq);
+		free(mon);
+		return -1;
+	}
+
+	/* the first step starts now */
+	event_base_gettimeofday_cached(base, &mon->last);
+	mon->delay.tv_sec = steps[0].msec/1000;
+	mon->delay.tv_usec = 1000*(steps[0].msec%1000);
+	tv_add(&mon->last, &mon->delay, &seq->next);
+	seq->level = steps[0].level;
+	seq_write(seq);
+	bus_sync();
+
+	mon->next = mon_list;
+	mon_list = mon;
+	ckpt_dirty();
+	return mon->mon.id;
+}
+
+int mon_new_freq(unsigned char port, unsigned char offset, struct bufferevent *buf,
+	unsigned int window, unsigned int period, float delta)
+{
+	struct _mon_priv *mon;
+	struct _mon_freq *freq;
+	unsigned short _port = port;
+	unsigned short _offset = offset;
+
+	if (window == 0 || delta < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (bus_is_read_bit(&_port,&_offset) < 0)
+		return -1;
+
+	freq = malloc(sizeof(*freq));
+	if (freq == NULL)
+		return -1;
+	memset(freq,0,sizeof(*freq));
+	freq->window = window*1000ULL;
+	freq->delta = delta;
+
+	mon = malloc(sizeof(*mon));
+	if (mon == NULL) {
+		free(freq);
+		return -1;
+	}
+	memset(mon,0,sizeof(*mon));
+	mon->mon.id = ++last_mon_id;
+	mon->mon.typ = MON_FREQ;
+	mon->mon.port = port;
+	mon->_port = _port;
+	mon->mon.offset = offset;
+	mon->_offset = _offset;
+	mon->buf = buf;
+	mon->freq = freq;
+	if (tab_add(mon, MG_FREQ, _bus_read_bit(_port,_offset)) < 0) {
+		free(freq);
+		free(mon);
+		return -1;
+	}
+
+	if (period) {
+		mon->delay.tv_sec = period/1000;
+		mon->delay.tv_usec = 1000*(period%1000);
+		mon->timer = event_new(base, -1, EV_TIMEOUT|EV_PERSIST, freq_cb, mon);
+		if(mon->timer == NULL || event_add(mon->timer, &mon->delay)) {
+			if(mon->timer) event_free(mon->timer);
+			tab_del(MG_FREQ, mon->idx);
+			free(freq);
+			free(mon);
+			return -1;
+		}
+	}
+	event_base_gettimeofday_cached(base, &mon->last);
+
+	mon->next = mon_list;
+	mon_list = mon;
+	return mon->mon.id;
+}
+
+int mon_new_analog(enum mon_type typ, unsigned char port, unsigned char chan, struct bufferevent *buf,
+	int64_t a, int64_t b, unsigned int period)
+{
+	struct _mon_priv *mon;
+	struct _mon_analog *ana;
+	unsigned short _port = port, wport = port;
+	enum bus_enc enc,wenc;
+
+	switch(typ) {
+	case MON_ANALOG_DELTA:
+		if (a < 0)
+			goto inval;
+		break;
+	case MON_ANALOG_LEVEL:
+		if (b > a)
+			goto inval;
+		break;
+	case MON_ANALOG_STATS:
+		if (period == 0)
+			goto inval;
+		break;
+	default:
+	inval:
+		errno = EINVAL;
+		return -1;
+	}
+	if (bus_is_read_word(&_port,chan,&enc) < 0)
+		return -1;
+
+	ana = malloc(sizeof(*ana));
+	if (ana == NULL)
+		return -1;
+	memset(ana,0,sizeof(*ana));
+	ana->enc = enc;
+	ana->output = (bus_is_write_word(&wport,chan,&wenc) == 0);
+	ana->a = a;
+	ana->b = b;
+	ana->value = _bus_read_word(_port, enc, ana->output);
+	ana->reported = ana->value;
+
+	mon = malloc(sizeof(*mon));
+	if (mon == NULL) {
+		free(ana);
+		return -1;
+	}
+	memset(mon,0,sizeof(*mon));
+	mon->mon.id = ++last_mon_id;
+	mon->mon.typ = typ;
+	mon->mon.port = port;
+	mon->_port = _port;
+	mon->mon.offset = chan;
+	mon->buf = buf;
+	mon->ana = ana;
+	if (tab_add(mon, MG_ANALOG, typ == MON_ANALOG_LEVEL && ana->value >= a) < 0) {
+		free(ana);
+		free(mon);
+		return -1;
+	}
+
+	if (typ == MON_ANALOG_STATS) {
+		mon->delay.tv_sec = period/1000;
+		mon->delay.tv_usec = 1000*(period%1000);
+		mon->timer = event_new(base, -1, EV_TIMEOUT|EV_PERSIST, analog_cb, mon);
+		if(mon->timer == NULL || event_add(mon->timer, &mon->delay)) {
+			if(mon->timer) event_free(mon->timer);
+			tab_del(MG_ANALOG, mon->idx);
+			free(ana);
+			free(mon);
+			return -1;
+		}
+	}
+	event_base_gettimeofday_cached(base, &mon->last);
+
+	mon->next = mon_list;
+	mon_list = mon;
 	return mon->mon.id;
 }
 
@@ -149,10 +681,75 @@ static void mon_free(struct _mon_priv *mon, struct bufferevent *buf)
 	}
 	if(out)
 		evbuffer_add_printf(out, "!-%d Deleted.\n", mon->mon.id);
+	if (mon->mon.typ > _MON_UNKNOWN_OUT)
+		ckpt_dirty();
 
+	tab_del(mon->group, mon->idx);
+	if (mon->watch)
+		watch_detach(mon);
+	if (mon->seq)
+		free(mon->seq);
+	if (mon->freq)
+		free(mon->freq);
+	if (mon->ana)
+		free(mon->ana);
+	if (mon->filt)
+		free(mon->filt);
 	free(mon);
 }
 
+int mon_filter(int id, unsigned int debounce, unsigned int holdoff, unsigned int k)
+{
+	struct _mon_priv *mon;
+	struct _mon_filt *filt;
+
+	for(mon = mon_list; mon; mon = mon->next)
+		if (mon->mon.id == id)
+			break;
+	if (mon == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+	if (mon->mon.typ < MON_REPORT || mon->mon.typ > MON_COUNT_L ||
+			debounce > 65535 || holdoff > 65535 || k > 31) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (k < 2 && debounce == 0 && holdoff == 0) {
+		filt = NULL;
+	} else {
+		filt = mon->filt ? mon->filt : malloc(sizeof(*filt));
+		if (filt == NULL)
+			return -1;
+	}
+
+	/* A watched monitor takes the watcher's state along. */
+	if (mon->watch)
+		mon_state(mon) = mon->watch->state;
+	if (tab_move(mon, filt ? MG_FILT : MG_IN) < 0) {
+		if (filt != mon->filt)
+			free(filt);
+		return -1;
+	}
+	if (mon->watch)
+		watch_detach(mon);
+	if (filt == NULL) {
+		if (mon->filt)
+			free(mon->filt);
+		mon->filt = NULL;
+		return 0;
+	}
+	mon->filt = filt;
+	memset(filt,0,sizeof(*filt));
+	filt->debounce = debounce;
+	filt->holdoff = holdoff;
+	filt->k = (k < 2) ? 1 : k;
+	filt->raw = mon_state(mon);
+	if (filt->raw)
+		filt->hist = (1U << filt->k)-1;
+	return 0;
+}
+
 int mon_grab(int id, struct bufferevent *buf)
 {
 	struct _mon_priv *mon = mon_list;
@@ -205,6 +802,7 @@ void mon_delbuf(struct bufferevent *buf)
 			case MON_SET_LOOP:
 			case MON_CLEAR_ONCE:
 			case MON_CLEAR_LOOP:
+			case MON_SEQUENCE:
 				break;
 			default:
 				*pmon = mon->next;
@@ -251,6 +849,14 @@ const char *mon_typname(enum mon_type typ)
 		return "count changes h";
 	case MON_COUNT_L:
 		return "count changes l";
+	case MON_FREQ:
+		return "frequency";
+	case MON_ANALOG_DELTA:
+		return "analog change";
+	case MON_ANALOG_LEVEL:
+		return "analog level";
+	case MON_ANALOG_STATS:
+		return "analog stats";
 
 	/* write ports */
 	case MON_SET_ONCE:
@@ -261,6 +867,8 @@ const char *mon_typname(enum mon_type typ)
 		return "timed clear";
 	case MON_CLEAR_LOOP:
 		return "PWM, off";
+	case MON_SEQUENCE:
+		return "sequence";
 	default:
 		return "???";
 	}
@@ -270,12 +878,33 @@ static void
 counter_cb(evutil_socket_t sig, short events, void *user_data)
 {
 	struct _mon_priv *mon = (struct _mon_priv *)user_data;
-	struct evbuffer *out = outbuf(mon);
 
 	event_free(mon->timer);
 	mon->timer = NULL;
-	if(out)
-		evbuffer_add_printf(out, "!%d %ld\n", mon->mon.id, mon->count);
+	mon_signal(mon, "%ld", mon->count);
+}
+
+/* End of a report monitor's minimum interval: send one report for the
+   changes that were held back, if any, and start the next interval. */
+static void
+report_cb(evutil_socket_t sig, short events, void *user_data)
+{
+	struct _mon_priv *mon = (struct _mon_priv *)user_data;
+	char st;
+
+	if (mon->count == 0) {
+		event_free(mon->timer);
+		mon->timer = NULL;
+		return;
+	}
+	if (mon->mon.typ == MON_REPORT)
+		st = mon_state(mon) ? 'H' : 'L';
+	else
+		st = (mon->mon.typ == MON_REPORT_H) ? 'H' : 'L';
+	mon_signal(mon, "%c +%ld", st, mon->count);
+	mon->count = 0;
+	event_add(mon->timer, &mon->delay);
+	event_base_gettimeofday_cached(base, &mon->last);
 }
 
 static void
@@ -284,16 +913,14 @@ once_cb(evutil_socket_t sig, short events, void *user_data)
 	struct _mon_priv *mon = (struct _mon_priv *)user_data;
 	struct evbuffer *out = outbuf(mon);
 
-	if(debug)
-		printf("monitor %d triggers\n", mon->mon.id);
+	trace(TR_MON_FIRE, mon->mon.port,mon->mon.offset, mon->mon.id);
 	if (
 #ifdef DEMO
 		(demo_state_skip) ||
 #endif
-		(_bus_read_wbit(mon->_port,mon->_offset) == mon->state)) {
-		_bus_write_bit(mon->_port,mon->_offset, !mon->state);
-		if(out)
-			evbuffer_add_printf(out, "!%d TRIGGER\n", mon->mon.id);
+		(_bus_read_wbit(mon->_port,mon->_offset) == mon_state(mon))) {
+		_bus_write_bit(mon->_port,mon->_offset, !mon_state(mon));
+		mon_signal(mon, "TRIGGER");
 		bus_sync();
 	} else {
 		if(out)
@@ -313,19 +940,17 @@ loop_cb(evutil_socket_t sig, short events, void *user_data)
 	struct evbuffer *out = outbuf(mon);
 	struct timeval tv;
 
-	if(_bus_read_wbit(mon->_port,mon->_offset) == mon->state) {
+	if(_bus_read_wbit(mon->_port,mon->_offset) == mon_state(mon)) {
 		if(mon->mon.typ == MON_CLEAR_LOOP) {
 			mon->mon.typ = MON_SET_LOOP;
-			mon->state = 1;
+			mon_state(mon) = 1;
 		} else {
 			mon->mon.typ = MON_CLEAR_LOOP;
-			mon->state = 0;
+			mon_state(mon) = 0;
 		}
-		_bus_write_bit(mon->_port,mon->_offset, mon->state);
-	
-		if(debug)
-			printf("monitor %d toggles: %c\n", mon->mon.id, mon->state ? 'H' : 'L');
-	
+		_bus_write_bit(mon->_port,mon->_offset, mon_state(mon));
+		trace(TR_MON_TOGGLE, mon->mon.port,mon->mon.offset, mon->mon.id);
+
 		tv = mon->delay;
 		mon->delay = mon->delay2;
 		mon->delay2 = tv;
@@ -335,8 +960,7 @@ loop_cb(evutil_socket_t sig, short events, void *user_data)
 		event_free(mon->timer);
 		mon->timer = NULL;
 
-		if(debug)
-			printf("monitor %d: ext change: %c\n", mon->mon.id, mon->state ? 'H' : 'L');
+		trace(TR_MON_DROP, mon->mon.port,mon->mon.offset, mon->mon.id);
 		if(out)
 			evbuffer_add_printf(out, "!-%d DROP: saw external change in timer\n", mon->mon.id);
 
@@ -363,93 +987,421 @@ keepalive_cb(evutil_socket_t sig, short events, void *user_data)
 	}
 }
 
-/* check monitor state */
-void mon_sync(void)
+static inline uint64_t tv_usec(const struct timeval *tv)
 {
-	struct _mon_priv *mon,*mon2;
+	return tv->tv_sec*1000000ULL + tv->tv_usec;
+}
 
-	for(mon = mon_list; mon; mon = mon2) {
-		unsigned char state;
-		struct evbuffer *out = outbuf(mon);
+/* Run the raw input state through the monitor's filter.
+   Returns the filtered state. */
+static unsigned char filt_sync(struct _mon_priv *mon, unsigned char state, uint64_t now)
+{
+	struct _mon_filt *filt = mon->filt;
 
-		mon2 = mon->next;
+	filt->hist = (filt->hist << 1) | !!state;
+	if (filt->k > 1) {
+		filt->hist &= (1U << filt->k)-1;
+		state = 2*__builtin_popcount(filt->hist) > filt->k;
+	}
+	if (!state != !filt->raw) {
+		filt->raw = state;
+		filt->since = now;
+	}
+	if (!state == !mon_state(mon))
+		return state;
+	if (now - filt->since < filt->debounce*1000ULL)
+		return mon_state(mon);
+	if (now - filt->edge < filt->holdoff*1000ULL)
+		return mon_state(mon);
+	filt->edge = now;
+	return state;
+}
+
+/* Frequency within the window, in Hz. If the input has been quiet for
+   longer than the average period, the open period counts instead, so
+   that the value decays when the signal stops. */
+static float freq_hz(struct _mon_freq *freq, uint64_t now)
+{
+	unsigned int n = freq->head - freq->first;
+	uint64_t newest,span,open;
+
+	if (n < 2)
+		return 0;
+	newest = freq->edge[(freq->head-1) % MON_FREQ_EDGES];
+	span = newest - freq->edge[freq->first % MON_FREQ_EDGES];
+	if (span == 0)
+		return 0;
+	open = now - newest;
+	if (open*(n-1) > span)
+		return 1000000.0/open;
+	return 1000000.0*(n-1)/span;
+}
+
+/* "!ID FREQ PERIOD MIN MAX HIGH LOW": Hz, then msec */
+static void freq_report(struct _mon_priv *mon, uint64_t now)
+{
+	struct _mon_freq *freq = mon->freq;
+	uint32_t period = 0, pmin = 0, pmax = 0;
+	unsigned int i;
+
+	/* i != head would run 4G times on an empty ring */
+	for(i = freq->first+1; i - freq->first < freq->head - freq->first; i++) {
+		uint32_t p = freq->edge[i % MON_FREQ_EDGES] - freq->edge[(i-1) % MON_FREQ_EDGES];
+		if (pmin == 0 || p < pmin)
+			pmin = p;
+		if (p > pmax)
+			pmax = p;
+		period = p;
+	}
+	freq->reported = freq_hz(freq, now);
+	mon_signal(mon, "%.3f %.3f %.3f %.3f %.3f %.3f", freq->reported,
+		period/1000.0, pmin/1000.0, pmax/1000.0, freq->t_high/1000.0, freq->t_low/1000.0);
+}
+
+static void
+freq_cb(evutil_socket_t sig, short events, void *user_data)
+{
+	struct _mon_priv *mon = (struct _mon_priv *)user_data;
+	struct timeval now;
+
+	event_base_gettimeofday_cached(base, &now);
+	freq_report(mon, tv_usec(&now));
+}
+
+/* Record an edge at the cycle's timestamp, expire old ones, and check
+   the report threshold. */
+static void freq_sync(struct _mon_priv *mon, struct timeval *tv)
+{
+	struct _mon_freq *freq = mon->freq;
+	uint64_t now = tv_usec(tv);
+	unsigned char state;
+	float f;
+
+	state = _bus_read_bit(mon->_port,mon->_offset);
+	if(!state != !mon_state(mon)) {
+		mon_state(mon) = state;
+		trace(TR_MON_COUNT, mon->mon.port,mon->mon.offset, mon->mon.id);
+		if (state) {
+			if (freq->last_fall)
+				freq->t_low = now - freq->last_fall;
+			freq->last_rise = now;
+			if (freq->head - freq->first == MON_FREQ_EDGES)
+				freq->first++;
+			freq->edge[freq->head++ % MON_FREQ_EDGES] = now;
+		} else {
+			if (freq->last_rise)
+				freq->t_high = now - freq->last_rise;
+			freq->last_fall = now;
+		}
+	}
+	while(freq->first != freq->head && freq->edge[freq->first % MON_FREQ_EDGES] + freq->window < now)
+		freq->first++;
+
+	if (freq->delta > 0) {
+		f = freq_hz(freq, now) - freq->reported;
+		if (f > freq->delta || f < -freq->delta)
+			freq_report(mon, now);
+	}
+}
+
+/* "!ID MIN MAX MEAN N" for the samples since the last report */
+static void
+analog_cb(evutil_socket_t sig, short events, void *user_data)
+{
+	struct _mon_priv *mon = (struct _mon_priv *)user_data;
+	struct _mon_analog *ana = mon->ana;
+
+	event_base_gettimeofday_cached(base, &mon->last);
+	if (ana->n == 0)
+		return;
+	trace(TR_MON_COUNT, mon->mon.port,mon->mon.offset, mon->mon.id);
+	mon_signal(mon, "%lld %lld %.3f %u", (long long)ana->min, (long long)ana->max,
+		(double)ana->sum/ana->n, ana->n);
+	ana->n = 0;
+	ana->sum = 0;
+}
+
+/* Sample an analog channel from the process image. */
+static void analog_sync(struct _mon_priv *mon)
+{
+	struct _mon_analog *ana = mon->ana;
+	int64_t v = _bus_read_word(mon->_port, ana->enc, ana->output);
+
+	ana->value = v;
+	switch(mon->mon.typ) {
+	case MON_ANALOG_DELTA:
+		if (v - ana->reported > ana->a || ana->reported - v > ana->a) {
+			ana->reported = v;
+			trace(TR_MON_COUNT, mon->mon.port,mon->mon.offset, mon->mon.id);
+			mon_signal(mon, "%lld", (long long)v);
+		}
+		break;
+	case MON_ANALOG_LEVEL:
+		if (!mon_state(mon) && v >= ana->a) {
+			mon_state(mon) = 1;
+			trace(TR_MON_H, mon->mon.port,mon->mon.offset, mon->mon.id);
+			mon_signal(mon, "H %lld", (long long)v);
+		} else if (mon_state(mon) && v <= ana->b) {
+			mon_state(mon) = 0;
+			trace(TR_MON_L, mon->mon.port,mon->mon.offset, mon->mon.id);
+			mon_signal(mon, "L %lld", (long long)v);
+		}
+		break;
+	case MON_ANALOG_STATS:
+		if (ana->n == 0 || v < ana->min)
+			ana->min = v;
+		if (ana->n == 0 || v > ana->max)
+			ana->max = v;
+		ana->sum += v;
+		ana->n++;
+		break;
+	default:
+		break;
+	}
+}
+
+/* Advance a sequence whose step has run out.
+   Returns 1 if the sequence is finished or has been dropped. */
+static int seq_sync(struct _mon_priv *mon, struct timeval *now)
+{
+	struct _mon_seq *seq = mon->seq;
+	struct evbuffer *out = outbuf(mon);
+	int i;
 
-		if (mon->mon.typ > _MON_UNKNOWN_OUT) {
 #ifdef DEMO
-			if (demo_state_skip)
-				continue;
+	if (!demo_state_skip)
 #endif
-			state = _bus_read_wbit(mon->_port,mon->_offset);
-		} else
-			state = _bus_read_bit(mon->_port,mon->_offset);
-		if(!state == !mon->state)
-			continue;
-
-		mon->state = state;
-		switch(mon->mon.typ) {
-		/* Outputs: if the output has been changed externally, die. */
-		case MON_SET_ONCE:
-		case MON_SET_LOOP:
-			_bus_write_bit(mon->_port,mon->_offset, 0);
-			goto clear_common;
-		case MON_CLEAR_ONCE:
-		case MON_CLEAR_LOOP:
-			_bus_write_bit(mon->_port,mon->_offset, 1);
-		clear_common:
-			if(debug)
-				printf("Mon%d: dropped, found %c\n", mon->mon.id, state?'H':'L');
+	for(i = 0; i < seq->n_out; i++) {
+		if (_bus_read_wbit(seq->_port[i],seq->_offset[i]) != ((seq->level >> i) & 1)) {
+			trace(TR_MON_DROP, mon->mon.port,mon->mon.offset, mon->mon.id);
 			if(out)
-				evbuffer_add_printf(out, "!-%d DROP %c: saw external change in loop\n", mon->mon.id, state?'H':'L');
+				evbuffer_add_printf(out, "!-%d DROP: saw external change in sequence\n", mon->mon.id);
 			mon->buf = NULL;
 			mon_del(mon->mon.id, NULL);
-			break;
-			
-		/* Inputs: change reporting */
-		case MON_REPORT:
-		mon_report:
-			if(debug)
-				printf("Mon%d: %c\n", mon->mon.id, state?'H':'L');
-			if(out)
-				evbuffer_add_printf(out, "!%d %c\n", mon->mon.id, state?'H':'L');
-			break;
-		case MON_REPORT_H:
-			if(!state) continue;
-			goto mon_report;
-		case MON_REPORT_L:
-			if(state) continue;
-			goto mon_report;
-
-		/* Inputs: change counting */
-		case MON_COUNT:
-		mon_count:
-			mon->count++;
-			if (mon->timer == NULL) {
-				if(debug)
-					printf("Mon%d: %ld %ld.%06lu\n", mon->mon.id, mon->count, mon->delay.tv_sec,mon->delay.tv_usec);
-				mon->timer = event_new(base, -1, EV_TIMEOUT, counter_cb, mon);
-				if(mon->timer == NULL || event_add(mon->timer, &mon->delay)) {
-					if(out) {
-						evbuffer_add_printf(out, "!%d %ld\n", mon->mon.id, mon->count);
-						evbuffer_add_printf(out, "* Monitor timeout: error: %s\n", strerror(errno));
-					}
-				}
-				event_base_gettimeofday_cached(base, &mon->last);
-			} else {
-				if(debug)
-					printf("Mon%d: %ld\n", mon->mon.id, mon->count);
+			return 1;
+		}
+	}
+
+	if (evutil_timercmp(now, &seq->next, <))
+		return 0;
+
+	/* Catch up if we're more than one step late, but the cycle time
+	   should be much shorter than that anyway. */
+	while(!evutil_timercmp(now, &seq->next, <)) {
+		if (++seq->step == seq->n_steps) {
+			seq->step = 0;
+			if (seq->repeat && ++seq->loop == seq->repeat) {
+				trace(TR_MON_FIRE, mon->mon.port,mon->mon.offset, mon->mon.id);
+				mon_signal(mon, "DONE");
+				mon_del(mon->mon.id, NULL);
+				return 1;
 			}
+		}
+		mon->last = seq->next;
+		mon->delay.tv_sec = seq->steps[seq->step].msec/1000;
+		mon->delay.tv_usec = 1000*(seq->steps[seq->step].msec%1000);
+		tv_add(&mon->last, &mon->delay, &seq->next);
+	}
+	if (seq->level != seq->steps[seq->step].level) {
+		seq->level = seq->steps[seq->step].level;
+		seq_write(seq);
+		trace(TR_MON_TOGGLE, mon->mon.port,mon->mon.offset, mon->mon.id);
+	}
+	return 0;
+}
+
+/* Someone else has changed a monitored output: die. */
+static void mon_output(struct _mon_priv *mon, unsigned char state)
+{
+	struct evbuffer *out = outbuf(mon);
+
+	switch(mon->mon.typ) {
+	case MON_SET_ONCE:
+	case MON_SET_LOOP:
+		_bus_write_bit(mon->_port,mon->_offset, 0);
+		break;
+	case MON_CLEAR_ONCE:
+	case MON_CLEAR_LOOP:
+		_bus_write_bit(mon->_port,mon->_offset, 1);
+		break;
+	default:
+		return;
+	}
+	trace(TR_MON_DROP, mon->mon.port,mon->mon.offset, mon->mon.id);
+	if(out)
+		evbuffer_add_printf(out, "!-%d DROP %c: saw external change in loop\n", mon->mon.id, state?'H':'L');
+	mon->buf = NULL;
+	mon_del(mon->mon.id, NULL);
+}
+
+/* An input has changed: report or count it. */
+static void mon_input(struct _mon_priv *mon, unsigned char state)
+{
+	struct evbuffer *out = outbuf(mon);
+
+	switch(mon->mon.typ) {
+	/* change reporting */
+	case MON_REPORT:
+	mon_report:
+		trace(state ? TR_MON_H : TR_MON_L, mon->mon.port,mon->mon.offset, mon->mon.id);
+		if (mon->timer) {
+			/* within the minimum interval: coalesce */
+			mon->count++;
 			break;
-		case MON_COUNT_H:
-			if(!state) continue;
-			goto mon_count;
-		case MON_COUNT_L:
-			if(state) continue;
-			goto mon_count;
+		}
+		mon_signal(mon, "%c", state?'H':'L');
+		if (mon->delay.tv_sec || mon->delay.tv_usec) {
+			mon->timer = event_new(base, -1, EV_TIMEOUT, report_cb, mon);
+			if(mon->timer && event_add(mon->timer, &mon->delay)) {
+				event_free(mon->timer);
+				mon->timer = NULL;
+			}
+			event_base_gettimeofday_cached(base, &mon->last);
+		}
+		break;
+	case MON_REPORT_H:
+		if(!state) break;
+		goto mon_report;
+	case MON_REPORT_L:
+		if(state) break;
+		goto mon_report;
 
-		default:
-			continue;
+	/* change counting */
+	case MON_COUNT:
+	mon_count:
+		mon->count++;
+		trace(TR_MON_COUNT, mon->mon.port,mon->mon.offset, mon->mon.id);
+		if (mon->timer == NULL) {
+			mon->timer = event_new(base, -1, EV_TIMEOUT, counter_cb, mon);
+			if(mon->timer == NULL || event_add(mon->timer, &mon->delay)) {
+				mon_signal(mon, "%ld", mon->count);
+				if(out)
+					evbuffer_add_printf(out, "* Monitor timeout: error: %s\n", strerror(errno));
+			}
+			event_base_gettimeofday_cached(base, &mon->last);
 		}
+		break;
+	case MON_COUNT_H:
+		if(!state) break;
+		goto mon_count;
+	case MON_COUNT_L:
+		if(state) break;
+		goto mon_count;
+
+	default:
+		break;
+	}
+}
+
+/* check monitor state */
+void mon_sync(void)
+{
+	struct _mon_watch *w;
+	struct mon_tab *t;
+	struct timeval now;
+	unsigned char state;
+	unsigned int i;
+	int changed = 0;
+
+	event_base_gettimeofday_cached(base, &now);
+	for(w = watch_list; w; w = w->next) {
+		state = _bus_read_bit(w->_port,w->_offset);
+
+		if(!state == !w->state)
+			continue;
+		w->state = state;
+		if ((w->typ == MON_REPORT_H && !state) || (w->typ == MON_REPORT_L && state))
+			continue;
+		trace(state ? TR_MON_H : TR_MON_L, w->port,w->offset, w->subs->mon.id);
+		watch_signal(w, "%c", state?'H':'L');
+	}
+
+	/* The tables are walked backwards: when a monitor is deleted, the
+	   one moved into its place has been done already. */
+#ifdef DEMO
+	if (!demo_state_skip)
+#endif
+	for(t = &mon_tab[MG_OUT], i = t->n; i--; ) {
+		state = _bus_read_wbit(t->_port[i],t->_offset[i]);
+		if(!state == !t->state[i])
+			continue;
+		t->state[i] = state;
+		mon_output(t->mon[i], state);
+	}
+	for(t = &mon_tab[MG_IN], i = t->n; i--; ) {
+		state = _bus_read_bit(t->_port[i],t->_offset[i]);
+		if(!state == !t->state[i])
+			continue;
+		t->state[i] = state;
+		mon_input(t->mon[i], state);
+	}
+	for(t = &mon_tab[MG_FILT], i = t->n; i--; ) {
+		state = filt_sync(t->mon[i], _bus_read_bit(t->_port[i],t->_offset[i]), tv_usec(&now));
+		if(!state == !t->state[i])
+			continue;
+		t->state[i] = state;
+		mon_input(t->mon[i], state);
+	}
+	for(t = &mon_tab[MG_SEQ], i = t->n; i--; ) {
+		struct _mon_seq *seq = t->mon[i]->seq;
+		unsigned short level = seq->level;
+
+		if (seq_sync(t->mon[i], &now) == 0 && level != seq->level)
+			changed = 1;
+	}
+	for(t = &mon_tab[MG_FREQ], i = t->n; i--; )
+		freq_sync(t->mon[i], &now);
+	for(t = &mon_tab[MG_ANALOG], i = t->n; i--; )
+		analog_sync(t->mon[i]);
+
+	hist_sync(&now);
+	ckpt_sync(&now);
+	dlog_sync(&now);
+	pub_sync(&now);
+	if (sched_sync())
+		changed = 1;
+	if (rule_sync())
+		changed = 1;
+	if (changed)
+		bus_sync();
+}
+
+int mon_reload(void)
+{
+	struct _mon_priv *mon,*mon2;
+	struct evbuffer *out;
+	int i,kept,n = 0;
+
+	for(mon = mon_list; mon; mon = mon2) {
+		mon2 = mon->next;
+		if (mon->seq) {
+			kept = 1;
+			for(i = 0; i < mon->seq->n_out; i++)
+				if (!bus_bit_kept(mon->seq->_port[i],mon->seq->_offset[i], BUS_BITS_OUT))
+					kept = 0;
+		} else if (mon->ana) {
+			unsigned short _port = mon->mon.port;
+			enum bus_enc enc;
+			kept = bus_is_read_word(&_port,mon->mon.offset,&enc) == 0 &&
+				_port == mon->_port && enc == mon->ana->enc;
+		} else if (mon->mon.typ > _MON_UNKNOWN_OUT)
+			kept = bus_bit_kept(mon->_port,mon->_offset, BUS_BITS_OUT);
+		else if (mon->mon.typ > _MON_UNKNOWN_IN)
+			kept = bus_bit_kept(mon->_port,mon->_offset, BUS_BITS_IN);
+		else
+			kept = 1;
+		if (kept)
+			continue;
+
+		trace(TR_MON_DROP, mon->mon.port,mon->mon.offset, mon->mon.id);
+		out = outbuf(mon);
+		if(out)
+			evbuffer_add_printf(out, "!-%d DROP: slot changed by reload\n", mon->mon.id);
+		mon->buf = NULL;
+		mon_del(mon->mon.id, NULL);
+		n++;
 	}
+	return n;
 }
 
 const char *mon_detail(struct _mon *_mon)
@@ -467,6 +1419,27 @@ const char *mon_detail(struct _mon *_mon)
 		if(buf == NULL) return NULL;
 		sprintf(buf,"%ld",mon->count);
 		return buf;
+	case MON_FREQ:
+		buf = malloc(20);
+		if(buf == NULL) return NULL;
+		gettimeofday(&tv, NULL);
+		sprintf(buf,"%.3f",freq_hz(mon->freq, tv_usec(&tv)));
+		return buf;
+	case MON_ANALOG_DELTA:
+	case MON_ANALOG_LEVEL:
+	case MON_ANALOG_STATS:
+		buf = malloc(24);
+		if(buf == NULL) return NULL;
+		sprintf(buf,"%lld",(long long)mon->ana->value);
+		return buf;
+	case MON_SEQUENCE:
+		buf = malloc(40);
+		if(buf == NULL) return NULL;
+		if (mon->seq->repeat)
+			sprintf(buf,"%d/%d %d/%d",mon->seq->step+1,mon->seq->n_steps, mon->seq->loop+1,mon->seq->repeat);
+		else
+			sprintf(buf,"%d/%d",mon->seq->step+1,mon->seq->n_steps);
+		return buf;
 	case MON_SET_ONCE:
 	case MON_CLEAR_ONCE:
 	case MON_SET_LOOP:
@@ -494,3 +1467,483 @@ const char *mon_detail(struct _mon *_mon)
 	}
 }
 
+
+/* Monitor state in a handoff. Types are saved by name, so that the
+   enum may change between versions. Times are in usec. */
+struct mon_ho {
+	char typ[16]; /* mon_typname() */
+	uint32_t id;
+	int32_t conn; /* handoff_conn_id() */
+	uint16_t port,offset, _port,_offset;
+	uint8_t state, timer, filt, k;
+	uint32_t count;
+	int64_t last, delay, delay2;
+
+	/* input filter */
+	uint16_t debounce, holdoff;
+	uint32_t hist;
+	uint64_t since, edge;
+	uint8_t raw;
+	/* followed by struct mon_ho_seq and its steps, by struct mon_ho_freq
+	   and its edges, or by struct mon_ho_analog */
+};
+struct mon_ho_seq {
+	uint16_t n_out, n_steps, step, level;
+	uint32_t repeat, loop;
+	int64_t next;
+	uint16_t _port[MON_SEQ_OUTS], _offset[MON_SEQ_OUTS];
+	uint8_t port[MON_SEQ_OUTS], offset[MON_SEQ_OUTS];
+};
+struct mon_ho_freq {
+	uint64_t window, last_rise, last_fall;
+	uint32_t t_high, t_low, n_edges;
+	float delta, reported;
+};
+struct mon_ho_analog {
+	int64_t a, b, value, reported, min, max, sum;
+	uint32_t n;
+	uint8_t enc, output;
+};
+
+static inline int64_t tv_save(const struct timeval *tv)
+{
+	return tv->tv_sec*1000000LL + tv->tv_usec;
+}
+
+static inline void tv_load(struct timeval *tv, int64_t usec)
+{
+	tv->tv_sec = usec/1000000;
+	tv->tv_usec = usec%1000000;
+}
+
+static int mon_save_one(struct _mon_priv *mon)
+{
+	struct mon_ho h;
+	struct evbuffer *out;
+	size_t len = sizeof(h);
+
+	memset(&h,0,sizeof(h));
+	strncpy(h.typ, mon_typname(mon->mon.typ), sizeof(h.typ)-1);
+	h.id = mon->mon.id;
+	h.conn = handoff_conn_id(mon->buf);
+	h.port = mon->mon.port;
+	h.offset = mon->mon.offset;
+	h._port = mon->_port;
+	h._offset = mon->_offset;
+	h.state = mon->watch ? mon->watch->state : mon_state(mon);
+	h.timer = (mon->timer != NULL);
+	h.count = mon->count;
+	h.last = tv_save(&mon->last);
+	h.delay = tv_save(&mon->delay);
+	h.delay2 = tv_save(&mon->delay2);
+	if (mon->filt) {
+		h.filt = 1;
+		h.k = mon->filt->k;
+		h.raw = mon->filt->raw;
+		h.debounce = mon->filt->debounce;
+		h.holdoff = mon->filt->holdoff;
+		h.hist = mon->filt->hist;
+		h.since = mon->filt->since;
+		h.edge = mon->filt->edge;
+	}
+	if (mon->seq)
+		len += sizeof(struct mon_ho_seq) + mon->seq->n_steps*sizeof(struct mon_seq_step);
+	if (mon->freq)
+		len += sizeof(struct mon_ho_freq) + (mon->freq->head-mon->freq->first)*sizeof(uint64_t);
+	if (mon->ana)
+		len += sizeof(struct mon_ho_analog);
+
+	out = handoff_rec(HO_MON, len);
+	if (out == NULL || evbuffer_add(out, &h, sizeof(h)) < 0)
+		return -1;
+	if (mon->seq) {
+		struct _mon_seq *seq = mon->seq;
+		struct mon_ho_seq hs;
+
+		memset(&hs,0,sizeof(hs));
+		hs.n_out = seq->n_out;
+		hs.n_steps = seq->n_steps;
+		hs.step = seq->step;
+		hs.level = seq->level;
+		hs.repeat = seq->repeat;
+		hs.loop = seq->loop;
+		hs.next = tv_save(&seq->next);
+		memcpy(hs._port, seq->_port, sizeof(hs._port));
+		memcpy(hs._offset, seq->_offset, sizeof(hs._offset));
+		memcpy(hs.port, seq->port, sizeof(hs.port));
+		memcpy(hs.offset, seq->offset, sizeof(hs.offset));
+		if (evbuffer_add(out, &hs, sizeof(hs)) < 0 ||
+				evbuffer_add(out, seq->steps, seq->n_steps*sizeof(struct mon_seq_step)) < 0)
+			return -1;
+	}
+	if (mon->freq) {
+		struct _mon_freq *freq = mon->freq;
+		struct mon_ho_freq hf;
+		unsigned int i;
+
+		memset(&hf,0,sizeof(hf));
+		hf.window = freq->window;
+		hf.last_rise = freq->last_rise;
+		hf.last_fall = freq->last_fall;
+		hf.t_high = freq->t_high;
+		hf.t_low = freq->t_low;
+		hf.n_edges = freq->head - freq->first;
+		hf.delta = freq->delta;
+		hf.reported = freq->reported;
+		if (evbuffer_add(out, &hf, sizeof(hf)) < 0)
+			return -1;
+		for(i = freq->first; i != freq->head; i++)
+			if (evbuffer_add(out, &freq->edge[i % MON_FREQ_EDGES], sizeof(uint64_t)) < 0)
+				return -1;
+	}
+	if (mon->ana) {
+		struct _mon_analog *ana = mon->ana;
+		struct mon_ho_analog ha;
+
+		memset(&ha,0,sizeof(ha));
+		ha.a = ana->a;
+		ha.b = ana->b;
+		ha.value = ana->value;
+		ha.reported = ana->reported;
+		ha.min = ana->min;
+		ha.max = ana->max;
+		ha.sum = ana->sum;
+		ha.n = ana->n;
+		ha.enc = ana->enc;
+		ha.output = ana->output;
+		if (evbuffer_add(out, &ha, sizeof(ha)) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* The list is saved oldest first, so that mon_restore() can simply
+   prepend each monitor and end up with the same order. */
+int mon_save(char outputs_only)
+{
+	struct _mon_priv *mon, **all;
+	int i,n = 0;
+
+	for(mon = mon_list; mon; mon = mon->next)
+		n++;
+	if (n == 0)
+		return 0;
+	all = malloc(n*sizeof(*all));
+	if (all == NULL)
+		return -1;
+	for(i = 0, mon = mon_list; mon; mon = mon->next)
+		if (!outputs_only || mon->mon.typ > _MON_UNKNOWN_OUT)
+			all[i++] = mon;
+	while(i--)
+		if (mon_save_one(all[i]) < 0)
+			break;
+	free(all);
+	return (i < 0) ? 0 : -1;
+}
+
+/* After a restart, the PWM phase has moved on: skip whole periods,
+   then flip until the current phase's end is in the future. */
+static void loop_catchup(struct mon_ho *h, enum mon_type *typ, int64_t now)
+{
+	int64_t period = h->delay + h->delay2;
+	int64_t d;
+
+	if (period <= 0 || h->last + h->delay > now)
+		return;
+	h->last += (now - h->last) / period * period;
+	while(h->last + h->delay <= now) {
+		h->last += h->delay;
+		d = h->delay;
+		h->delay = h->delay2;
+		h->delay2 = d;
+		*typ = (*typ == MON_SET_LOOP) ? MON_CLEAR_LOOP : MON_SET_LOOP;
+		h->state = !h->state;
+	}
+}
+
+int mon_restore(const void *data, size_t len, enum mon_restore_mode mode)
+{
+	const unsigned char *p = data;
+	struct _mon_priv *mon;
+	struct mon_ho h;
+	struct timeval now,tv;
+	event_callback_fn cb = NULL;
+	short flags = EV_TIMEOUT;
+	enum mon_type typ;
+	unsigned short _port,_offset;
+	enum bus_enc enc = BUS_ENC_BIT;
+	char added = 0;
+	int64_t rem;
+	int i;
+
+	if (len < sizeof(h)) {
+		errno = EINVAL;
+		return -1;
+	}
+	memcpy(&h, p, sizeof(h));
+	p += sizeof(h);
+	len -= sizeof(h);
+	for(typ = MON_UNKNOWN+1; typ < _MON_MAX; typ++)
+		if (!strncmp(h.typ, mon_typname(typ), sizeof(h.typ)))
+			break;
+	if (typ == _MON_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	event_base_gettimeofday_cached(base, &now);
+	if (typ == MON_SET_LOOP || typ == MON_CLEAR_LOOP)
+		loop_catchup(&h, &typ, tv_save(&now));
+
+	/* The bus configuration may not have changed. */
+	_port = h.port;
+	_offset = h.offset;
+	if (typ > _MON_UNKNOWN_OUT) {
+		if (bus_is_write_bit(&_port,&_offset) < 0)
+			return -1;
+	} else if (typ >= MON_ANALOG_DELTA && typ <= MON_ANALOG_STATS) {
+		if (bus_is_read_word(&_port,h.offset,&enc) < 0)
+			return -1;
+		_offset = h._offset; /* the channel is in h.offset */
+	} else if (typ > _MON_UNKNOWN_IN) {
+		if (bus_is_read_bit(&_port,&_offset) < 0)
+			return -1;
+	}
+	if (typ > _MON_UNKNOWN_IN && (_port != h._port || _offset != h._offset)) {
+		errno = ENODEV;
+		return -1;
+	}
+
+	mon = malloc(sizeof(*mon));
+	if (mon == NULL)
+		return -1;
+	memset(mon,0,sizeof(*mon));
+	mon->mon.id = h.id;
+	mon->mon.typ = typ;
+	mon->mon.port = h.port;
+	mon->mon.offset = h.offset;
+	mon->_port = h._port;
+	mon->_offset = h._offset;
+	mon->count = h.count;
+	mon->buf = (mode == MON_RESTORE_HANDOFF) ? handoff_conn_bev(h.conn) : NULL;
+	tv_load(&mon->last, h.last);
+	tv_load(&mon->delay, h.delay);
+	tv_load(&mon->delay2, h.delay2);
+
+	if (typ == MON_SEQUENCE) {
+		struct mon_ho_seq hs;
+		struct _mon_seq *seq;
+
+		if (len < sizeof(hs))
+			goto inval;
+		memcpy(&hs, p, sizeof(hs));
+		p += sizeof(hs);
+		len -= sizeof(hs);
+		if (hs.n_out < 1 || hs.n_out > MON_SEQ_OUTS || hs.n_steps < 1 || hs.step >= hs.n_steps ||
+				len != hs.n_steps*sizeof(struct mon_seq_step) || (hs.level >> hs.n_out) ||
+				hs.port[0] != h.port || hs.offset[0] != h.offset)
+			goto inval;
+		seq = malloc(sizeof(*seq) + len);
+		if (seq == NULL)
+			goto err;
+		memset(seq,0,sizeof(*seq));
+		memcpy(seq->steps, p, len);
+		/* as in mon_new_seq(), and every output must still be where it was */
+		for(i = 0; i < hs.n_steps; i++)
+			if (seq->steps[i].msec == 0 || (seq->steps[i].level >> hs.n_out)) {
+				free(seq);
+				goto inval;
+			}
+		for(i = 0; i < hs.n_out; i++) {
+			_port = hs.port[i];
+			_offset = hs.offset[i];
+			if (bus_is_write_bit(&_port,&_offset) < 0) {
+				free(seq);
+				goto err;
+			}
+			if (_port != hs._port[i] || _offset != hs._offset[i]) {
+				free(seq);
+				errno = ENODEV;
+				goto err;
+			}
+		}
+		seq->n_out = hs.n_out;
+		seq->n_steps = hs.n_steps;
+		seq->step = hs.step;
+		seq->level = hs.level;
+		seq->repeat = hs.repeat;
+		seq->loop = hs.loop;
+		tv_load(&seq->next, hs.next);
+		memcpy(seq->_port, hs._port, sizeof(seq->_port));
+		memcpy(seq->_offset, hs._offset, sizeof(seq->_offset));
+		memcpy(seq->port, hs.port, sizeof(seq->port));
+		memcpy(seq->offset, hs.offset, sizeof(seq->offset));
+		mon->seq = seq;
+	} else if (typ == MON_FREQ) {
+		struct mon_ho_freq hf;
+		struct _mon_freq *freq;
+
+		if (len < sizeof(hf))
+			goto inval;
+		memcpy(&hf, p, sizeof(hf));
+		p += sizeof(hf);
+		len -= sizeof(hf);
+		if (hf.n_edges > MON_FREQ_EDGES || len != hf.n_edges*sizeof(uint64_t))
+			goto inval;
+		freq = malloc(sizeof(*freq));
+		if (freq == NULL)
+			goto err;
+		memset(freq,0,sizeof(*freq));
+		freq->window = hf.window;
+		freq->last_rise = hf.last_rise;
+		freq->last_fall = hf.last_fall;
+		freq->t_high = hf.t_high;
+		freq->t_low = hf.t_low;
+		freq->delta = hf.delta;
+		freq->reported = hf.reported;
+		memcpy(freq->edge, p, len);
+		freq->head = hf.n_edges;
+		mon->freq = freq;
+	} else if (typ >= MON_ANALOG_DELTA && typ <= MON_ANALOG_STATS) {
+		struct mon_ho_analog ha;
+		struct _mon_analog *ana;
+
+		if (len != sizeof(ha))
+			goto inval;
+		memcpy(&ha, p, sizeof(ha));
+		if (ha.enc != enc)
+			goto inval;
+		ana = malloc(sizeof(*ana));
+		if (ana == NULL)
+			goto err;
+		memset(ana,0,sizeof(*ana));
+		ana->enc = enc;
+		ana->output = ha.output;
+		ana->a = ha.a;
+		ana->b = ha.b;
+		ana->value = ha.value;
+		ana->reported = ha.reported;
+		ana->min = ha.min;
+		ana->max = ha.max;
+		ana->sum = ha.sum;
+		ana->n = ha.n;
+		mon->ana = ana;
+	} else if (len)
+		goto inval;
+
+	if (h.filt) {
+		mon->filt = malloc(sizeof(*mon->filt));
+		if (mon->filt == NULL)
+			goto err;
+		memset(mon->filt,0,sizeof(*mon->filt));
+		mon->filt->k = h.k;
+		mon->filt->raw = h.raw;
+		mon->filt->debounce = h.debounce;
+		mon->filt->holdoff = h.holdoff;
+		mon->filt->hist = h.hist;
+		mon->filt->since = h.since;
+		mon->filt->edge = h.edge;
+	}
+
+	switch(typ) {
+	case MON_KEEPALIVE:
+		cb = keepalive_cb;
+		break;
+	case MON_SET_ONCE:
+	case MON_CLEAR_ONCE:
+		cb = once_cb;
+		break;
+	case MON_SET_LOOP:
+	case MON_CLEAR_LOOP:
+		cb = loop_cb;
+		break;
+	case MON_REPORT:
+	case MON_REPORT_H:
+	case MON_REPORT_L:
+		if (h.timer)
+			cb = report_cb;
+		break;
+	case MON_COUNT:
+	case MON_COUNT_H:
+	case MON_COUNT_L:
+		if (h.timer)
+			cb = counter_cb;
+		break;
+	case MON_FREQ:
+		if (h.timer) {
+			cb = freq_cb;
+			flags |= EV_PERSIST;
+		}
+		break;
+	case MON_ANALOG_STATS:
+		cb = analog_cb;
+		flags |= EV_PERSIST;
+		break;
+	default:
+		break;
+	}
+
+	if ((typ == MON_REPORT || typ == MON_REPORT_H || typ == MON_REPORT_L) &&
+			h.delay == 0 && mon->filt == NULL && watch_attach(mon, h.state) < 0)
+		goto err;
+	if (tab_add(mon, mon_group(mon), h.state) < 0)
+		goto err;
+	added = 1;
+
+	if (mode == MON_RESTORE_CLEAR) {
+		if (mon->seq) {
+			mon->seq->level = 0;
+			seq_write(mon->seq);
+		} else if (typ > _MON_UNKNOWN_OUT)
+			_bus_write_bit(mon->_port,mon->_offset, 0);
+		mon_free(mon, NULL);
+		return 0;
+	}
+	if (mode == MON_RESTORE_RESUME) {
+		if (mon->seq)
+			seq_write(mon->seq);
+		else if (typ > _MON_UNKNOWN_OUT)
+			_bus_write_bit(mon->_port,mon->_offset, mon_state(mon));
+	}
+
+	if (cb) {
+		/* Resume the timer where it was: the deadline is on the wall clock. */
+		rem = h.last + h.delay - tv_save(&now);
+		if (flags & EV_PERSIST)
+			rem = h.delay;
+		tv_load(&tv, (rem > 0) ? rem : 0);
+		mon->timer = event_new(base, -1, flags, cb, mon);
+		if (mon->timer == NULL)
+			goto err;
+		if (event_add(mon->timer, &tv) < 0) {
+			event_free(mon->timer);
+			mon->timer = NULL;
+			goto err;
+		}
+	}
+
+	if (last_mon_id < mon->mon.id)
+		last_mon_id = mon->mon.id;
+	mon->next = mon_list;
+	mon_list = mon;
+	return mon->mon.id;
+
+inval:
+	errno = EINVAL;
+err:
+	if (added)
+		tab_del(mon->group, mon->idx);
+	if (mon->watch)
+		watch_detach(mon);
+	if (mon->timer)
+		event_free(mon->timer);
+	if (mon->seq)
+		free(mon->seq);
+	if (mon->freq)
+		free(mon->freq);
+	if (mon->ana)
+		free(mon->ana);
+	if (mon->filt)
+		free(mon->filt);
+	free(mon);
+	return -1;
+}
@@ -1,6 +1,7 @@
 #ifndef MON_H
 #define MON_H
 
+#include <stdint.h>
 #include <event2/bufferevent.h>
 
 /* Monitor descriptor */
@@ -23,6 +24,14 @@ enum mon_type {
 	MON_COUNT_H,
 	MON_COUNT_L,
 
+	/* measure frequency and pulse widths */
+	MON_FREQ,
+
+	/* analog channels: deadband, thresholds, statistics */
+	MON_ANALOG_DELTA,
+	MON_ANALOG_LEVEL,
+	MON_ANALOG_STATS,
+
 	/* Marker; above are inputs, below are outputs */
 	_MON_UNKNOWN_OUT,
 
@@ -33,6 +42,12 @@ enum mon_type {
 	/* switch between set and clear */
 	MON_SET_LOOP,
 	MON_CLEAR_LOOP,
+
+	/* play a list of steps on one or more outputs */
+	MON_SEQUENCE,
+
+	/* Marker; number of types */
+	_MON_MAX,
 };
 
 struct _mon {
@@ -47,6 +62,40 @@ int mon_grab(int id, struct bufferevent *buf);
 int mon_del(int id, struct bufferevent *buf);
 void mon_delbuf(struct bufferevent *buf);
 
+/* Input filter for report and count monitors, applied in the bus cycle:
+   the majority of the last K samples (K <= 31; 0 or 1: off), then the
+   level must be stable for DEBOUNCE msec, then after each accepted
+   change the next one is held off for HOLDOFF msec. */
+int mon_filter(int id, unsigned int debounce, unsigned int holdoff, unsigned int k);
+
+/* Sequence playback: each step sets the outputs to LEVEL (bit 0 is the
+   first output) for MSEC milliseconds. The steps are played REPEAT
+   times, or forever if that's zero. The outputs keep the last step's level. */
+#define MON_SEQ_OUTS 16
+struct mon_seq_step {
+	unsigned short level;
+	unsigned int msec;
+};
+int mon_new_seq(struct bufferevent *buf, int n_out, const unsigned char *port, const unsigned char *offset,
+	int n_steps, const struct mon_seq_step *steps, unsigned int repeat);
+
+/* Frequency measurement: rising edges of the last WINDOW msec (at most
+   MON_FREQ_EDGES of them) are used. Reports every PERIOD msec (0: don't),
+   and whenever the frequency has moved by more than DELTA Hz (0: don't). */
+#define MON_FREQ_EDGES 256
+int mon_new_freq(unsigned char port, unsigned char offset, struct bufferevent *buf,
+	unsigned int window, unsigned int period, float delta);
+
+/* Analog channel CHAN of slot PORT (anything bus_is_read_word()
+   accepts), sampled in every bus cycle:
+   MON_ANALOG_DELTA reports the value when it has moved by more than
+   A since the last report; MON_ANALOG_LEVEL reports 'H' when it
+   reaches A and 'L' when it falls back to B (B <= A, hysteresis);
+   MON_ANALOG_STATS reports min, max and mean of the samples every
+   PERIOD msec. */
+int mon_new_analog(enum mon_type typ, unsigned char port, unsigned char chan, struct bufferevent *buf,
+	int64_t a, int64_t b, unsigned int period);
+
 /* Enumerate the monitors. Return something != 0 to break the enumerator loop. */
 typedef int (*mon_enum_fn)(struct _mon *mon, void *priv);
 int mon_enum(mon_enum_fn, void *priv);
@@ -55,7 +104,22 @@ const char *mon_typname(enum mon_type typ);
 /* check monitor state */
 void mon_sync(void);
 
+/* Called from bus_reload(): drop monitors on changed slots.
+   Returns how many were dropped. */
+int mon_reload(void);
+
 /* report details */
 const char *mon_detail(struct _mon *mon);
 
+/* Handoff (see handoff.h): save every monitor (or only those on
+   outputs) as a HO_MON record, and restore one of them with its ID,
+   connection and pending timer. */
+int mon_save(char outputs_only);
+enum mon_restore_mode {
+	MON_RESTORE_HANDOFF, /* the outputs are already set */
+	MON_RESTORE_RESUME, /* set the outputs to the monitor's state */
+	MON_RESTORE_CLEAR, /* clear the outputs, drop the monitor */
+};
+int mon_restore(const void *data, size_t len, enum mon_restore_mode mode);
+
 #endif
@@ -0,0 +1,715 @@
+
+#include "wago.h"
+#include "proxy.h"
+#include "metrics.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+
+#define PROXY_RETRY 5 /* seconds between connection attempts */
+
+/* An upstream monitor: one per node, slot and bit, shared by all
+   downstream subscribers; it also keeps the bit's value cached. */
+struct _pmon;
+struct _psub;
+struct _pmon {
+	struct _pmon *next;
+	unsigned char slot,bit;
+	int up_id; /* upstream monitor ID, 0 while there is none */
+	char valid, state;
+	struct _psub *subs;
+};
+
+/* A downstream monitor */
+struct _psub {
+	struct _psub *next; /* all of them */
+	struct _psub *next_pm; /* on the same upstream monitor */
+	int id;
+	char edge;
+	struct bufferevent *client;
+	struct _pmon *pm;
+	int node;
+};
+
+/* Replies to a client must arrive in the order of its commands, but
+   answers from different nodes (or from the proxy itself) don't. Each
+   command therefore gets a slot in the client's reply queue, which is
+   sent once it and all slots before it are complete. */
+struct _pclient;
+struct _pslot {
+	struct _pslot *next;
+	struct _pclient *client; /* NULL if the client has gone */
+	struct evbuffer *buf;
+	char done;
+};
+struct _pclient {
+	struct _pclient *next;
+	struct bufferevent *bev;
+	struct _pslot *head,*tail;
+};
+
+/* A request sent upstream, waiting for its reply */
+enum preq_type {
+	PREQ_RELAY, /* send the reply to the client */
+	PREQ_MON, /* m+ for a _pmon */
+	PREQ_READ, /* i for a _pmon; the client, if any, gets the reply */
+};
+struct _preq {
+	struct _preq *next;
+	enum preq_type typ;
+	struct _pslot *slot; /* where the reply goes */
+	struct _pmon *pm;
+};
+
+struct _pnode {
+	int id;
+	struct sockaddr_in sin;
+	char *name;
+	struct bufferevent *bev;
+	char up;
+	char multi; /* inside a multi-line reply */
+	struct event *retry;
+	struct _preq *head,*tail;
+	struct _pmon *mons;
+};
+
+static struct _pnode nodes[PROXY_NODES];
+static int n_nodes = 0;
+static struct _psub *sub_list = NULL;
+static struct _pclient *client_list = NULL;
+static int last_sub_id = 0;
+
+static void node_connect(struct _pnode *node);
+
+int proxy_add(const char *addr_port)
+{
+	struct _pnode *node;
+	char *addr, *p;
+
+	if (n_nodes == PROXY_NODES) {
+		errno = ENOSPC;
+		return -1;
+	}
+	node = &nodes[n_nodes];
+	memset(node,0,sizeof(*node));
+	addr = strdup(addr_port);
+	if (addr == NULL)
+		return -1;
+	node->sin.sin_family = AF_INET;
+	p = strrchr(addr,':');
+	if (p)
+		*p++ = '\0';
+	if (p == NULL || inet_pton(AF_INET, addr, &node->sin.sin_addr) != 1 ||
+			(node->sin.sin_port = htons(atoi(p))) == 0) {
+		free(addr);
+		errno = EINVAL;
+		return -1;
+	}
+	free(addr);
+	node->name = strdup(addr_port);
+	node->id = ++n_nodes;
+	return node->id;
+}
+
+int proxy_active(void)
+{
+	return n_nodes > 0;
+}
+
+static struct _pnode *find_node(int id)
+{
+	if (id < 1 || id > n_nodes)
+		return NULL;
+	return &nodes[id-1];
+}
+
+static struct _pslot *slot_new(struct bufferevent *bev)
+{
+	struct _pclient *cl;
+	struct _pslot *slot;
+
+	for(cl = client_list; cl; cl = cl->next)
+		if (cl->bev == bev)
+			break;
+	if (cl == NULL) {
+		cl = malloc(sizeof(*cl));
+		if (cl == NULL)
+			return NULL;
+		memset(cl,0,sizeof(*cl));
+		cl->bev = bev;
+		cl->next = client_list;
+		client_list = cl;
+	}
+	slot = malloc(sizeof(*slot));
+	if (slot == NULL)
+		return NULL;
+	slot->buf = evbuffer_new();
+	if (slot->buf == NULL) {
+		free(slot);
+		return NULL;
+	}
+	slot->next = NULL;
+	slot->client = cl;
+	slot->done = 0;
+	if (cl->tail)
+		cl->tail->next = slot;
+	else
+		cl->head = slot;
+	cl->tail = slot;
+	return slot;
+}
+
+static void slot_free(struct _pslot *slot)
+{
+	evbuffer_free(slot->buf);
+	free(slot);
+}
+
+/* The reply in this slot is complete; send whatever can be sent */
+static void slot_done(struct _pslot *slot)
+{
+	struct _pclient *cl = slot->client;
+	struct evbuffer *out;
+
+	slot->done = 1;
+	if (cl == NULL) {
+		slot_free(slot);
+		return;
+	}
+	out = bufferevent_get_output(cl->bev);
+	while(cl->head && cl->head->done) {
+		slot = cl->head;
+		cl->head = slot->next;
+		evbuffer_add_buffer(out, slot->buf);
+		slot_free(slot);
+	}
+	if (cl->head == NULL)
+		cl->tail = NULL;
+}
+
+/* Are replies still queued for this client? */
+static int slot_pending(struct bufferevent *bev)
+{
+	struct _pclient *cl;
+
+	for(cl = client_list; cl; cl = cl->next)
+		if (cl->bev == bev)
+			return cl->head != NULL;
+	return 0;
+}
+
+static void slot_line(struct _pslot *slot, const char *line)
+{
+	if (slot == NULL)
+		return;
+	evbuffer_add(slot->buf, line, strlen(line));
+	evbuffer_add(slot->buf, "\n", 1);
+}
+
+/* Send a line upstream and queue what to do with the reply */
+static int node_send(struct _pnode *node, enum preq_type typ, struct _pslot *slot,
+	struct _pmon *pm, const char *fmt, ...)
+{
+	struct _preq *req;
+	va_list ap;
+
+	if (!node->up) {
+		errno = ENOTCONN;
+		return -1;
+	}
+	req = malloc(sizeof(*req));
+	if (req == NULL)
+		return -1;
+	req->next = NULL;
+	req->typ = typ;
+	req->slot = slot;
+	req->pm = pm;
+	if (node->tail)
+		node->tail->next = req;
+	else
+		node->head = req;
+	node->tail = req;
+
+	va_start(ap, fmt);
+	evbuffer_add_vprintf(bufferevent_get_output(node->bev), fmt, ap);
+	va_end(ap);
+	evbuffer_add(bufferevent_get_output(node->bev), "\n", 1);
+	return 0;
+}
+
+static struct _preq *node_pop(struct _pnode *node)
+{
+	struct _preq *req = node->head;
+
+	if (req) {
+		node->head = req->next;
+		if (node->head == NULL)
+			node->tail = NULL;
+	}
+	return req;
+}
+
+/* Create the upstream monitor and read the bit's current state */
+static void pmon_setup(struct _pnode *node, struct _pmon *pm)
+{
+	pm->up_id = 0;
+	pm->valid = 0;
+	if (node_send(node, PREQ_MON, NULL, pm, "m+ %d %d *", pm->slot,pm->bit) == 0)
+		node_send(node, PREQ_READ, NULL, pm, "i %d %d", pm->slot,pm->bit);
+}
+
+static struct _pmon *pmon_get(struct _pnode *node, int slot, int bit)
+{
+	struct _pmon *pm;
+
+	for(pm = node->mons; pm; pm = pm->next)
+		if (pm->slot == slot && pm->bit == bit)
+			return pm;
+	pm = malloc(sizeof(*pm));
+	if (pm == NULL)
+		return NULL;
+	memset(pm,0,sizeof(*pm));
+	pm->slot = slot;
+	pm->bit = bit;
+	pm->next = node->mons;
+	node->mons = pm;
+	pmon_setup(node, pm);
+	return pm;
+}
+
+/* An upstream monitor reported a change */
+static void node_event(struct _pnode *node, int id, const char *what)
+{
+	struct _pmon *pm;
+	struct _psub *sub;
+	struct _pslot *slot;
+
+	for(pm = node->mons; pm; pm = pm->next)
+		if (pm->up_id == id)
+			break;
+	if (pm == NULL || (*what != 'H' && *what != 'L'))
+		return;
+	pm->state = (*what == 'H');
+	pm->valid = 1;
+	for(sub = pm->subs; sub; sub = sub->next_pm) {
+		if (sub->edge == '+' && !pm->state)
+			continue;
+		if (sub->edge == '-' && pm->state)
+			continue;
+		/* Queue behind pending replies, e.g. this monitor's own "!+ID" */
+		if (!slot_pending(sub->client)) {
+			evbuffer_add_printf(bufferevent_get_output(sub->client),
+				"!%d %c\n", sub->id, *what);
+		} else if ((slot = slot_new(sub->client)) != NULL) {
+			evbuffer_add_printf(slot->buf, "!%d %c\n", sub->id, *what);
+			slot_done(slot);
+		} else {
+			metrics.events_dropped++;
+			continue;
+		}
+		metrics.events++;
+	}
+}
+
+static void node_line(struct _pnode *node, const char *line)
+{
+	struct _preq *req;
+	int id;
+
+	if (node->multi) {
+		req = node->head;
+		if (req && req->typ == PREQ_RELAY)
+			slot_line(req->slot, line);
+		if (!strcmp(line,".")) {
+			node->multi = 0;
+			req = node_pop(node);
+			if (req->slot)
+				slot_done(req->slot);
+			free(req);
+		}
+		return;
+	}
+
+	/* asynchronous lines */
+	if (line[0] == '*')
+		return;
+	if (line[0] == '!' && isdigit(line[1])) {
+		const char *sp = strchr(line,' ');
+		if (sp)
+			node_event(node, atoi(line+1), sp+1);
+		return;
+	}
+	if (line[0] == '!' && line[1] == '-') {
+		struct _pmon *pm;
+		id = atoi(line+2);
+		for(pm = node->mons; pm; pm = pm->next)
+			if (pm->up_id == id) {
+				pm->up_id = 0;
+				pm->valid = 0;
+			}
+		return;
+	}
+
+	/* everything else is a reply */
+	req = node->head;
+	if (req == NULL)
+		return;
+	if (line[0] == '=') {
+		node->multi = 1;
+		if (req->typ == PREQ_RELAY)
+			slot_line(req->slot, line);
+		return;
+	}
+	req = node_pop(node);
+	switch(req->typ) {
+	case PREQ_RELAY:
+		slot_line(req->slot, line);
+		break;
+	case PREQ_MON:
+		if (line[0] == '!' && line[1] == '+')
+			req->pm->up_id = atoi(line+2);
+		break;
+	case PREQ_READ:
+		if (line[0] == '+' && isdigit(line[1])) {
+			req->pm->state = atoi(line+1);
+			req->pm->valid = (req->pm->up_id != 0);
+		}
+		slot_line(req->slot, line);
+		break;
+	}
+	if (req->slot)
+		slot_done(req->slot);
+	free(req);
+}
+
+static void
+node_readcb(struct bufferevent *bev, void *user_data)
+{
+	struct _pnode *node = user_data;
+	struct evbuffer *buf = bufferevent_get_input(bev);
+	char *line;
+	size_t len;
+
+	while((line = evbuffer_readln(buf, &len, EVBUFFER_EOL_CRLF))) {
+		node_line(node, line);
+		free(line);
+	}
+}
+
+static void
+retry_cb(evutil_socket_t fd, short events, void *user_data)
+{
+	node_connect((struct _pnode *)user_data);
+}
+
+static void node_down(struct _pnode *node)
+{
+	struct timeval tv = { PROXY_RETRY, 0 };
+	struct _preq *req;
+	struct _pmon *pm;
+
+	if (node->up)
+		printf("Node %d (%s) disconnected.\n", node->id, node->name);
+	node->up = 0;
+	node->multi = 0;
+	bufferevent_free(node->bev);
+	node->bev = NULL;
+	while((req = node_pop(node))) {
+		if (req->slot) {
+			char buf[60];
+			sprintf(buf,"?Node %d disconnected.", node->id);
+			slot_line(req->slot, buf);
+			slot_done(req->slot);
+		}
+		free(req);
+	}
+	for(pm = node->mons; pm; pm = pm->next) {
+		pm->up_id = 0;
+		pm->valid = 0;
+	}
+	event_add(node->retry, &tv);
+}
+
+static void
+node_eventcb(struct bufferevent *bev, short events, void *user_data)
+{
+	struct _pnode *node = user_data;
+	struct _pmon *pm;
+
+	if (events & BEV_EVENT_CONNECTED) {
+		printf("Node %d (%s) connected.\n", node->id, node->name);
+		node->up = 1;
+		for(pm = node->mons; pm; pm = pm->next)
+			pmon_setup(node, pm);
+		return;
+	}
+	if (events & (BEV_EVENT_EOF|BEV_EVENT_ERROR))
+		node_down(node);
+}
+
+static void node_connect(struct _pnode *node)
+{
+	struct timeval tv = { PROXY_RETRY, 0 };
+
+	node->bev = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE);
+	if (node->bev == NULL) {
+		event_add(node->retry, &tv);
+		return;
+	}
+	bufferevent_setcb(node->bev, node_readcb, NULL, node_eventcb, node);
+	bufferevent_enable(node->bev, EV_READ|EV_WRITE);
+	if (bufferevent_socket_connect(node->bev, (struct sockaddr *)&node->sin, sizeof(node->sin)) < 0) {
+		bufferevent_free(node->bev);
+		node->bev = NULL;
+		event_add(node->retry, &tv);
+	}
+}
+
+int proxy_start(void)
+{
+	int i;
+
+	for(i = 0; i < n_nodes; i++) {
+		nodes[i].retry = evtimer_new(base, retry_cb, &nodes[i]);
+		if (nodes[i].retry == NULL)
+			return -1;
+		node_connect(&nodes[i]);
+	}
+	return 0;
+}
+
+void proxy_stop(void)
+{
+	int i;
+
+	for(i = 0; i < n_nodes; i++) {
+		struct _pnode *node = &nodes[i];
+		struct _preq *req;
+		if (node->bev)
+			bufferevent_free(node->bev);
+		if (node->retry)
+			event_free(node->retry);
+		while((req = node_pop(node)))
+			free(req);
+		while(node->mons) {
+			struct _pmon *pm = node->mons;
+			node->mons = pm->next;
+			free(pm);
+		}
+	}
+	while(sub_list) {
+		struct _psub *sub = sub_list;
+		sub_list = sub->next;
+		free(sub);
+	}
+	while(client_list)
+		proxy_delbuf(client_list->bev);
+}
+
+static void sub_free(struct _psub *sub)
+{
+	struct _psub **ps;
+
+	for(ps = &sub->pm->subs; *ps != sub; ps = &(*ps)->next_pm)
+		;
+	*ps = sub->next_pm;
+	free(sub);
+}
+
+void proxy_delbuf(struct bufferevent *bev)
+{
+	struct _psub **ps = &sub_list;
+	struct _pclient **pcl;
+
+	while(*ps) {
+		struct _psub *sub = *ps;
+		if (sub->client == bev) {
+			*ps = sub->next;
+			sub_free(sub);
+		} else
+			ps = &sub->next;
+	}
+
+	/* Slots still waiting for a node are freed when the reply arrives */
+	for(pcl = &client_list; *pcl; pcl = &(*pcl)->next) {
+		struct _pclient *cl = *pcl;
+		if (cl->bev != bev)
+			continue;
+		*pcl = cl->next;
+		while(cl->head) {
+			struct _pslot *slot = cl->head;
+			cl->head = slot->next;
+			slot->client = NULL;
+			if (slot->done)
+				slot_free(slot);
+		}
+		free(cl);
+		break;
+	}
+}
+
+static const char proxy_help[] = "=\n\
+Proxy mode. I/O is addressed as N:A:B (node N, port A, offset B).\n\
+n             list nodes: number, address, state.\n\
+i N:A:B       read an input (cached while the node is connected).\n\
+I N:A:B       report an output's state.\n\
+s N:A:B [...] set an output; parameters as for 's' on the node.\n\
+c N:A:B [...] clear an output.\n\
+v N:A:B       read an analog or counter channel.\n\
+V N:A:B X     write an analog output channel.\n\
+m             list monitors.\n\
+m+ N:A:B D    report changes of an input; D is + - *.\n\
+              Replies with a monitor ID; events are '!ID H' or '!ID L'.\n\
+m- X          delete monitor X.\n\
+> N LINE      send LINE to node N and relay the reply. Monitors created\n\
+              this way don't report through the proxy; use m+.\n\
+.\n";
+
+/* Run one command. Returns 1 if the reply will come from a node. */
+static int proxy_cmd(struct bufferevent *bev, struct _pslot *slot, const char *line)
+{
+	struct evbuffer *out = slot->buf;
+	struct _pnode *node;
+	struct _pmon *pm;
+	struct _psub *sub;
+	int n,a,b,len = 0;
+	char edge;
+
+	metrics_command(*line);
+	switch(*line) {
+	case 'h':
+		evbuffer_add(out, proxy_help, sizeof(proxy_help)-1);
+		return 0;
+	case 'n':
+		evbuffer_add_printf(out,"=Nodes:\n");
+		for(n = 0; n < n_nodes; n++)
+			evbuffer_add_printf(out,"%d %s %s\n", nodes[n].id, nodes[n].name, nodes[n].up ? "up" : "down");
+		evbuffer_add(out,".\n",2);
+		return 0;
+	case '>':
+		if (sscanf(line+1,"%d %n",&n,&len) != 1 || !line[1+len]) {
+			evbuffer_add_printf(out,"?'>' needs a node number and a command.\n");
+			return 0;
+		}
+		node = find_node(n);
+		if (node && node_send(node, PREQ_RELAY, slot, NULL, "%s", line+1+len) == 0)
+			return 1;
+		evbuffer_add_printf(out,"?Node %d: %s\n", n, node ? strerror(errno) : "unknown");
+		return 0;
+	case 'i':
+	case 'I':
+	case 's':
+	case 'c':
+	case 'v':
+	case 'V':
+		if (sscanf(line+1,"%d:%d:%d %n",&n,&a,&b,&len) < 3) {
+			evbuffer_add_printf(out,"?'%c' needs a N:A:B parameter.\n",*line);
+			return 0;
+		}
+		if (a < 0 || a > 255 || b < 0 || b > 255) {
+			evbuffer_add_printf(out,"?'%c': A and B must be 0..255.\n",*line);
+			return 0;
+		}
+		node = find_node(n);
+		if (node == NULL) {
+			evbuffer_add_printf(out,"?Node %d: unknown\n", n);
+			return 0;
+		}
+		if (*line == 'i' && !line[1+len]) {
+			pm = pmon_get(node, a,b);
+			if (pm && pm->valid && node->up) {
+				evbuffer_add_printf(out,"+%d\n", pm->state);
+				return 0;
+			}
+			if (pm && node_send(node, PREQ_READ, slot, pm, "i %d %d", a,b) == 0)
+				return 1;
+		} else if (node_send(node, PREQ_RELAY, slot, NULL, "%c %d %d %s", *line, a,b, line+1+len) == 0)
+			return 1;
+		evbuffer_add_printf(out,"?Node %d: %s\n", n, strerror(errno));
+		return 0;
+	case 'm':
+		if (line[1] == 0) {
+			evbuffer_add_printf(out,"=Monitors:\n");
+			for(sub = sub_list; sub; sub = sub->next)
+				evbuffer_add_printf(out,"%d %d:%d:%d %c\n", sub->id, sub->node,
+					sub->pm->slot,sub->pm->bit, sub->edge);
+			evbuffer_add(out,".\n",2);
+		} else if (line[1] == '+') {
+			if (sscanf(line+2,"%d:%d:%d %c",&n,&a,&b,&edge) != 4 || !strchr("+-*",edge)) {
+				evbuffer_add_printf(out,"?'m+' needs a N:A:B parameter and one of + - *.\n");
+				return 0;
+			}
+			if (a < 0 || a > 255 || b < 0 || b > 255) {
+				evbuffer_add_printf(out,"?'m+': A and B must be 0..255.\n");
+				return 0;
+			}
+			node = find_node(n);
+			if (node == NULL) {
+				evbuffer_add_printf(out,"?Node %d: unknown\n", n);
+				return 0;
+			}
+			pm = pmon_get(node, a,b);
+			sub = pm ? malloc(sizeof(*sub)) : NULL;
+			if (sub == NULL) {
+				evbuffer_add_printf(out,"?'m+' error creating monitor: %s\n",strerror(errno));
+				return 0;
+			}
+			sub->id = ++last_sub_id;
+			sub->edge = edge;
+			sub->client = bev;
+			sub->pm = pm;
+			sub->node = n;
+			sub->next_pm = pm->subs;
+			pm->subs = sub;
+			sub->next = sub_list;
+			sub_list = sub;
+			evbuffer_add_printf(out,"!+%d monitor created\n",sub->id);
+		} else if (line[1] == '-') {
+			struct _psub **ps;
+			if (sscanf(line+2,"%d",&n) != 1) {
+				evbuffer_add_printf(out,"?'m-' needs a numeric parameter.\n");
+				return 0;
+			}
+			for(ps = &sub_list; *ps; ps = &(*ps)->next)
+				if ((*ps)->id == n && (*ps)->client == bev)
+					break;
+			if (*ps == NULL) {
+				evbuffer_add_printf(out,"?'m-' error deleting monitor %d: %s\n",n,strerror(ENOENT));
+				return 0;
+			}
+			sub = *ps;
+			*ps = sub->next;
+			sub_free(sub);
+			evbuffer_add_printf(out,"+Monitor %d deleted.\n",n);
+		} else {
+			evbuffer_add_printf(out,"?Unknown subcommand: '%c'. Help with 'h'.\n",line[1]);
+		}
+		return 0;
+	default:
+		evbuffer_add_printf(out,"?Unknown command in proxy mode: '%c'. Help with 'h'.\n",*line);
+		return 0;
+	}
+}
+
+void proxy_parse(struct bufferevent *bev, const char *line)
+{
+	struct _pslot *slot;
+
+	slot = slot_new(bev);
+	if (slot == NULL) {
+		evbuffer_add_printf(bufferevent_get_output(bev),"?Out of memory.\n");
+		return;
+	}
+	if (!proxy_cmd(bev, slot, line))
+		slot_done(slot);
+}
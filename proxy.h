@@ -0,0 +1,25 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <event2/bufferevent.h>
+
+/* Proxy mode: instead of a local bus, talk to other wago daemons
+   ("nodes", numbered from 1 in the order they're added) and address
+   their I/O as NODE:SLOT:BIT. */
+
+#define PROXY_NODES 32 /* at most this many -X options */
+
+/* Add a node at ADDRESS:PORT. Call before proxy_start(). */
+int proxy_add(const char *addr_port);
+/* Are we a proxy? */
+int proxy_active(void);
+/* Connect to the nodes */
+int proxy_start(void);
+void proxy_stop(void);
+
+/* Process a client's command line */
+void proxy_parse(struct bufferevent *bev, const char *line);
+/* A client went away */
+void proxy_delbuf(struct bufferevent *bev);
+
+#endif
@@ -0,0 +1,260 @@
+
+#include "wago.h"
+#include "pub.h"
+#include "bus.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <ifaddrs.h>
+
+#include <event2/event.h>
+
+struct _pub_slot {
+	unsigned short _port,_offset;
+	unsigned char id, bits, typ;
+	uint32_t value;
+};
+
+static int pub_fd = -1;
+static struct sockaddr_in pub_addr;
+static struct event *pub_event = NULL;
+
+static struct _pub_slot slots[PUB_SLOTS];
+static unsigned int n_slots = 0;
+static uint32_t pub_seq = 0;
+static struct timeval pub_last;
+static struct timeval req_window;
+static unsigned int n_replies;
+
+static struct {
+	struct pub_hdr hdr;
+	struct pub_slot slot[PUB_SLOTS];
+} pkt;
+
+static int add_slot(struct _bus *bus, void *priv)
+{
+	struct _pub_slot *s = &slots[n_slots];
+	unsigned short port = bus->id, offset;
+	unsigned char bits;
+	int res;
+
+	if (n_slots == PUB_SLOTS)
+		return 1;
+	if (bus->typ == BUS_BITS_IN)
+		res = bus_is_read_slot(&port,&offset,&bits);
+	else if (bus->typ == BUS_BITS_OUT)
+		res = bus_is_write_slot(&port,&offset,&bits);
+	else
+		return 0;
+	if (res < 0 || bits > 32)
+		return 0;
+	s->_port = port;
+	s->_offset = offset;
+	s->id = bus->id;
+	s->bits = bits;
+	s->typ = bus->typ;
+	n_slots++;
+	return 0;
+}
+
+static inline uint32_t read_slot(struct _pub_slot *s)
+{
+	if (s->typ == BUS_BITS_IN)
+		return _bus_read_slot(s->_port,s->_offset,s->bits);
+	return _bus_read_wslot(s->_port,s->_offset,s->bits);
+}
+
+static void add_entry(struct _pub_slot *s)
+{
+	struct pub_slot *ps = &pkt.slot[pkt.hdr.n++];
+
+	ps->id = s->id;
+	ps->typ = s->typ;
+	ps->bits = s->bits;
+	ps->_pad = 0;
+	ps->value = htonl(s->value);
+}
+
+/* Send the packet; N is still in host order here */
+static void send_pkt(enum pub_type type, const struct timeval *tv, struct sockaddr_in *to)
+{
+	size_t len = sizeof(pkt.hdr) + pkt.hdr.n*sizeof(*pkt.slot);
+
+	pkt.hdr.magic[0] = PUB_MAGIC0;
+	pkt.hdr.magic[1] = PUB_MAGIC1;
+	pkt.hdr.version = PUB_VERSION;
+	pkt.hdr.type = type;
+	pkt.hdr.seq = htonl(pub_seq);
+	pkt.hdr.sec = htonl(tv->tv_sec);
+	pkt.hdr.usec = htonl(tv->tv_usec);
+	pkt.hdr.n = htons(pkt.hdr.n);
+	pkt.hdr._pad = 0;
+	sendto(pub_fd, &pkt, len, 0, (struct sockaddr *)to, sizeof(*to));
+}
+
+/* Is FROM on one of our directly attached subnets? Subscribers are,
+   as the group's TTL is 1; anyone else must not get snapshots sent. */
+static int local_source(const struct sockaddr_in *from)
+{
+	struct ifaddrs *ifa, *ifp;
+	uint32_t addr, mask;
+	int res = 0;
+
+	if (getifaddrs(&ifa) < 0)
+		return 0;
+	for(ifp = ifa; ifp; ifp = ifp->ifa_next) {
+		if (ifp->ifa_addr == NULL || ifp->ifa_netmask == NULL ||
+				ifp->ifa_addr->sa_family != AF_INET)
+			continue;
+		addr = ((struct sockaddr_in *)ifp->ifa_addr)->sin_addr.s_addr;
+		mask = ((struct sockaddr_in *)ifp->ifa_netmask)->sin_addr.s_addr;
+		if (((addr ^ from->sin_addr.s_addr) & mask) == 0) {
+			res = 1;
+			break;
+		}
+	}
+	freeifaddrs(ifa);
+	return res;
+}
+
+static void
+request_cb(evutil_socket_t fd, short events, void *user_data)
+{
+	struct pub_hdr req;
+	struct sockaddr_in from;
+	socklen_t fromlen = sizeof(from);
+	struct timeval now;
+	unsigned int i;
+	ssize_t len;
+
+	len = recvfrom(fd, &req, sizeof(req), 0, (struct sockaddr *)&from, &fromlen);
+	if (len < 4 || req.magic[0] != PUB_MAGIC0 || req.magic[1] != PUB_MAGIC1 ||
+			req.version != PUB_VERSION || req.type != PUB_REQUEST)
+		return;
+
+	/* Cap the replies even to local senders, whose address may be forged */
+	event_base_gettimeofday_cached(base, &now);
+	if (now.tv_sec != req_window.tv_sec) {
+		req_window = now;
+		n_replies = 0;
+	}
+	if (n_replies >= PUB_REPLIES || !local_source(&from))
+		return;
+	n_replies++;
+
+	/* the values as of the last change datagram */
+	pkt.hdr.n = 0;
+	for(i = 0; i < n_slots; i++)
+		add_entry(&slots[i]);
+	send_pkt(PUB_SNAPSHOT, &now, &from);
+}
+
+int pub_open(const char *addr_port)
+{
+	char *addr, *p;
+	int one = 1;
+	unsigned char ttl = 1;
+	unsigned int i;
+
+	addr = strdup(addr_port);
+	if (addr == NULL)
+		return -1;
+	memset(&pub_addr, 0, sizeof(pub_addr));
+	pub_addr.sin_family = AF_INET;
+	p = strrchr(addr,':');
+	if (p)
+		*p++ = '\0';
+	if (p == NULL || inet_pton(AF_INET, addr, &pub_addr.sin_addr) != 1 ||
+			(pub_addr.sin_port = htons(atoi(p))) == 0) {
+		free(addr);
+		errno = EINVAL;
+		return -1;
+	}
+	free(addr);
+
+	pub_fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (pub_fd < 0)
+		return -1;
+	if (setsockopt(pub_fd, SOL_SOCKET, SO_BROADCAST, &one, sizeof(one)) < 0 ||
+			setsockopt(pub_fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0)
+		goto err;
+	/* requests arrive on the (ephemeral) source port */
+	if (evutil_make_socket_nonblocking(pub_fd) < 0)
+		goto err;
+	pub_event = event_new(base, pub_fd, EV_READ|EV_PERSIST, request_cb, NULL);
+	if (pub_event == NULL || event_add(pub_event, NULL) < 0)
+		goto err;
+
+	n_slots = 0;
+	bus_enum(add_slot, NULL);
+	for(i = 0; i < n_slots; i++)
+		slots[i].value = read_slot(&slots[i]);
+	event_base_gettimeofday_cached(base, &pub_last);
+	return 0;
+
+err:
+	pub_close();
+	return -1;
+}
+
+void pub_close(void)
+{
+	if (pub_event) {
+		event_free(pub_event);
+		pub_event = NULL;
+	}
+	if (pub_fd >= 0) {
+		close(pub_fd);
+		pub_fd = -1;
+	}
+}
+
+void pub_reload(void)
+{
+	struct timeval now;
+	unsigned int i;
+
+	if (pub_fd < 0)
+		return;
+	n_slots = 0;
+	bus_enum(add_slot, NULL);
+	pkt.hdr.n = 0;
+	for(i = 0; i < n_slots; i++) {
+		slots[i].value = read_slot(&slots[i]);
+		add_entry(&slots[i]);
+	}
+	event_base_gettimeofday_cached(base, &now);
+	pub_seq++;
+	send_pkt(PUB_CHANGE, &now, &pub_addr);
+	pub_last = now;
+}
+
+void pub_sync(const struct timeval *now)
+{
+	unsigned int i;
+
+	if (pub_fd < 0)
+		return;
+	pkt.hdr.n = 0;
+	for(i = 0; i < n_slots; i++) {
+		uint32_t value = read_slot(&slots[i]);
+		if (value == slots[i].value)
+			continue;
+		slots[i].value = value;
+		add_entry(&slots[i]);
+	}
+	if (pkt.hdr.n) {
+		pub_seq++;
+		send_pkt(PUB_CHANGE, now, &pub_addr);
+		pub_last = *now;
+	} else if (now->tv_sec - pub_last.tv_sec > PUB_IDLE ||
+			(now->tv_sec - pub_last.tv_sec == PUB_IDLE && now->tv_usec >= pub_last.tv_usec)) {
+		send_pkt(PUB_HEARTBEAT, now, &pub_addr);
+		pub_last = *now;
+	}
+}
@@ -0,0 +1,65 @@
+#ifndef PUB_H
+#define PUB_H
+
+#include <stdint.h>
+#include <sys/time.h>
+
+/* UDP change publisher.
+
+   Every bus cycle in which a digital slot changed, one datagram with the
+   changed slots is sent to a multicast (or broadcast) group. Each one
+   carries the next sequence number; heartbeats, sent every PUB_IDLE
+   seconds without changes, repeat the last one so that subscribers notice
+   a lost final datagram.
+
+   A subscriber which sees a gap sends a PUB_REQUEST datagram to the
+   address the datagrams come from, and gets a PUB_SNAPSHOT of all slots
+   in reply, whose sequence number is that of the last change datagram.
+   Only requests from directly attached subnets are answered, at most
+   PUB_REPLIES per second.
+
+   All integers are in network byte order.
+ */
+#define PUB_MAGIC0 'W'
+#define PUB_MAGIC1 'P'
+#define PUB_VERSION 1
+#define PUB_IDLE 1
+#define PUB_SLOTS 64
+#define PUB_REPLIES 20
+
+enum pub_type {
+	PUB_CHANGE = 'C',
+	PUB_HEARTBEAT = 'H',
+	PUB_SNAPSHOT = 'S',
+	PUB_REQUEST = 'R', /* subscriber to controller; the header only */
+};
+
+struct pub_hdr {
+	char magic[2];
+	uint8_t version;
+	uint8_t type; /* enum pub_type */
+	uint32_t seq;
+	uint32_t sec, usec; /* cycle timestamp */
+	uint16_t n; /* struct pub_slot entries following */
+	uint16_t _pad;
+};
+struct pub_slot {
+	uint8_t id;
+	uint8_t typ; /* 1: digital input, 2: digital output */
+	uint8_t bits;
+	uint8_t _pad;
+	uint32_t value; /* bit 0 is position 1 */
+};
+
+/* Start publishing to ADDR:PORT. */
+int pub_open(const char *addr_port);
+void pub_close(void);
+
+/* Called from mon_sync() with the cycle's timestamp. */
+void pub_sync(const struct timeval *now);
+
+/* Called from bus_reload(): take the new slot table, and send all slots
+   in one change datagram. */
+void pub_reload(void);
+
+#endif
@@ -0,0 +1,332 @@
+
+#include "wago.h"
+#include "rules.h"
+#include "bus.h"
+#include "mon.h"
+#include "trace.h"
+#include "handoff.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+struct rule_term {
+	unsigned short _port,_offset;
+	char cond;
+	unsigned char state;
+};
+
+struct _rule_priv;
+struct _rule_priv {
+	struct _rule rule;
+	struct _rule_priv *next;
+	char op; /* & | */
+	unsigned char n_terms;
+	unsigned char active; /* result of the last evaluation */
+	struct rule_term term[RULE_TERMS];
+
+	char act;
+	unsigned char port,offset;
+	unsigned short _port,_offset;
+	unsigned int msec1,msec2;
+};
+static struct _rule_priv *rule_list = NULL;
+static int last_rule_id = 0;
+
+static const char *skip_space(const char *p)
+{
+	while(*p == ' ' || *p == '\t')
+		p++;
+	return p;
+}
+
+static int parse_action(struct _rule_priv *rule, const char *p)
+{
+	int port,offset,len = 0;
+	float f1 = 0,f2 = 0;
+	int n;
+
+	rule->act = *p++;
+	switch(rule->act) {
+	case 's':
+	case 'c':
+		n = sscanf(p,"%d %d %n",&port,&offset,&len);
+		if (n != 2)
+			return -1;
+		break;
+	case 'p':
+	case 'P':
+		n = sscanf(p,"%d %d %f %n",&port,&offset,&f1,&len);
+		if (n != 3 || f1 <= 0)
+			return -1;
+		break;
+	case 'w':
+		n = sscanf(p,"%d %d %f %f %n",&port,&offset,&f1,&f2,&len);
+		if (n != 4 || f1 <= 0 || f2 <= 0)
+			return -1;
+		break;
+	default:
+		return -1;
+	}
+	if (p[len] || port < 0 || port > 255 || offset < 0 || offset > 255)
+		return -1;
+
+	rule->port = port;
+	rule->offset = offset;
+	rule->_port = port;
+	rule->_offset = offset;
+	rule->msec1 = f1*1000;
+	rule->msec2 = f2*1000;
+	if (bus_is_write_bit(&rule->_port,&rule->_offset) < 0)
+		return -2;
+	return 0;
+}
+
+int rule_new(const char *text)
+{
+	struct _rule_priv *rule;
+	const char *p = skip_space(text);
+	int res;
+
+	rule = malloc(sizeof(*rule));
+	if (rule == NULL)
+		return -1;
+	memset(rule,0,sizeof(*rule));
+
+	while(1) {
+		struct rule_term *term = &rule->term[rule->n_terms];
+		unsigned short port,offset;
+		int len = 0;
+
+		if (rule->n_terms == RULE_TERMS)
+			goto inval;
+		if (sscanf(p,"%hu:%hu%c%n",&port,&offset,&term->cond,&len) != 3 || !strchr("+-*HL",term->cond))
+			goto inval;
+		p = skip_space(p+len);
+		if (bus_is_read_bit(&port,&offset) < 0)
+			goto err;
+		term->_port = port;
+		term->_offset = offset;
+		term->state = _bus_read_bit(port,offset);
+		rule->n_terms++;
+
+		if (*p == '&' || *p == '|') {
+			if (rule->op && rule->op != *p)
+				goto inval; /* no mixing */
+			rule->op = *p;
+			p = skip_space(p+1);
+		} else if (p[0] == '=' && p[1] == '>') {
+			p = skip_space(p+2);
+			break;
+		} else
+			goto inval;
+	}
+
+	res = parse_action(rule,p);
+	if (res == -1)
+		goto inval;
+	if (res < 0)
+		goto err;
+
+	rule->rule.text = strdup(skip_space(text));
+	if (rule->rule.text == NULL)
+		goto err;
+	rule->rule.id = ++last_rule_id;
+	rule->next = rule_list;
+	rule_list = rule;
+	return rule->rule.id;
+
+inval:
+	errno = EINVAL;
+err:
+	free(rule);
+	return -1;
+}
+
+int rule_del(int id)
+{
+	struct _rule_priv **prule = &rule_list;
+	while(1) {
+		struct _rule_priv *rule = *prule;
+		if (rule == NULL) {
+			errno = ENOENT;
+			return -1;
+		}
+		if (rule->rule.id == id) {
+			*prule = rule->next;
+			free((char *)rule->rule.text);
+			free(rule);
+			return 0;
+		}
+		prule = &rule->next;
+	}
+}
+
+/* Enumerate the rules. Return something != 0 to break the enumerator loop. */
+int rule_enum(rule_enum_fn enum_fn, void *priv)
+{
+	struct _rule_priv *rule;
+	int res = 0;
+	for(rule = rule_list; rule; rule = rule->next) {
+		res = (*enum_fn)(&rule->rule, priv);
+		if (res)
+			break;
+	}
+	return res;
+}
+
+static int rule_fire(struct _rule_priv *rule)
+{
+	rule->rule.count++;
+	trace(TR_RULE, rule->port,rule->offset, rule->rule.id);
+	switch(rule->act) {
+	case 's':
+		_bus_write_bit(rule->_port,rule->_offset, 1);
+		return 1;
+	case 'c':
+		_bus_write_bit(rule->_port,rule->_offset, 0);
+		return 1;
+	/* An output that's already pulsing is left alone (EEXIST). */
+	case 'p':
+		mon_new(MON_SET_ONCE, rule->port,rule->offset, NULL, rule->msec1,0);
+		break;
+	case 'P':
+		mon_new(MON_CLEAR_ONCE, rule->port,rule->offset, NULL, rule->msec1,0);
+		break;
+	case 'w':
+		mon_new(MON_SET_LOOP, rule->port,rule->offset, NULL, rule->msec1,rule->msec2);
+		break;
+	}
+	return 0;
+}
+
+/* Evaluate the rules */
+int rule_sync(void)
+{
+	struct _rule_priv *rule;
+	int res = 0;
+
+	for(rule = rule_list; rule; rule = rule->next) {
+		unsigned char active = (rule->op != '|');
+		int i;
+
+		for(i = 0; i < rule->n_terms; i++) {
+			struct rule_term *term = &rule->term[i];
+			unsigned char state = _bus_read_bit(term->_port,term->_offset);
+			unsigned char match;
+
+			switch(term->cond) {
+			case '+':
+				match = state && !term->state;
+				break;
+			case '-':
+				match = !state && term->state;
+				break;
+			case '*':
+				match = !state != !term->state;
+				break;
+			case 'H':
+				match = state;
+				break;
+			default:
+				match = !state;
+				break;
+			}
+			term->state = state;
+			if (rule->op == '|')
+				active |= match;
+			else
+				active &= match;
+		}
+		if (active && !rule->active)
+			res |= rule_fire(rule);
+		rule->active = active;
+	}
+	return res;
+}
+
+int rule_reload(void)
+{
+	struct _rule_priv **prule = &rule_list;
+	int i,kept,n = 0;
+
+	while(*prule) {
+		struct _rule_priv *rule = *prule;
+
+		kept = bus_bit_kept(rule->_port,rule->_offset, BUS_BITS_OUT);
+		for(i = 0; i < rule->n_terms; i++)
+			if (!bus_bit_kept(rule->term[i]._port,rule->term[i]._offset, BUS_BITS_IN))
+				kept = 0;
+		if (kept) {
+			prule = &rule->next;
+			continue;
+		}
+		*prule = rule->next;
+		free((char *)rule->rule.text);
+		free(rule);
+		n++;
+	}
+	return n;
+}
+
+/* Rule in a handoff; followed by its text */
+struct rule_ho {
+	uint32_t id;
+	uint32_t count;
+};
+
+int rule_save(void)
+{
+	struct _rule_priv *rule;
+
+	for(rule = rule_list; rule; rule = rule->next) {
+		size_t len = strlen(rule->rule.text);
+		struct evbuffer *out = handoff_rec(HO_RULE, sizeof(struct rule_ho) + len);
+		struct rule_ho h;
+
+		h.id = rule->rule.id;
+		h.count = rule->rule.count;
+		if (out == NULL || evbuffer_add(out, &h, sizeof(h)) < 0 ||
+				evbuffer_add(out, rule->rule.text, len) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* Rules are saved in list order; append to keep it. */
+int rule_restore(const void *data, size_t len)
+{
+	struct _rule_priv *rule, **prule;
+	struct rule_ho h;
+	int last = last_rule_id;
+	char *text;
+	int res;
+
+	if (len < sizeof(h)) {
+		errno = EINVAL;
+		return -1;
+	}
+	memcpy(&h, data, sizeof(h));
+	len -= sizeof(h);
+	text = malloc(len+1);
+	if (text == NULL)
+		return -1;
+	memcpy(text, (const char *)data + sizeof(h), len);
+	text[len] = 0;
+	res = rule_new(text);
+	free(text);
+	if (res < 0)
+		return -1;
+
+	rule = rule_list;
+	rule_list = rule->next;
+	rule->rule.id = h.id;
+	rule->rule.count = h.count;
+	last_rule_id = (last < h.id) ? h.id : last;
+	for(prule = &rule_list; *prule; prule = &(*prule)->next)
+		;
+	rule->next = NULL;
+	*prule = rule;
+	return rule->rule.id;
+}
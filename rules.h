@@ -0,0 +1,46 @@
+#ifndef RULES_H
+#define RULES_H
+
+#include <stddef.h>
+
+/* Local reaction rules: a condition on input bits, and an action on an
+   output which runs in the same bus cycle as the input change.
+
+   Syntax: TERM [& TERM …] => ACTION     (or | instead of &)
+   TERM:   A:B+ rising edge, A:B- falling edge, A:B* any edge,
+           A:BH high, A:BL low  (input port A, offset B)
+   ACTION: s A B        set output
+           c A B        clear output
+           p A B I      set output for I seconds
+           P A B I      clear output for I seconds
+           w A B I J    set for I seconds, clear for J seconds, repeat
+ */
+#define RULE_TERMS 8
+
+struct _rule {
+	unsigned int id;
+	unsigned long count; /* times fired */
+	const char *text;
+};
+
+int rule_new(const char *text);
+int rule_del(int id);
+
+/* Enumerate the rules. Return something != 0 to break the enumerator loop. */
+typedef int (*rule_enum_fn)(struct _rule *rule, void *priv);
+int rule_enum(rule_enum_fn, void *priv);
+
+/* Evaluate the rules. Called from mon_sync().
+   Returns 1 if an output has been changed and the bus needs to be synced. */
+int rule_sync(void);
+
+/* Called from bus_reload(): drop rules on changed slots.
+   Returns how many were dropped. */
+int rule_reload(void);
+
+/* Handoff (see handoff.h): save all rules as HO_RULE records, and
+   restore one of them with its ID. */
+int rule_save(void);
+int rule_restore(const void *data, size_t len);
+
+#endif
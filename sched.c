@@ -0,0 +1,263 @@
+
+#include "wago.h"
+#include "sched.h"
+#include "bus.h"
+#include "trace.h"
+#include "handoff.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#include <event2/util.h>
+
+struct _sched_priv {
+	struct _sched sched;
+	unsigned short _port,_offset;
+};
+
+/* One binary min-heap per clock, ordered by due time */
+struct sched_heap {
+	struct _sched_priv *ent;
+	unsigned int n, max;
+};
+static struct sched_heap heaps[2];
+static int last_sched_id = 0;
+
+#define SCHED_MAX 100000
+
+static inline int earlier(struct _sched_priv *a, struct _sched_priv *b)
+{
+	return evutil_timercmp(&a->sched.when, &b->sched.when, <);
+}
+
+static void sift_up(struct sched_heap *h, unsigned int i)
+{
+	struct _sched_priv e = h->ent[i];
+
+	while(i > 0) {
+		unsigned int p = (i-1)/2;
+		if (!earlier(&e, &h->ent[p]))
+			break;
+		h->ent[i] = h->ent[p];
+		i = p;
+	}
+	h->ent[i] = e;
+}
+
+static void sift_down(struct sched_heap *h, unsigned int i)
+{
+	struct _sched_priv e = h->ent[i];
+
+	while(1) {
+		unsigned int c = 2*i+1;
+		if (c >= h->n)
+			break;
+		if (c+1 < h->n && earlier(&h->ent[c+1], &h->ent[c]))
+			c++;
+		if (!earlier(&h->ent[c], &e))
+			break;
+		h->ent[i] = h->ent[c];
+		i = c;
+	}
+	h->ent[i] = e;
+}
+
+static void heap_remove(struct sched_heap *h, unsigned int i)
+{
+	h->n--;
+	if (i == h->n)
+		return;
+	h->ent[i] = h->ent[h->n];
+	if (i > 0 && earlier(&h->ent[i], &h->ent[(i-1)/2]))
+		sift_up(h, i);
+	else
+		sift_down(h, i);
+}
+
+void sched_now(enum sched_clock clock, struct timeval *tv)
+{
+	if (clock == SCHED_MONOTONIC) {
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		tv->tv_sec = ts.tv_sec;
+		tv->tv_usec = ts.tv_nsec/1000;
+	} else
+		gettimeofday(tv, NULL);
+}
+
+static int sched_add(enum sched_clock clock, const struct timeval *when,
+	unsigned char port, unsigned char offset, char value, unsigned int id)
+{
+	struct sched_heap *h = &heaps[clock];
+	struct _sched_priv *e;
+	unsigned short _port = port;
+	unsigned short _offset = offset;
+
+	if (bus_is_write_bit(&_port,&_offset) < 0)
+		return -1;
+	if (h->n == h->max) {
+		unsigned int max = h->max ? 2*h->max : 64;
+		struct _sched_priv *ent;
+
+		if (h->n >= SCHED_MAX) {
+			errno = ENOSPC;
+			return -1;
+		}
+		ent = realloc(h->ent, max*sizeof(*ent));
+		if (ent == NULL)
+			return -1;
+		h->ent = ent;
+		h->max = max;
+	}
+	e = &h->ent[h->n];
+	memset(e,0,sizeof(*e));
+	e->sched.id = id;
+	e->sched.clock = clock;
+	e->sched.when = *when;
+	e->sched.port = port;
+	e->sched.offset = offset;
+	e->sched.value = value;
+	e->_port = _port;
+	e->_offset = _offset;
+	sift_up(h, h->n++);
+	if (last_sched_id < id)
+		last_sched_id = id;
+	return id;
+}
+
+int sched_new(enum sched_clock clock, const struct timeval *when,
+	unsigned char port, unsigned char offset, char value)
+{
+	return sched_add(clock, when, port, offset, value, last_sched_id+1);
+}
+
+int sched_del(int id)
+{
+	int c;
+	unsigned int i;
+
+	for(c = 0; c < 2; c++) {
+		struct sched_heap *h = &heaps[c];
+		for(i = 0; i < h->n; i++) {
+			if (h->ent[i].sched.id == id) {
+				heap_remove(h, i);
+				return 0;
+			}
+		}
+	}
+	errno = ENOENT;
+	return -1;
+}
+
+/* Enumerate the entries. Return something != 0 to break the enumerator loop. */
+int sched_enum(sched_enum_fn enum_fn, void *priv)
+{
+	int c, res = 0;
+	unsigned int i;
+
+	for(c = 0; c < 2; c++) {
+		struct sched_heap *h = &heaps[c];
+		for(i = 0; i < h->n; i++) {
+			res = (*enum_fn)(&h->ent[i].sched, priv);
+			if (res)
+				return res;
+		}
+	}
+	return res;
+}
+
+/* Apply all due changes */
+int sched_sync(void)
+{
+	struct timeval now;
+	int c, res = 0;
+
+	for(c = 0; c < 2; c++) {
+		struct sched_heap *h = &heaps[c];
+		if (h->n == 0)
+			continue;
+		sched_now(c, &now);
+		while(h->n && !evutil_timercmp(&now, &h->ent[0].sched.when, <)) {
+			struct _sched_priv *e = &h->ent[0];
+			_bus_write_bit(e->_port,e->_offset, e->sched.value);
+			trace(TR_SCHED, e->sched.port,e->sched.offset, e->sched.id);
+			heap_remove(h, 0);
+			res = 1;
+		}
+	}
+	return res;
+}
+
+int sched_reload(void)
+{
+	int c, n = 0;
+	unsigned int i,j;
+
+	for(c = 0; c < 2; c++) {
+		struct sched_heap *h = &heaps[c];
+
+		for(i = j = 0; i < h->n; i++) {
+			if (!bus_bit_kept(h->ent[i]._port,h->ent[i]._offset, BUS_BITS_OUT)) {
+				n++;
+				continue;
+			}
+			h->ent[j++] = h->ent[i];
+		}
+		h->n = j;
+		/* rebuild the heap */
+		for(i = h->n/2; i-- > 0; )
+			sift_down(h, i);
+	}
+	return n;
+}
+
+/* Entry in a handoff. Monotonic times stay valid: the clock is system-wide. */
+struct sched_ho {
+	uint32_t id;
+	uint8_t clock, port, offset, value;
+	int64_t when; /* usec */
+};
+
+static int save_one(struct _sched *s, void *priv)
+{
+	struct sched_ho h;
+	struct evbuffer *out;
+
+	memset(&h,0,sizeof(h));
+	h.id = s->id;
+	h.clock = s->clock;
+	h.port = s->port;
+	h.offset = s->offset;
+	h.value = s->value;
+	h.when = s->when.tv_sec*1000000LL + s->when.tv_usec;
+	out = handoff_rec(HO_SCHED, sizeof(h));
+	if (out == NULL)
+		return -1;
+	return evbuffer_add(out, &h, sizeof(h));
+}
+
+int sched_save(void)
+{
+	return sched_enum(save_one, NULL) ? -1 : 0;
+}
+
+int sched_restore(const void *data, size_t len)
+{
+	struct sched_ho h;
+	struct timeval when;
+
+	if (len != sizeof(h)) {
+		errno = EINVAL;
+		return -1;
+	}
+	memcpy(&h, data, sizeof(h));
+	if (h.clock != SCHED_REALTIME && h.clock != SCHED_MONOTONIC) {
+		errno = EINVAL;
+		return -1;
+	}
+	when.tv_sec = h.when/1000000;
+	when.tv_usec = h.when%1000000;
+	return sched_add(h.clock, &when, h.port, h.offset, h.value, h.id);
+}
@@ -0,0 +1,46 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <sys/time.h>
+#include <stddef.h>
+
+/* Output changes scheduled for an absolute time, on either the wall clock
+   or the monotonic clock. Due entries are applied once per bus cycle. */
+enum sched_clock {
+	SCHED_REALTIME,
+	SCHED_MONOTONIC,
+};
+
+struct _sched {
+	unsigned int id;
+	enum sched_clock clock;
+	struct timeval when;
+	unsigned char port,offset;
+	char value;
+};
+
+int sched_new(enum sched_clock clock, const struct timeval *when,
+	unsigned char port, unsigned char offset, char value);
+int sched_del(int id);
+
+/* current time on this clock */
+void sched_now(enum sched_clock clock, struct timeval *tv);
+
+/* Enumerate the entries (not sorted). Return something != 0 to break the enumerator loop. */
+typedef int (*sched_enum_fn)(struct _sched *sched, void *priv);
+int sched_enum(sched_enum_fn, void *priv);
+
+/* Apply all due changes. Called from mon_sync().
+   Returns 1 if an output has been changed and the bus needs to be synced. */
+int sched_sync(void);
+
+/* Called from bus_reload(): drop entries on changed slots.
+   Returns how many were dropped. */
+int sched_reload(void);
+
+/* Handoff (see handoff.h): save all entries as HO_SCHED records, and
+   restore one of them with its ID. */
+int sched_save(void);
+int sched_restore(const void *data, size_t len);
+
+#endif
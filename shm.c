@@ -0,0 +1,138 @@
+
+#include "wago.h"
+#include "shm.h"
+#include "wagoshm.h"
+#include "bus.h"
+#include "metrics.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+struct _shm_slot {
+	unsigned short _port,_offset;
+	unsigned char bits, typ;
+};
+
+static struct wago_shm *shm = NULL;
+static char *shm_name = NULL;
+static struct _shm_slot slots[WAGO_SHM_SLOTS];
+
+static int add_slot(struct _bus *bus, void *priv)
+{
+	struct wago_shm_data *d = &shm->d;
+	struct _shm_slot *s = &slots[d->n_slots];
+	unsigned short port = bus->id, offset;
+	unsigned char bits;
+	int res;
+
+	if (d->n_slots == WAGO_SHM_SLOTS)
+		return 1;
+	if (bus->typ == BUS_BITS_IN)
+		res = bus_is_read_slot(&port,&offset,&bits);
+	else if (bus->typ == BUS_BITS_OUT)
+		res = bus_is_write_slot(&port,&offset,&bits);
+	else
+		return 0;
+	if (res < 0 || bits > 32)
+		return 0;
+	s->_port = port;
+	s->_offset = offset;
+	s->bits = bits;
+	s->typ = bus->typ;
+	d->slot[d->n_slots].id = bus->id;
+	d->slot[d->n_slots].typ = bus->typ;
+	d->slot[d->n_slots].bits = bits;
+	d->n_slots++;
+	return 0;
+}
+
+int shm_export(const char *name)
+{
+	int fd;
+
+	fd = shm_open(name, O_RDWR|O_CREAT, 0644);
+	if (fd < 0)
+		return -1;
+	if (ftruncate(fd, sizeof(*shm)) < 0) {
+		close(fd);
+		return -1;
+	}
+	shm = mmap(NULL, sizeof(*shm), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) {
+		shm = NULL;
+		return -1;
+	}
+	shm_name = strdup(name);
+
+	/* readers check the magic last */
+	shm->magic = 0;
+	__sync_synchronize();
+	memset(&shm->d, 0, sizeof(shm->d));
+	shm->seq = 0;
+	shm->version = WAGO_SHM_VERSION;
+	shm->size = sizeof(*shm);
+	bus_enum(add_slot, NULL);
+	shm_publish(0);
+	__sync_synchronize();
+	shm->magic = WAGO_SHM_MAGIC;
+	return 0;
+}
+
+void shm_unexport(void)
+{
+	if (shm == NULL)
+		return;
+	munmap(shm, sizeof(*shm));
+	shm = NULL;
+	if (shm_name) {
+		shm_unlink(shm_name);
+		free(shm_name);
+		shm_name = NULL;
+	}
+}
+
+void shm_reload(void)
+{
+	if (shm == NULL)
+		return;
+	/* readers retry while the sequence number is odd */
+	shm->seq++;
+	__sync_synchronize();
+	memset(shm->d.slot, 0, sizeof(shm->d.slot));
+	shm->d.n_slots = 0;
+	bus_enum(add_slot, NULL);
+	__sync_synchronize();
+	shm->seq++;
+	shm_publish(0);
+}
+
+void shm_publish(unsigned long usec)
+{
+	struct wago_shm_data *d;
+	struct timeval tv;
+	unsigned int i;
+
+	if (shm == NULL)
+		return;
+	d = &shm->d;
+	gettimeofday(&tv, NULL);
+
+	shm->seq++;
+	__sync_synchronize();
+	d->updates = metrics.kbus_updates;
+	d->cycles = metrics.cycles;
+	d->time = tv.tv_sec*1000000ULL + tv.tv_usec;
+	d->kbus_usec = usec;
+	for(i = 0; i < d->n_slots; i++) {
+		struct _shm_slot *s = &slots[i];
+		if (s->typ == BUS_BITS_IN)
+			d->slot[i].value = _bus_read_slot(s->_port,s->_offset,s->bits);
+		else
+			d->slot[i].value = _bus_read_wslot(s->_port,s->_offset,s->bits);
+	}
+	__sync_synchronize();
+	shm->seq++;
+}
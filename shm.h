@@ -0,0 +1,14 @@
+#ifndef SHM_H
+#define SHM_H
+
+/* Publish the process image in POSIX shared memory; see wagoshm.h */
+int shm_export(const char *name);
+void shm_unexport(void);
+
+/* Called from bus_sync(), with the update's duration */
+void shm_publish(unsigned long usec);
+
+/* Called from bus_reload(): rebuild the slot table */
+void shm_reload(void);
+
+#endif
@@ -0,0 +1,154 @@
+
+#include "trace.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <time.h>
+
+struct trace_rec trace_ring[TRACE_SIZE];
+unsigned int trace_pos = 0;
+uint32_t trace_now = 0;
+char trace_on = 1;
+
+void trace_stamp(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv,NULL);
+	/* wraps by design; unsigned so the overflow is well defined on 32-bit long */
+	trace_now = (uint32_t)tv.tv_sec*1000000U + (uint32_t)tv.tv_usec;
+}
+
+unsigned int trace_count(void)
+{
+	return (trace_pos < TRACE_SIZE) ? trace_pos : TRACE_SIZE;
+}
+
+void trace_clear(void)
+{
+	trace_pos = 0;
+}
+
+/* Enumerate the last N records, oldest first. */
+int trace_enum(unsigned int n, trace_enum_fn enum_fn, void *priv)
+{
+	unsigned int pos;
+	int res = 0;
+
+	if (n == 0 || n > trace_count())
+		n = trace_count();
+	for(pos = trace_pos-n; pos != trace_pos; pos++) {
+		res = (*enum_fn)(&trace_ring[pos & (TRACE_SIZE-1)], priv);
+		if (res)
+			break;
+	}
+	return res;
+}
+
+/* Write the ring to a file */
+int trace_save(const char *fn)
+{
+	struct trace_hdr hdr;
+	unsigned int pos,n;
+	FILE *f;
+
+	f = fopen(fn,"w");
+	if (f == NULL)
+		return -errno;
+
+	n = trace_count();
+	trace_stamp();
+	memset(&hdr,0,sizeof(hdr));
+	memcpy(hdr.magic,TRACE_MAGIC,sizeof(hdr.magic));
+	hdr.version = 1;
+	hdr.recsize = sizeof(struct trace_rec);
+	hdr.count = n;
+	hdr.now = trace_now;
+	hdr.time = time(NULL);
+	fwrite(&hdr,sizeof(hdr),1,f);
+
+	/* The ring may wrap: write the older part first. */
+	pos = (trace_pos-n) & (TRACE_SIZE-1);
+	if (pos+n > TRACE_SIZE) {
+		fwrite(trace_ring+pos,sizeof(struct trace_rec),TRACE_SIZE-pos,f);
+		n -= TRACE_SIZE-pos;
+		pos = 0;
+	}
+	fwrite(trace_ring+pos,sizeof(struct trace_rec),n,f);
+
+	if (fclose(f))
+		return -errno;
+	return 0;
+}
+
+const char *trace_evname(unsigned char ev)
+{
+	switch(ev) {
+	case TR_SYNC:
+		return "sync";
+	case TR_READ:
+		return "read";
+	case TR_READ_W:
+		return "wread";
+	case TR_WRITE:
+		return "write";
+	case TR_FIND_FAIL:
+		return "nobit";
+	case TR_MON_H:
+		return "mon H";
+	case TR_MON_L:
+		return "mon L";
+	case TR_MON_COUNT:
+		return "count";
+	case TR_MON_DROP:
+		return "drop";
+	case TR_MON_FIRE:
+		return "fire";
+	case TR_MON_TOGGLE:
+		return "toggle";
+	case TR_RULE:
+		return "rule";
+	case TR_SCHED:
+		return "at";
+	default:
+		return "???";
+	}
+}
+
+/* Decode one record. The timestamp is printed relative to NOW. */
+int trace_decode(const struct trace_rec *rec, uint32_t now, char *buf, size_t len)
+{
+	int32_t age = now - rec->ts;
+	const char *sign = "-";
+
+	if (age < 0) {
+		age = -age;
+		sign = "+";
+	}
+	switch(rec->ev) {
+	case TR_SYNC:
+		return snprintf(buf,len,"%s%d.%06d %s %d", sign, age/1000000, age%1000000,
+			trace_evname(rec->ev), rec->value);
+	case TR_FIND_FAIL:
+		return snprintf(buf,len,"%s%d.%06d %s %d:%s%d %s", sign, age/1000000, age%1000000,
+			trace_evname(rec->ev), rec->port, (rec->bit == TR_BIT_MAX) ? ">=" : "",
+			rec->bit, strerror(rec->value));
+	case TR_READ:
+	case TR_READ_W:
+	case TR_WRITE:
+		return snprintf(buf,len,"%s%d.%06d %s %d:%d = %d", sign, age/1000000, age%1000000,
+			trace_evname(rec->ev), rec->port, rec->bit, rec->value);
+	case TR_RULE:
+		return snprintf(buf,len,"%s%d.%06d %s %d:%d rule %d", sign, age/1000000, age%1000000,
+			trace_evname(rec->ev), rec->port, rec->bit, rec->value);
+	case TR_SCHED:
+		return snprintf(buf,len,"%s%d.%06d %s %d:%d entry %d", sign, age/1000000, age%1000000,
+			trace_evname(rec->ev), rec->port, rec->bit, rec->value);
+	default:
+		return snprintf(buf,len,"%s%d.%06d %s %d:%d mon %d", sign, age/1000000, age%1000000,
+			trace_evname(rec->ev), rec->port, rec->bit, rec->value);
+	}
+}
@@ -0,0 +1,110 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Trace event IDs. Don't renumber; trace files carry these. */
+enum trace_ev {
+	TR_NONE,
+
+	/* bus cycle; value is the KbusUpdate result */
+	TR_SYNC,
+
+	/* bit access; port/bit are the hardware byte/bit offsets */
+	TR_READ,
+	TR_READ_W,
+	TR_WRITE,
+
+	/* bit lookup failed; port/bit are slot/position, value is errno */
+	TR_FIND_FAIL,
+
+	/* monitor events; port/bit are slot/position, value is the monitor ID */
+	TR_MON_H,
+	TR_MON_L,
+	TR_MON_COUNT,
+	TR_MON_DROP,
+	TR_MON_FIRE,
+	TR_MON_TOGGLE,
+
+	/* a rule fired; port/bit are the output's slot/position, value is the rule ID */
+	TR_RULE,
+
+	/* a scheduled change was applied; port/bit are the output's slot/position, value is its ID */
+	TR_SCHED,
+
+	_TR_MAX
+};
+
+/* One trace record. Native byte order. */
+struct trace_rec {
+	uint32_t ts; /* usec, wraps every 71 minutes */
+	uint16_t port;
+	uint8_t bit;
+	uint8_t ev;
+	int32_t value;
+};
+
+/* trace_rec.bit of TR_READ, TR_READ_W and TR_WRITE is a hardware bit
+   offset, or one of these markers */
+#define TR_BIT_SLOT 0xFF /* several bits of a slot at once */
+#define TR_BIT_WORD 0xFE /* a word channel */
+/* Positions of a failed lookup are stored as at most TR_BIT_MAX, which
+   then means "TR_BIT_MAX or more"; 8 bits keep the file format. */
+#define TR_BIT_MAX 0xFD
+#define TR_POS(pos) ((pos) < TR_BIT_MAX ? (pos) : TR_BIT_MAX)
+
+/* Number of records in the ring. Must be a power of two. */
+#define TRACE_SIZE 4096
+
+/* Trace file header */
+#define TRACE_MAGIC "WTRC"
+struct trace_hdr {
+	char magic[4];
+	uint16_t version;
+	uint16_t recsize;
+	uint32_t count; /* records following the header, oldest first */
+	uint32_t now; /* trace timestamp when the file was written */
+	int64_t time; /* wall clock (sec) when the file was written */
+};
+
+extern struct trace_rec trace_ring[TRACE_SIZE];
+extern unsigned int trace_pos;
+extern uint32_t trace_now;
+extern char trace_on;
+
+/* Record an event. This is called from the bus and monitor hot paths,
+   so it does nothing beyond a couple of stores. */
+static inline void trace(enum trace_ev ev, unsigned short port, unsigned char bit, int value)
+{
+	struct trace_rec *r;
+
+	if (!trace_on)
+		return;
+	r = &trace_ring[trace_pos++ & (TRACE_SIZE-1)];
+	r->ts = trace_now;
+	r->port = port;
+	r->bit = bit;
+	r->ev = ev;
+	r->value = value;
+}
+
+/* Update the timestamp used for subsequent records. */
+void trace_stamp(void);
+
+/* Number of valid records in the ring */
+unsigned int trace_count(void);
+void trace_clear(void);
+
+/* Enumerate the last N records, oldest first. Return something != 0 to break the enumerator loop. */
+typedef int (*trace_enum_fn)(const struct trace_rec *rec, void *priv);
+int trace_enum(unsigned int n, trace_enum_fn, void *priv);
+
+/* Write the ring to a file (binary), oldest record first. */
+int trace_save(const char *fn);
+
+/* Decode one record into human-readable text, relative to NOW. */
+const char *trace_evname(unsigned char ev);
+int trace_decode(const struct trace_rec *rec, uint32_t now, char *buf, size_t len);
+
+#endif
@@ -25,6 +25,7 @@
 #  include <arpa/inet.h>
 # endif
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/file.h>
 #endif
 #include <getopt.h>
@@ -32,12 +33,22 @@
 #include "wago.h"
 #include "bus.h"
 #include "mon.h"
+#include "trace.h"
+#include "metrics.h"
+#include "cmd.h"
+#include "datalog.h"
+#include "shm.h"
+#include "pub.h"
+#include "proxy.h"
+#include "handoff.h"
+#include "checkpoint.h"
 
 #include <event2/bufferevent.h>
 #include <event2/buffer.h>
 #include <event2/listener.h>
 #include <event2/util.h>
 #include <event2/event.h>
+#include <event2/http.h>
 
 const char *MSG_HELLO = "* WAGO ready.\n";
 
@@ -57,30 +68,79 @@ char demo_state_skip = 0;
 #endif
 
 static int port = 59995;
-static struct timeval loop_dly = {3,0};
+struct timeval loop_dly = {3,0};
 static char *buscfg_file = NULL;
+char *trace_file = "/tmp/wago.trace";
+static char *metrics_port = NULL;
+static char *log_file = NULL;
+static unsigned long log_size = 1024;
+static char *shm_file = NULL;
+static char *pub_group = NULL;
+static char *unix_path = NULL;
+static char *ckpt_file = NULL;
+
+static enum ckpt_mode ckpt_mode = CKPT_RESUME;
+static int handoff_fd = -1;
+static char handed_off = 0;
+
+/* our options, for background() and handoffs: room for each option
+   once plus a -X for every proxy node */
+#define NARGS (48 + 2*PROXY_NODES)
+static char *args[NARGS];
+
+/* open connections, for handoffs */
+struct _conn {
+	struct _conn *next;
+	struct bufferevent *bev;
+	struct _conn *next_ready; /* in ready_list */
+	char ready;
+	struct event *more; /* rate limit: run the rest when the window ends */
+	struct timeval window; /* rate limit: start of the current second */
+	unsigned int n_window; /* commands in it */
+	struct event *closing; /* conn_close() with a delay */
+};
+static struct _conn *conn_list = NULL;
+
+/* Fair scheduling: a connection runs at most conn_budget commands per
+   loop turn (dumps and help count CMD_COST_DUMP), and at most conn_rate
+   per second (0: no limit). The rest of its input waits, while its
+   socket isn't read: on ready_list for the next turn, or for the end
+   of its rate window. */
+#define CONN_BUDGET 16
+static unsigned int conn_budget = CONN_BUDGET;
+static unsigned int conn_rate = 0;
+static struct _conn *ready_list = NULL, **ready_tail = &ready_list;
+static struct event *ready_event = NULL;
+static const struct timeval zero_tv = { 0, 0 };
 
 static void listener_cb(struct evconnlistener *, evutil_socket_t,
     struct sockaddr *, int socklen, void *);
 static void conn_eventcb(struct bufferevent *, short, void *);
 static void conn_readcb(struct bufferevent *, void *);
+static void conn_more_cb(evutil_socket_t, short, void *);
+static void conn_close_cb(evutil_socket_t, short, void *);
+static void conn_ready(struct _conn *);
+static void ready_cb(evutil_socket_t, short, void *);
 static void signal_cb(evutil_socket_t, short, void *);
+static void trace_cb(evutil_socket_t, short, void *);
+static void handoff_cb(evutil_socket_t, short, void *);
+static void reload_cb(evutil_socket_t, short, void *);
+static void metrics_cb(struct evhttp_request *, void *);
 static void timer_cb(evutil_socket_t, short, void *);
-#ifdef DEMO
-static void off_cb(evutil_socket_t, short, void *);
-#endif
 static int interface_setup(struct event_base *base, evutil_socket_t fd);
+static struct bufferevent *conn_new(evutil_socket_t fd);
+static int take_listener(int fd, enum handoff_listen kind);
 
 struct event_base *base = NULL;
 static struct evconnlistener *listener = NULL;
+static struct evconnlistener *unix_listener = NULL;
 static struct event *signal_event = NULL;
+static struct event *trace_event = NULL;
+static struct event *handoff_event = NULL;
+static struct event *reload_event = NULL;
+static struct evhttp *metrics_http = NULL;
 static struct event *timer_event = NULL;
 
-struct ev_at_buf {
-	struct bufferevent *bev;
-	struct event *ev;
-};
-
 extern char *__progname; /* from uClibc */
 static void
 usage (int err)
@@ -93,68 +153,33 @@ usage (int err)
 Usage: %s OPTION ...\n\
 Options:\n\
 -p|--port #     Use port # instead of %d\n\
--c|--cfg  #     Use configuration file #\n\
+-u|--unix #     Also listen on Unix socket #\n\
+-c|--cfg  #     Use configuration file # (re-read on SIGHUP)\n\
 -D|--debug      Toggle debugging (default %s)\n\
 -d|--stdin      accept commands from the console\n\
 -F|--foreground Don't daemonize.\n\
 -l|--loop #     Check ports every # seconds instead of %g\n\
+-b|--budget #   Run at most # commands per connection and loop turn (default %d)\n\
+-r|--rate #     Run at most # commands per connection and second (default: no limit)\n\
+-t|--trace #    Write the trace buffer to # on SIGUSR1 (default %s)\n\
+-T|--no-trace   Start with tracing turned off\n\
+-M|--metrics #  Serve metrics via HTTP on [address:]port #\n\
+-L|--log #      Log all input and output changes to file #\n\
+-R|--log-size # Rotate the log at # kBytes (default %lu)\n\
+-S|--shm #      Publish the process image in shared memory object #\n\
+-P|--publish #  Send input and output changes to UDP group address:port #\n\
+-X|--proxy #    Proxy mode: connect to the daemon at address:port #\n\
+                (repeat for more nodes) instead of using the local bus\n\
+-C|--checkpoint # Save output monitors to file #; restore them on startup\n\
+-O|--on-restart # Then resume them (default) or clear their outputs\n\
+-H|--handoff #  Take over from the daemon which started us, via socket #\n\
+                (SIGUSR2 starts a new daemon this way)\n\
 -h|--help       Print this message\n\
-\n", __progname, port, debug?"on":"off", loop_dly.tv_sec+loop_dly.tv_usec/1000000.);
+\n", __progname, port, debug?"on":"off", loop_dly.tv_sec+loop_dly.tv_usec/1000000., CONN_BUDGET, trace_file, log_size);
 	}
 	exit (err);
 }
 
-static int report_mon(struct _mon *mon, void *priv)
-{
-	struct evbuffer *out = (struct evbuffer *)priv;
-	const char nix[] = "-";
-	const char *det;
-
-	det = mon_detail(mon);
-	if (det == NULL)
-		det = nix;
-
-	evbuffer_add_printf(out, "%d %s: %d:%d %s\n", mon->id, mon_typname(mon->typ), mon->port,mon->offset, det);
-	if (det != nix)
-		free((char *)det);
-	return 0;
-}
-
-static int report_bus(struct _bus *bus, void *priv)
-{
-	struct evbuffer *out = (struct evbuffer *)priv;
-
-	evbuffer_add_printf(out, "%d: %s:%s %d", bus->id,bus_typname(bus->typ),bus->typname, bus->bits);
-	int i;
-	signed char j;
-
-	switch (bus->typ) {
-	case BUS_BITS_IN:
-		evbuffer_add(out, " <=",3);
-		for(i=1; i <= bus->bits; i++) {
-			if ((i%5) == 1) evbuffer_add(out, " ",1);
-			j = bus_read_bit(bus->id,i);
-			evbuffer_add(out, (j < 0) ? "?" : j ? "1" : "0", 1);
-		}
-		
-		break;
-	case BUS_BITS_OUT:
-		evbuffer_add(out, " =>",3);
-		for(i=1; i <= bus->bits; i++) {
-			if ((i%5) == 1) evbuffer_add(out, " ",1);
-			j = bus_read_wbit(bus->id,i);
-			evbuffer_add(out, (j < 0) ? "?" : j ? "1" : "0", 1);
-		}
-
-		break;
-	default:
-		/* don't know what to do */
-		break;
-	}
-	evbuffer_add(out, "\n",1);
-	return 0;
-}
-
 static int list_bus_debug(struct _bus *bus, void *priv)
 {
 	printf("%d: %s:%s %d\n", bus->id,bus_typname(bus->typ),bus->typname, bus->bits);
@@ -168,6 +193,15 @@ set_loop_timer(float d)
 	loop_dly.tv_usec = (int)((d-loop_dly.tv_sec)*1000000);
 }
 
+int
+change_loop_timer(float d)
+{
+	set_loop_timer(d);
+	if (event_del(timer_event) || event_add(timer_event, &loop_dly)<0)
+		return -1;
+	return 0;
+}
+
 void
 background(char * const args[])
 {
@@ -206,8 +240,6 @@ main(int argc, char **argv)
 {
 	int res;
 	char listen_stdin = 0;
-#define NARGS 10
-	char * args[NARGS];
 	char **ap = args;
 
 	struct sockaddr_in sin;
@@ -232,16 +264,30 @@ main(int argc, char **argv)
 			{"foreground", 0, 0, 'F'},
 			{"loop", 1, 0, 'l'},
 			{"port", 1, 0, 'p'},
+			{"unix", 1, 0, 'u'},
+			{"trace", 1, 0, 't'},
+			{"no-trace", 0, 0, 'T'},
+			{"metrics", 1, 0, 'M'},
+			{"log", 1, 0, 'L'},
+			{"log-size", 1, 0, 'R'},
+			{"shm", 1, 0, 'S'},
+			{"publish", 1, 0, 'P'},
+			{"proxy", 1, 0, 'X'},
+			{"handoff", 1, 0, 'H'},
+			{"checkpoint", 1, 0, 'C'},
+			{"on-restart", 1, 0, 'O'},
+			{"budget", 1, 0, 'b'},
+			{"rate", 1, 0, 'r'},
 			{0, 0, 0, 0}
 		};
 		
 		/* Identify all  options */
 		*ap++ = "wagomon";
 		*ap++ = "-F";
-		while((opt= getopt_long (argc, argv, "c:dDFhl:p:",
+		while((opt= getopt_long (argc, argv, "b:c:C:dDFhH:l:L:M:O:p:P:r:R:S:t:Tu:X:",
 						long_options, &option_index)) >= 0) {
 			if(ap-args > NARGS-3) {
-				fprintf(stderr,"Too many arguments");
+				fprintf(stderr,"Too many arguments\n");
 				exit(1);
 			}
 			switch (opt) {
@@ -249,6 +295,7 @@ main(int argc, char **argv)
 				listen_stdin = 1;
 				break;
 			case 'D':
+				*ap++ = "-D";
 				debug = !debug;
 				break;
 			case 'F':
@@ -264,9 +311,97 @@ main(int argc, char **argv)
 				}
 				port=p;
 				break;
+			case 'u':
+				*ap++ = "-u";
+				*ap++ = optarg;
+				unix_path = optarg;
+				break;
 			case 'c':
+				*ap++ = "-c";
+				*ap++ = optarg;
 				buscfg_file = optarg;
 				break;
+			case 'C':
+				*ap++ = "-C";
+				*ap++ = optarg;
+				ckpt_file = optarg;
+				break;
+			case 'O':
+				*ap++ = "-O";
+				*ap++ = optarg;
+				if (!strcmp(optarg,"resume"))
+					ckpt_mode = CKPT_RESUME;
+				else if (!strcmp(optarg,"clear"))
+					ckpt_mode = CKPT_CLEAR;
+				else {
+					fprintf(stderr, "'%s' is not valid: use 'resume' or 'clear'.\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'H':
+				handoff_fd = atoi(optarg);
+				break;
+			case 't':
+				*ap++ = "-t";
+				*ap++ = optarg;
+				trace_file = optarg;
+				break;
+			case 'T':
+				*ap++ = "-T";
+				trace_on = 0;
+				break;
+			case 'M':
+				*ap++ = "-M";
+				*ap++ = optarg;
+				metrics_port = optarg;
+				break;
+			case 'L':
+				*ap++ = "-L";
+				*ap++ = optarg;
+				log_file = optarg;
+				break;
+			case 'R':
+				*ap++ = "-R";
+				*ap++ = optarg;
+				p = strtoul(optarg, &ep, 10);
+				if(!*optarg || *ep) {
+					fprintf(stderr, "'%s' is not a valid size.\n", optarg);
+					exit(1);
+				}
+				log_size = p;
+				break;
+			case 'b':
+			case 'r':
+				*ap++ = (opt == 'b') ? "-b" : "-r";
+				*ap++ = optarg;
+				p = strtoul(optarg, &ep, 10);
+				if(!*optarg || *ep || p > 1000000 || (opt == 'b' && p == 0)) {
+					fprintf(stderr, "'%s' is not a valid %s.\n", optarg, (opt == 'b') ? "budget" : "rate");
+					exit(1);
+				}
+				if (opt == 'b')
+					conn_budget = p;
+				else
+					conn_rate = p;
+				break;
+			case 'P':
+				*ap++ = "-P";
+				*ap++ = optarg;
+				pub_group = optarg;
+				break;
+			case 'X':
+				*ap++ = "-X";
+				*ap++ = optarg;
+				if (proxy_add(optarg) < 0) {
+					fprintf(stderr, "'%s' is not a valid node address: %s\n", optarg, strerror(errno));
+					exit(1);
+				}
+				break;
+			case 'S':
+				*ap++ = "-S";
+				*ap++ = optarg;
+				shm_file = optarg;
+				break;
 			case 'l':
 				*ap++ = "-l";
 				*ap++ = optarg;
@@ -292,7 +427,19 @@ main(int argc, char **argv)
 	WSAStartup(0x0201, &wsa_data);
 #endif
 
-	if (debug) {
+	if (handoff_fd >= 0) {
+		/* returns when the old process has released the bus */
+		if (handoff_receive(handoff_fd) < 0) {
+			fprintf(stderr,"Could not take over: %s\n",strerror(errno));
+			exit(1);
+		}
+		res = bus_init_data(buscfg_file);
+	} else if (proxy_active()) {
+		/* no local bus */
+		if (!debug && !listen_stdin)
+			background(args);
+		res = 0;
+	} else if (debug) {
 		res = bus_init_data(buscfg_file);
 		if(res == 0)
 			bus_enum(list_bus_debug,NULL);
@@ -312,6 +459,11 @@ main(int argc, char **argv)
 		fprintf(stderr, "Could not initialize libevent: %s\n",strerror(errno));
 		return 1;
 	}
+	ready_event = evtimer_new(base, ready_cb, NULL);
+	if (!ready_event) {
+		fprintf(stderr, "Could not create an event: %s\n",strerror(errno));
+		return 1;
+	}
 
 	if (listen_stdin > 0) {
 		if (debug)
@@ -322,40 +474,161 @@ main(int argc, char **argv)
 		}
 	}
 
-	memset(&sin, 0, sizeof(sin));
-	sin.sin_family = AF_INET;
-	sin.sin_port = htons(port);
+	/* sockets, output image and monitors from the old process */
+	if (handoff_fd >= 0)
+		handoff_restore(take_listener, conn_new);
 
-	listener = evconnlistener_new_bind(base, listener_cb, (void *)base,
-	    LEV_OPT_REUSEABLE|LEV_OPT_CLOSE_ON_FREE, -1,
-	    (struct sockaddr*)&sin,
-	    sizeof(sin));
+	/* output monitors from before a crash; after a handoff we already
+	   have them */
+	if (ckpt_file && !proxy_active() &&
+			ckpt_open(ckpt_file, ckpt_mode, handoff_fd < 0) < 0) {
+		fprintf(stderr, "Could not load %s: %s\n",ckpt_file,strerror(errno));
+		return 1;
+	}
 
+	if (!listener) {
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(port);
+
+		listener = evconnlistener_new_bind(base, listener_cb, (void *)base,
+		    LEV_OPT_REUSEABLE|LEV_OPT_CLOSE_ON_FREE, -1,
+		    (struct sockaddr*)&sin,
+		    sizeof(sin));
+	}
 	if (!listener) {
 		fprintf(stderr, "Could not create a listener: %s\n",strerror(errno));
 		return 1;
 	}
 
+	if (unix_path && !unix_listener) {
+		struct sockaddr_un sun;
+
+		if (strlen(unix_path) >= sizeof(sun.sun_path)) {
+			fprintf(stderr, "'%s' is too long for a socket path.\n", unix_path);
+			return 1;
+		}
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strcpy(sun.sun_path, unix_path);
+		unlink(unix_path);
+
+		/* access control is up to the socket's (or its directory's) permissions */
+		unix_listener = evconnlistener_new_bind(base, listener_cb, (void *)base,
+		    LEV_OPT_CLOSE_ON_FREE, -1,
+		    (struct sockaddr*)&sun, sizeof(sun));
+		if (!unix_listener) {
+			fprintf(stderr, "Could not listen on %s: %s\n",unix_path,strerror(errno));
+			return 1;
+		}
+	}
+
 	signal_event = evsignal_new(base, SIGINT, signal_cb, (void *)base);
 	if (!signal_event || event_add(signal_event, NULL)<0) {
 		fprintf(stderr, "Could not create/add a signal event: %s\n",strerror(errno));
 		return 1;
 	}
-	timer_event = event_new(base, -1, EV_TIMEOUT|EV_PERSIST, timer_cb, NULL);
-	if (!timer_event || event_add(timer_event, &loop_dly)<0) {
-		fprintf(stderr, "Could not create/add a timer event: %s\n",strerror(errno));
+	if (metrics_port) {
+		char *addr = "0.0.0.0";
+		char *mp = strrchr(metrics_port,':');
+		char *ep;
+		unsigned long p;
+
+		if (mp) {
+			*mp++ = '\0';
+			addr = metrics_port;
+		} else
+			mp = metrics_port;
+		p = strtoul(mp, &ep, 10);
+		if(!*mp || *ep || p>65535 || p==0 ) {
+			fprintf(stderr, "'%s' is not a valid port. Port numbers need to be >0 and <65536.\n", mp);
+			return 1;
+		}
+		metrics_http = evhttp_new(base);
+		if (!metrics_http || evhttp_bind_socket(metrics_http, addr, p) < 0) {
+			fprintf(stderr, "Could not create the metrics listener: %s\n",strerror(errno));
+			return 1;
+		}
+		evhttp_set_cb(metrics_http, "/metrics", metrics_cb, NULL);
+	}
+
+	trace_event = evsignal_new(base, SIGUSR1, trace_cb, NULL);
+	if (!trace_event || event_add(trace_event, NULL)<0) {
+		fprintf(stderr, "Could not create/add a signal event: %s\n",strerror(errno));
+		return 1;
+	}
+	handoff_event = evsignal_new(base, SIGUSR2, handoff_cb, NULL);
+	if (!handoff_event || event_add(handoff_event, NULL)<0) {
+		fprintf(stderr, "Could not create/add a signal event: %s\n",strerror(errno));
 		return 1;
 	}
+	reload_event = evsignal_new(base, SIGHUP, reload_cb, NULL);
+	if (!reload_event || event_add(reload_event, NULL)<0) {
+		fprintf(stderr, "Could not create/add a signal event: %s\n",strerror(errno));
+		return 1;
+	}
+	if (proxy_active()) {
+		if (proxy_start() < 0) {
+			fprintf(stderr, "Could not start the proxy: %s\n",strerror(errno));
+			return 1;
+		}
+	} else {
+		timer_event = event_new(base, -1, EV_TIMEOUT|EV_PERSIST, timer_cb, NULL);
+		if (!timer_event || event_add(timer_event, &loop_dly)<0) {
+			fprintf(stderr, "Could not create/add a timer event: %s\n",strerror(errno));
+			return 1;
+		}
+
+		if (log_file && dlog_open(log_file, log_size*1024) < 0) {
+			fprintf(stderr, "Could not open %s: %s\n",log_file,strerror(errno));
+			return 1;
+		}
+
+		if (shm_file && shm_export(shm_file) < 0) {
+			fprintf(stderr, "Could not export %s: %s\n",shm_file,strerror(errno));
+			return 1;
+		}
+
+		if (pub_group && pub_open(pub_group) < 0) {
+			fprintf(stderr, "Could not publish to %s: %s\n",pub_group,strerror(errno));
+			return 1;
+		}
+
+		bus_sync();
+	}
 
-	bus_sync();
 	event_base_dispatch(base);
-	bus_free_data();
+	if (proxy_active()) {
+		proxy_stop();
+	} else {
+		pub_close();
+		shm_unexport();
+		dlog_close();
+		ckpt_close();
+		bus_free_data();
+	}
 
 	evconnlistener_free(listener);
+	if (unix_listener) {
+		evconnlistener_free(unix_listener);
+		if (!handed_off)
+			unlink(unix_path);
+	}
+	if (metrics_http)
+		evhttp_free(metrics_http);
 	event_free(signal_event);
-	event_free(timer_event);
+	event_free(trace_event);
+	event_free(handoff_event);
+	event_free(reload_event);
+	if (timer_event)
+		event_free(timer_event);
+	event_free(ready_event);
 	event_base_free(base);
 
+	/* the bus is free: let the new process continue */
+	if (handed_off)
+		handoff_finish();
+
 	printf("done\n");
 	return 0;
 }
@@ -375,420 +648,253 @@ listener_cb(struct evconnlistener *listener, evutil_socket_t fd,
 	}
 }
 
-static int
-interface_setup(struct event_base *base, evutil_socket_t fd)
+static void
+count_in_cb(struct evbuffer *buf, const struct evbuffer_cb_info *info, void *arg)
+{
+	metrics.bytes_in += info->n_added;
+}
+
+static void
+count_out_cb(struct evbuffer *buf, const struct evbuffer_cb_info *info, void *arg)
+{
+	metrics.bytes_out += info->n_deleted;
+}
+
+static struct bufferevent *
+conn_new(evutil_socket_t fd)
 {
 	struct bufferevent *bev;
+	struct _conn *conn;
+
+	conn = malloc(sizeof(*conn));
+	if (conn == NULL)
+		return NULL;
+	memset(conn,0,sizeof(*conn));
+	conn->more = evtimer_new(base, conn_more_cb, conn);
+	if (conn->more == NULL) {
+		free(conn);
+		return NULL;
+	}
 	bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
-	if (bev == NULL)
-		return -1;
+	if (bev == NULL) {
+		event_free(conn->more);
+		free(conn);
+		return NULL;
+	}
+	conn->bev = bev;
+	conn->next = conn_list;
+	conn_list = conn;
+
+	bufferevent_setcb(bev, conn_readcb, NULL, conn_eventcb, conn);
+	evbuffer_add_cb(bufferevent_get_input(bev), count_in_cb, NULL);
+	evbuffer_add_cb(bufferevent_get_output(bev), count_out_cb, NULL);
+	metrics.conns++;
+	metrics.conns_total++;
+	bufferevent_enable(bev, EV_READ);
 
-	bufferevent_setcb(bev, conn_readcb, NULL, conn_eventcb, NULL);
+	/* after a handoff, the input may hold commands already */
+	conn_ready(conn);
+	return bev;
+}
 
+static int
+interface_setup(struct event_base *base, evutil_socket_t fd)
+{
+	struct bufferevent *bev = conn_new(fd);
+
+	if (bev == NULL)
+		return -1;
 	bufferevent_write(bev, MSG_HELLO, strlen(MSG_HELLO));
-	bufferevent_enable(bev, EV_READ);
 	return 0;
 }
 
-static const char std_help[] = "=\n\
-Known functions:\n\
-h     print help messages\n\
-i A B read bit from input port A, pos B\n\
-I A B report bit from output port A, pos B\n\
-s A B set bit at output port A, pos B\n\
-c A B clear bit at output port A, pos B\n\
-m     monitor a bit (see help for subcommands)\n\
-d     set/query poll delay\n\
-D     dump port info\n\
-\n\
-Send 'hX' for help on function X.\n\
-.\n";
-static const char std_help_h[] = "=\n\
-h  send a generic help message, list functions\n\
-hX send specific help on function X\n\
-.\n";
-static const char std_help_d[] = "=\n\
-d   report current poll frequency (seconds).\n\
-dc  report poll delay (seconds).\n\
-d X set poll frequency to X (0.001 < X < 1000 seconds).\n\
-.\n";
-static const char std_help_m[] = "=\n\
-m          list current monitor records.\n\
-           This includes timed set/clear commands.\n\
-m+ A B D   report changes of bit on input port A, offset B.\n\
-           D is + - * for positive, negative, or both edges.\n\
-		   The command replies with a monitor ID.\n\
-		   This monitor will be deallocated when the channel closes.\n\
-m# A B D I count changes, report at most every I seconds.\n\
-		   The command replies with a monitor ID.\n\
-		   This monitor will be deallocated when the channel closes.\n\
-m? X       Re-attach to a monitor whose channel has disconnected.\n\
-m- X       delete change monitor with monitor ID X.\n\
-.\n";
-static const char std_help_i[] = "=\n\
-i A B  read a bit on input port A, offset B.\n\
-.\n";
-static const char std_help_I[] = "=\n\
-I A B  read the state of bit on output port A, offset B.\n\
-.\n";
-static const char std_help_s[] = "=\n\
-s A B       set a bit on output port A, offset B.\n\
-s A B I   … for I seconds.\n\
-            This creates a one-shot monitor which persists until the timer\n\
-            runs out.\n\
-s A B I J … then clear for J seconds, repeat.\n\
-            This creates a monitor which persists if the channel closes.\n\
-            See 'hm' for reporting.\n\
-.\n";
-static const char std_help_c[] = "=\n\
-c A B  clear a bit on output port A, offset B.\n\
-c A B I   … for I seconds.\n\
-c A B I J … then set for J seconds, repeat.\n\
-            This creates a monitor which persists if the channel closes.\n\
-            See 'hm' for reporting.\n\
-.\n";
-static const char std_help_D[] = "=\n\
-D   dump port list (human-readable version).\n\
-Da# send a keepalive message every # seconds.\n\
-Dp  dump port list (parsed list).\n";
-static const char std_help_D2[] = "\
-D-  Disconnect; simulates a connection problem.\n\
-Ds  Read-port read commands will read H.\n\
-Dc  Read-port read commands will read L.\n\
-DS  Write-port read commands will read H.\n\
-DC  Write-port read commands will read L.\n\
-DI  Write-port read commands will read the expected value.\n\
-Dr  Port reads are deterministic.\n\
-DR  Port reads are 10% likely to read the opposite state.\n";
-static const char std_help_unknown[] = "=\n\
-You requested help on an unknown function (%d).\n\
-Send 'h' for a list of known functions.\n\
-.\n";
+static int
+take_listener(int fd, enum handoff_listen kind)
+{
+	struct evconnlistener *lev;
+
+	if (kind == HO_LISTEN_UNIX && (unix_listener || !unix_path)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (kind == HO_LISTEN_TCP && listener) {
+		errno = EINVAL;
+		return -1;
+	}
+	lev = evconnlistener_new(base, listener_cb, (void *)base,
+	    LEV_OPT_REUSEABLE|LEV_OPT_CLOSE_ON_FREE, -1, fd);
+	if (lev == NULL)
+		return -1;
+	if (kind == HO_LISTEN_UNIX)
+		unix_listener = lev;
+	else
+		listener = lev;
+	return 0;
+}
 
+/* Give this connection a turn in the next round of ready_cb(). */
 static void
-send_help(struct evbuffer *out, char h)
+conn_ready(struct _conn *conn)
 {
-	switch(h) {
-	case 0:
-		evbuffer_add(out,std_help,sizeof(std_help)-1);
-		break;
-	case 'h':
-		evbuffer_add(out,std_help_h,sizeof(std_help_h)-1);
-		break;
-	case 'd':
-		evbuffer_add(out,std_help_d,sizeof(std_help_d)-1);
-		break;
-	case 'm':
-		evbuffer_add(out,std_help_m,sizeof(std_help_m)-1);
-		break;
-	case 'i':
-		evbuffer_add(out,std_help_i,sizeof(std_help_i)-1);
-		break;
-	case 'I':
-		evbuffer_add(out,std_help_I,sizeof(std_help_I)-1);
-		break;
-	case 's':
-		evbuffer_add(out,std_help_s,sizeof(std_help_s)-1);
-		break;
-	case 'c':
-		evbuffer_add(out,std_help_c,sizeof(std_help_c)-1);
-		break;
-	case 'D':
-		evbuffer_add(out,std_help_D,sizeof(std_help_D)-1);
-#ifdef DEMO
-		evbuffer_add(out,std_help_D2,sizeof(std_help_D2)-1);
-#endif
-		evbuffer_add(out,".\n",2);
-		break;
-	default:
-		evbuffer_add_printf(out,std_help_unknown, h);
-		break;
+	if (!conn->ready) {
+		conn->ready = 1;
+		conn->next_ready = NULL;
+		*ready_tail = conn;
+		ready_tail = &conn->next_ready;
 	}
+	if (!evtimer_pending(ready_event, NULL))
+		evtimer_add(ready_event, &zero_tv);
 }
 
+/* Wait with reading stopped: for the next round (TV == NULL), or for
+   TV to pass. */
 static void
-parse_input(struct bufferevent *bev, const char *line)
+conn_defer(struct _conn *conn, const struct timeval *tv)
 {
-	struct evbuffer *out = bufferevent_get_output(bev);
-	int p1,p2;
-	float p3,p4;
-	int res = 0;
-
-	switch(*line) {
-	case 'D':
-		if (line[1] == 'p') {
-			bus_sync();
-			evbuffer_add_printf(out,"=Reporting bus data\n");
-			bus_enum(report_bus, out);
-			evbuffer_add(out,".\n",2);
-		} else if(line[1] == 'a') {
-			int mon_id;
-			if(sscanf(line+2,"%g",&p3) != 1) {
-				evbuffer_add_printf(out,"?Da needs a float parameter.\n");
-				break;
-			}
-			mon_id = mon_new(MON_KEEPALIVE,0,0, bev, (int)(p3*1000),0);
-			if(mon_id < 1) {
-				evbuffer_add_printf(out,"?'Da' error creating monitor: %s\n",strerror(errno));
-				return;
-			}
-			evbuffer_add_printf(out,"!+%d monitor created\n",mon_id);
-
-#ifdef DEMO
-		} else if(line[1] == '-') {
-			struct timeval dly = {0,50000}; /* 1/20 sec */
-			struct ev_at_buf *eb = malloc(sizeof(struct ev_at_buf));
-			if (eb == NULL) {
-				evbuffer_add(out,"-no memory\n",4);
-				return;
-			}
-			struct event *ev = NULL;
+	bufferevent_disable(conn->bev, EV_READ);
+	if (tv)
+		evtimer_add(conn->more, tv);
+	else
+		conn_ready(conn);
+}
 
-			evbuffer_add(out,"+OK\n",4);
-			mon_delbuf(bev);
-			bufferevent_flush(bev,EV_WRITE,BEV_FLUSH);
+/* Run the complete lines in the input, within the budget and rate. */
+static void
+conn_run(struct _conn *conn)
+{
+	struct bufferevent *bev = conn->bev;
+	struct evbuffer *buf = bufferevent_get_input(bev);
+	int budget = conn_budget;
+	struct timeval now,tv;
 
-			eb->bev = bev;
-			eb->ev = event_new(base, -1, EV_TIMEOUT, off_cb, eb);
-			if (!eb->ev || event_add(eb->ev, &dly)<0) {
-				fprintf(stderr, "Could not create/add a timeout event: %s\n",strerror(errno));
-				free(ev);
-				return;
-			}
-		} else if(line[1] == 'r') {
-			demo_rand = 0;
-			evbuffer_add(out,"+OK\n",4);
-		} else if(line[1] == 'R') {
-			demo_rand = 1;
-			evbuffer_add(out,"+OK\n",4);
-		} else if(line[1] == 's') {
-			demo_state_r=1;
-			evbuffer_add(out,"+OK\n",4);
-		} else if(line[1] == 'c') {
-			demo_state_r=0;
-			evbuffer_add(out,"+OK\n",4);
-		} else if(line[1] == 'S') {
-			demo_state_w=1;
-			demo_state_skip=0;
-			evbuffer_add(out,"+OK\n",4);
-		} else if(line[1] == 'C') {
-			demo_state_w=0;
-			demo_state_skip=0;
-			evbuffer_add(out,"+OK\n",4);
-		} else if(line[1] == 'I') {
-			demo_state_skip=1;
-			evbuffer_add(out,"+OK\n",4);
-#endif
-		} else if (!line[1]) {
-			FILE *fd = bus_description(); 
-			int len;
-			char fbuf[4096],*pbuf;
-			char cont = 0;
-			if (fd == NULL) {
-				evbuffer_add_printf(out,"?Could not open description: %s\n",strerror(errno));
-				break;
-			}
+	trace_stamp();
+	event_base_gettimeofday_cached(base, &now);
+	while(1) {
+		char *line;
+		size_t len;
 
-			evbuffer_add_printf(out,"=port data\n");
-			while(1) {
-				pbuf = fgets(fbuf,sizeof(fbuf),fd);
-				if (pbuf == NULL)
-					break;
-				len = strlen(pbuf);
-				if (!cont && *pbuf == '.')
-					evbuffer_add(out,".",1);
-				evbuffer_add(out,pbuf,len);
-				cont = pbuf[len-1] != '\n';
-			}
-			fclose(fd);
-			evbuffer_add(out,".\n",2);
-		} else {
-			evbuffer_add_printf(out,"?Unknown subcommand: '%c'. Help with 'hD'.\n",line[1]);
+		if (evbuffer_search_eol(buf, NULL, NULL, EVBUFFER_EOL_CRLF).pos < 0) {
+			bufferevent_enable(bev, EV_READ);
+			return;
 		}
-		break;
-	case 'd':
-		if (line[1] == 'c') {
-			struct timeval t1,t2;
-			int td;
-			gettimeofday(&t1,NULL);
-			bus_sync();
-			mon_sync();
-			bus_sync();
-			gettimeofday(&t2,NULL);
-			td = (t2.tv_sec-t1.tv_sec)*1000 + (t2.tv_usec-t1.tv_usec)/1000;
-			evbuffer_add_printf(out,"+%d.%03d sec\n",td/1000,td%1000);
-		} else if (line[1]) {
-			if(sscanf(line+1,"%g",&p3) != 1) {
-				evbuffer_add_printf(out,"?d needs a float parameter.\n");
-				break;
-			}
-			if(p3>100000 || p3 < 0.00099) {
-				evbuffer_add_printf(out,"?not a valid timer parameter, 0.001 < DELAY < 10000.\n");
-				break;
-			}
-			set_loop_timer(p3);
-			if (event_del(timer_event) || event_add(timer_event, &loop_dly)<0) {
-				evbuffer_add_printf(out,"?changing the timer failed: %s\n",strerror(errno));
-				break;
-			}
-			evbuffer_add_printf(out,"+Loop timer changed.\n");
-		} else {
-			evbuffer_add_printf(out,"+%g seconds per loop.\n", loop_dly.tv_sec+loop_dly.tv_usec/1000000.);
+		if (budget <= 0) {
+			metrics.conns_deferred++;
+			conn_defer(conn, NULL);
+			return;
 		}
-		break;
-	case 'm':
-		if(line[1] == 0) {
-			evbuffer_add_printf(out,"=Monitors:\n");
-			mon_enum(report_mon, out);
-			evbuffer_add(out,".\n",2);
-		} else if(line[1] == '+' || line[1] == '#') {
-			unsigned char edge;
-			enum mon_type typ;
-			int mon_id;
-			int res = sscanf(line+2,"%d %d %c %f",&p1,&p2,&edge,&p3);
-			if (res < 3) {
-				evbuffer_add_printf(out,"?'m%c' needs two numeric and one char parameters.\n",line[1]);
-				break;
-			}
-			if (res < 4)
-				p3 = 1;
-
-			switch(edge) {
-			case '+':
-				typ = (line[1] == '+' ? MON_REPORT_H : MON_COUNT_H);
-				break;
-			case '-':
-				typ = (line[1] == '+' ? MON_REPORT_L : MON_COUNT_L);
-				break;
-			case '*':
-				typ = (line[1] == '+' ? MON_REPORT : MON_COUNT);
-				break;
-			default:
-				evbuffer_add_printf(out,"?'m%c' last parameter must be one of + - *\n",line[1]);
-				return;
-			}
-			mon_id = mon_new(typ,p1,p2, bev, (int)(p3*1000),0);
-			if(mon_id < 1) {
-				evbuffer_add_printf(out,"?'m%c' error creating monitor: %s\n",line[1],strerror(errno));
-				return;
-			}
-			evbuffer_add_printf(out,"!+%d monitor created\n",mon_id);
-		} else if(line[1] == '-') {
-			if(sscanf(line+2,"%d",&p1) != 1) {
-				evbuffer_add_printf(out,"?'m-' needs a numeric parameter.\n");
-				return;
-			}
-			if(mon_del(p1,bev) < 0) {
-				evbuffer_add_printf(out,"?'m-' error deleting monitor %d: %s\n",p1,strerror(errno));
-				return;
-			}
-			evbuffer_add_printf(out,"+Monitor %d deleted.\n",p1);
-		} else if(line[1] == '?') {
-			if(sscanf(line+2,"%d",&p1) != 1) {
-				evbuffer_add_printf(out,"?'m?' needs a numeric parameter.\n");
-				return;
-			}
-			if(mon_grab(p1,bev) < 0) {
-				evbuffer_add_printf(out,"?'m?' error taking monitor %d: %s\n",p1,strerror(errno));
+		if (conn_rate) {
+			tv.tv_sec = conn->window.tv_sec + 1;
+			tv.tv_usec = conn->window.tv_usec;
+			if (!evutil_timercmp(&now, &tv, <)) {
+				conn->window = now;
+				conn->n_window = 0;
+			} else if (conn->n_window >= conn_rate) {
+				metrics.conns_throttled++;
+				evutil_timersub(&tv, &now, &tv);
+				conn_defer(conn, &tv);
 				return;
 			}
-			evbuffer_add_printf(out,"+Monitor %d attached.\n",p1);
-		} else {
-			evbuffer_add_printf(out,"?Unknown subcommand: '%c'. Help with 'hm'.\n",line[1]);
-		}
-		break;
-	case 'i':
-	case 'I':
-	case 's':
-	case 'c':
-		if((res = sscanf(line+1,"%d %d %f %f",&p1,&p2,&p3,&p4)) < 2) {
-			evbuffer_add_printf(out,"?'%c' needs two integer parameters and at most two floats.\n",*line);
-			break;
-		}
-		if (res < 3)
-			p3 = 0;
-		if (res < 4)
-			p4 = 0;
-		switch(*line) {
-		case 'i':
-			bus_sync();
-			res = bus_read_bit(p1,p2);
-			if(res < 0) {
-				evbuffer_add_printf(out,"?error: %s\n",strerror(errno));
-				break;
-			}
-			evbuffer_add_printf(out,"+%d\n",res);
-			break;
-		case 'I':
-			res = bus_read_wbit(p1,p2);
-			if(res < 0) {
-				evbuffer_add_printf(out,"?error: %s\n",strerror(errno));
-				break;
-			}
-			evbuffer_add_printf(out,"+%d\n",res);
-			break;
-		case 's':
-			if (p3)
-				res = mon_new(p4 ? MON_SET_LOOP : MON_SET_ONCE, p1,p2, bev, (int)(p3*1000),(int)(p4*1000));
-			else
-				res = bus_write_bit(p1,p2,1);
-			if (res < 0) {
-				if (errno == EEXIST)
-					evbuffer_add_printf(out,"%calready set\n", p3 ? '?' : '+');
-				else
-					evbuffer_add_printf(out,"?error: %s\n",strerror(errno));
-			} else if (p3)
-				evbuffer_add_printf(out,"!+%d Set, monitor started.\n", res);
-			else
-				evbuffer_add_printf(out,"+Set.\n");
-			bus_sync();
-			break;
-		case 'c':
-			if (p3)
-				res = mon_new(p4 ? MON_CLEAR_LOOP : MON_CLEAR_ONCE, p1,p2, bev, (int)(p3*1000),(int)(p4*1000));
-			else
-				res = bus_write_bit(p1,p2,0);
-			if (res < 0) {
-				if (errno == EEXIST)
-					evbuffer_add_printf(out,"%calready cleared\n", p3 ? '?' : '+');
-				else
-					evbuffer_add_printf(out,"?error: %s\n",strerror(errno));
-			} else if (p3)
-				evbuffer_add_printf(out,"!+%d Cleared, monitor started.\n", res);
-			else
-				evbuffer_add_printf(out,"+Cleared.\n");
-			bus_sync();
-			break;
+			conn->n_window++;
 		}
-		break;
-	case 'h':
-		send_help(out,line[1]);
-		break;
-	case 0:
-		evbuffer_add_printf(out,"?Empty line. Help with 'h'.\n");
-		break;
-	default:
-		evbuffer_add_printf(out,"?Unknown character: '%c'. Help with 'h'.\n",*line);
-		break;
+
+		line = evbuffer_readln(buf, &len, EVBUFFER_EOL_CRLF);
+		budget -= (cmd_class(line) == CMD_DUMP) ? CMD_COST_DUMP : 1;
+		if(debug)
+			printf("Read on %d: %s.\n", bufferevent_getfd(bev),line);
+		if (proxy_active())
+			proxy_parse(bev,line);
+		else
+			parse_input(bev,line);
+		free(line);
 	}
 }
 
 static void
 conn_readcb(struct bufferevent *bev, void *user_data)
 {
-	struct evbuffer *buf = bufferevent_get_input(bev);
-	while(1) {
-		char *line;
-		size_t len;
+	struct _conn *conn = user_data;
 
-		line = evbuffer_readln(buf, &len, EVBUFFER_EOL_CRLF);
-		if (line == NULL)
-			break;
-		if(debug)
-			printf("Read on %d: %s.\n", bufferevent_getfd(bev),line);
-		parse_input(bev,line);
-		free(line);
+	/* Some input is waiting for a later turn already. */
+	if (conn->ready || evtimer_pending(conn->more, NULL))
+		return;
+	conn_run(conn);
+}
+
+static void
+conn_more_cb(evutil_socket_t fd, short events, void *user_data)
+{
+	conn_run(user_data);
+}
+
+static int
+conn_urgent(struct _conn *conn)
+{
+	char line[2] = "";
+
+	evbuffer_copyout(bufferevent_get_input(conn->bev), line, sizeof(line)-1);
+	return cmd_class(line) == CMD_OUTPUT;
+}
+
+/* One round: a turn for every connection on ready_list, those whose
+   next command changes outputs first. A connection which runs out of
+   budget again waits for the next round; in between, the event loop
+   polls the sockets and runs the bus timer, on the same priority. */
+static void
+ready_cb(evutil_socket_t fd, short events, void *user_data)
+{
+	struct _conn *urgent = NULL, **u = &urgent;
+	struct _conn *rest = NULL, **r = &rest;
+	struct _conn *conn, *next;
+
+	for(conn = ready_list; conn; conn = next) {
+		next = conn->next_ready;
+		conn->ready = 0;
+		if (conn_urgent(conn)) {
+			*u = conn;
+			u = &conn->next_ready;
+		} else {
+			*r = conn;
+			r = &conn->next_ready;
+		}
+	}
+	*u = rest;
+	*r = NULL;
+	ready_list = NULL;
+	ready_tail = &ready_list;
+
+	for(conn = urgent; conn; conn = next) {
+		next = conn->next_ready;
+		conn_run(conn);
+	}
+}
+
+/* Forget the connection everywhere, then free it and its socket. */
+static void
+conn_free(struct _conn *conn)
+{
+	struct _conn **pconn;
+
+	if (proxy_active())
+		proxy_delbuf(conn->bev);
+	else
+		mon_delbuf(conn->bev);
+
+	for(pconn = &conn_list; *pconn != conn; pconn = &(*pconn)->next)
+		;
+	*pconn = conn->next;
+	if (conn->ready) {
+		for(pconn = &ready_list; *pconn != conn; pconn = &(*pconn)->next_ready)
+			;
+		*pconn = conn->next_ready;
+		if (*pconn == NULL)
+			ready_tail = pconn;
 	}
+	event_free(conn->more);
+	if (conn->closing)
+		event_free(conn->closing);
+	bufferevent_free(conn->bev);
+	metrics.conns--;
+	free(conn);
 }
 
 static void
@@ -801,8 +907,30 @@ conn_eventcb(struct bufferevent *bev, short events, void *user_data)
 	}
 	/* None of the other events can happen here, since we haven't enabled
 	 * timeouts */
-	mon_delbuf(bev);
-	bufferevent_free(bev);
+	conn_free(user_data);
+}
+
+static void
+conn_close_cb(evutil_socket_t fd, short events, void *user_data)
+{
+	conn_free(user_data);
+}
+
+int conn_close(struct bufferevent *bev, const struct timeval *dly)
+{
+	struct _conn *conn;
+
+	bufferevent_getcb(bev, NULL, NULL, NULL, (void **)&conn);
+	if (dly == NULL) {
+		conn_free(conn);
+		return 0;
+	}
+	if (conn->closing)
+		return 0;
+	conn->closing = evtimer_new(base, conn_close_cb, conn);
+	if (conn->closing == NULL)
+		return -1;
+	return evtimer_add(conn->closing, dly);
 }
 
 static void
@@ -816,23 +944,98 @@ signal_cb(evutil_socket_t sig, short events, void *user_data)
 	event_base_loopexit(base, &delay);
 }
 
+static void
+trace_cb(evutil_socket_t sig, short events, void *user_data)
+{
+	int res = trace_save(trace_file);
+	if (res < 0)
+		fprintf(stderr,"Could not write %s: %s\n",trace_file,strerror(-res));
+}
+
+static void
+reload_cb(evutil_socket_t sig, short events, void *user_data)
+{
+	int res;
+
+	if (proxy_active())
+		return;
+	res = bus_reload();
+	if (res < 0)
+		fprintf(stderr,"Could not reload the bus configuration: %s\n",strerror(errno));
+	else if (debug)
+		printf("Reloaded the bus configuration; %d dropped.\n",res);
+}
+
+/* Pass the sockets and all state to a new copy of ourselves, and exit. */
+static void
+handoff_cb(evutil_socket_t sig, short events, void *user_data)
+{
+	struct _conn *conn;
+
+	if (proxy_active()) {
+		fprintf(stderr,"Handoff is not supported in proxy mode.\n");
+		return;
+	}
+	printf("Handing off to a new process.\n");
+	if (handoff_begin(args) < 0) {
+		fprintf(stderr,"Could not start the new process: %s\n",strerror(errno));
+		return;
+	}
+	handoff_listener(evconnlistener_get_fd(listener), HO_LISTEN_TCP);
+	if (unix_listener)
+		handoff_listener(evconnlistener_get_fd(unix_listener), HO_LISTEN_UNIX);
+	/* conn_list only holds live connections; those which 'D-' is about
+	   to close stay behind and go away with us */
+	for(conn = conn_list; conn; conn = conn->next)
+		if (conn->closing == NULL)
+			handoff_conn(conn->bev);
+	if (handoff_commit() < 0) {
+		fprintf(stderr,"Handoff failed, continuing: %s\n",strerror(errno));
+		return;
+	}
+	handed_off = 1;
+	event_base_loopbreak(base);
+}
+
+static void
+metrics_cb(struct evhttp_request *req, void *arg)
+{
+	struct evbuffer *buf = evbuffer_new();
+
+	if (buf == NULL) {
+		evhttp_send_error(req, HTTP_INTERNAL, NULL);
+		return;
+	}
+	metrics_report(buf);
+	evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type", "text/plain; version=0.0.4");
+	evhttp_send_reply(req, HTTP_OK, "OK", buf);
+	evbuffer_free(buf);
+}
+
 static void
 timer_cb(evutil_socket_t sig, short events, void *user_data)
 {
+	static struct timeval last;
+	struct timeval t1,t2;
+	long td;
+
 	if(debug)
 		printf("Loop.\n");
+	gettimeofday(&t1,NULL);
+	if (metrics.cycles++) {
+		/* late by more than half a period? */
+		td = (t1.tv_sec-last.tv_sec)*1000000 + (t1.tv_usec-last.tv_usec);
+		if (td > (loop_dly.tv_sec*1000000 + loop_dly.tv_usec)*3/2)
+			metrics.overruns++;
+	}
+	last = t1;
+
 	bus_sync();
 	mon_sync();
-}
 
-#ifdef DEMO
-static void
-off_cb(evutil_socket_t sig, short events, void *user_data)
-{
-	struct ev_at_buf *eb = (struct ev_at_buf *)user_data;
-	bufferevent_free(eb->bev);
-	event_free(eb->ev);
-	free(eb);
+	gettimeofday(&t2,NULL);
+	td = (t2.tv_sec-t1.tv_sec)*1000000 + (t2.tv_usec-t1.tv_usec);
+	metrics.cycle_usec = td;
+	if (metrics.cycle_usec_max < td)
+		metrics.cycle_usec_max = td;
 }
-
-#endif
@@ -1,11 +1,26 @@
 #ifndef WAGO_H
 #define WAGO_H
 
+#include <sys/time.h>
+
 struct event_base;
 extern struct event_base *base;
 
 extern char debug;
 
+/* bus cycle time */
+extern struct timeval loop_dly;
+int change_loop_timer(float d);
+
+/* Drop a client connection and everything attached to it, after DLY
+   (so that pending output gets out) or, if DLY is NULL, right away.
+   Not from within the connection's own command processing. */
+struct bufferevent;
+int conn_close(struct bufferevent *bev, const struct timeval *dly);
+
+/* where to save the trace buffer */
+extern char *trace_file;
+
 #ifdef DEMO
 extern char demo_rand;
 extern char demo_state_r;
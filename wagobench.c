@@ -0,0 +1,566 @@
+/*
+  Load generator for the wago daemon.
+
+  Opens N connections, creates M monitors of each type on every one of
+  them, then issues a configurable mix of commands at a fixed rate per
+  connection (or as fast as possible). It measures command round-trip
+  latency and, by toggling the simulated inputs of a DEMO daemon,
+  the latency from an input edge to its change notification.
+
+  Results are printed as JSON.
+
+  It is available under the GNU General Public license, version 3.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <event2/bufferevent.h>
+#include <event2/buffer.h>
+#include <event2/util.h>
+#include <event2/event.h>
+
+/* Configuration */
+static const char *host = "127.0.0.1";
+static int port = 59995;
+static int n_conn = 4;
+static int n_mon = 2;
+static float rate = 100; /* commands per second and connection; 0: closed loop */
+static float duration = 10;
+static float edge_dly = 0.2; /* seconds between input toggles; 0: off */
+static int in_slot = 1, in_bits = 8;
+static int out_slot = 2, out_bits = 16;
+static char *mix = "i:5,I:2,s:1,c:1,m:1";
+
+/* command mix */
+struct mix_ent {
+	char cmd;
+	int weight;
+};
+#define MIX_MAX 10
+static struct mix_ent mix_tab[MIX_MAX];
+static int mix_len = 0, mix_total = 0;
+
+/* latency samples, usec */
+struct samples {
+	unsigned long *v;
+	unsigned int n, max;
+};
+static struct samples rtt, edge;
+
+/* A pending command, waiting for its reply */
+enum pend_typ {
+	P_SETUP,
+	P_OUTMON, /* setup; remember the monitor ID for cleanup */
+	P_CMD,
+	P_CLEANUP,
+};
+struct pend {
+	enum pend_typ typ;
+	struct timeval sent;
+};
+#define PEND_MAX 1024
+
+struct bconn {
+	struct bufferevent *bev;
+	int idx;
+	char ready;
+	char in_multi;
+	struct pend pend[PEND_MAX];
+	unsigned int p_head, p_tail;
+	struct event *tick;
+	int *outmon;
+	int n_outmon;
+	unsigned long sent, done, errors, events;
+};
+static struct bconn *conns;
+static int n_ready = 0, n_setup_left = 0;
+
+static struct event_base *base;
+static struct bufferevent *ctl = NULL;
+static struct event *edge_event, *stop_event;
+static struct timeval t_start, t_stop, t_edge;
+static char edge_state = 0;
+static unsigned long toggles = 0;
+static char running = 0, stopping = 0;
+
+static void usage(int err)
+{
+	fprintf(err ? stderr : stdout, "\
+Usage: wagobench OPTION ...\n\
+Options:\n\
+-H|--host #     Connect to host # (default %s)\n\
+-p|--port #     Connect to port # (default %d)\n\
+-n|--conns #    Open # connections (default %d)\n\
+-m|--mons #     Create # monitors of each type per connection (default %d)\n\
+-r|--rate #     Send # commands per second per connection; 0: closed loop (default %g)\n\
+-t|--time #     Run for # seconds (default %g)\n\
+-e|--edge #     Toggle the simulated inputs every # seconds; 0: don't (default %g)\n\
+-x|--mix #      Command mix (default %s)\n\
+                i I s c: bit access; m: monitor list; p: port dump\n\
+-i|--in #:#     Input slot and bit count (default %d:%d)\n\
+-o|--out #:#    Output slot and bit count (default %d:%d)\n\
+-h|--help       Print this message\n\
+\n\
+The daemon needs to be a DEMO build for the edge latency test.\n\
+", host,port, n_conn,n_mon, rate,duration,edge_dly, mix, in_slot,in_bits, out_slot,out_bits);
+	exit(err);
+}
+
+static long tv_usec(const struct timeval *a, const struct timeval *b)
+{
+	return (b->tv_sec-a->tv_sec)*1000000 + (b->tv_usec-a->tv_usec);
+}
+
+static void sample_add(struct samples *s, unsigned long v)
+{
+	if (s->n == s->max) {
+		unsigned int max = s->max ? 2*s->max : 1024;
+		unsigned long *nv = realloc(s->v, max*sizeof(*nv));
+		if (nv == NULL)
+			return;
+		s->v = nv;
+		s->max = max;
+	}
+	s->v[s->n++] = v;
+}
+
+static int ulcmp(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+	return (x > y) - (x < y);
+}
+
+static void sample_json(const char *name, struct samples *s)
+{
+	unsigned long long sum = 0;
+	unsigned int i;
+
+	printf("\"%s\": {\"count\": %u", name, s->n);
+	if (s->n) {
+		qsort(s->v, s->n, sizeof(*s->v), ulcmp);
+		for(i = 0; i < s->n; i++)
+			sum += s->v[i];
+		printf(", \"mean\": %llu, \"min\": %lu, \"p50\": %lu, \"p90\": %lu, \"p99\": %lu, \"max\": %lu",
+			sum/s->n, s->v[0], s->v[s->n/2], s->v[s->n*9/10], s->v[s->n*99/100], s->v[s->n-1]);
+	}
+	printf("}");
+}
+
+static int parse_mix(const char *m)
+{
+	while(*m) {
+		char cmd;
+		int w, len;
+
+		if (mix_len == MIX_MAX)
+			return -1;
+		if (sscanf(m, "%c:%d%n", &cmd,&w,&len) != 2 || !strchr("iIscmp",cmd) || w < 0)
+			return -1;
+		m += len;
+		if (*m == ',')
+			m++;
+		else if (*m)
+			return -1;
+		mix_tab[mix_len].cmd = cmd;
+		mix_tab[mix_len].weight = w;
+		mix_len++;
+		mix_total += w;
+	}
+	return mix_total ? 0 : -1;
+}
+
+static void send_cmd(struct bconn *c, enum pend_typ typ, const char *fmt, ...)
+{
+	struct pend *p;
+	va_list ap;
+
+	if (c->p_head-c->p_tail >= PEND_MAX) {
+		c->errors++;
+		return;
+	}
+	p = &c->pend[c->p_head++ % PEND_MAX];
+	p->typ = typ;
+	gettimeofday(&p->sent, NULL);
+	va_start(ap, fmt);
+	evbuffer_add_vprintf(bufferevent_get_output(c->bev), fmt, ap);
+	va_end(ap);
+	if (typ == P_CMD)
+		c->sent++;
+}
+
+static void send_random(struct bconn *c)
+{
+	int r = rand() % mix_total;
+	int i;
+
+	for(i = 0; r >= mix_tab[i].weight; i++)
+		r -= mix_tab[i].weight;
+	switch(mix_tab[i].cmd) {
+	case 'i':
+		send_cmd(c, P_CMD, "i %d %d\n", in_slot, 1+rand()%in_bits);
+		break;
+	case 'I':
+	case 's':
+	case 'c':
+		send_cmd(c, P_CMD, "%c %d %d\n", mix_tab[i].cmd, out_slot, 1+rand()%out_bits);
+		break;
+	case 'm':
+		send_cmd(c, P_CMD, "m\n");
+		break;
+	case 'p':
+		send_cmd(c, P_CMD, "Dp\n");
+		break;
+	}
+}
+
+static void setup_conn(struct bconn *c)
+{
+	int i;
+
+	for(i = 0; i < n_mon; i++) {
+		send_cmd(c, P_SETUP, "m+ %d %d *\n", in_slot, 1+(c->idx+i)%in_bits);
+		send_cmd(c, P_SETUP, "m# %d %d * 1\n", in_slot, 1+(c->idx+i)%in_bits);
+		send_cmd(c, P_OUTMON, "s %d %d 3600\n", out_slot, 1+(c->idx*n_mon+2*i)%out_bits);
+		send_cmd(c, P_OUTMON, "s %d %d 0.05 0.05\n", out_slot, 1+(c->idx*n_mon+2*i+1)%out_bits);
+		n_setup_left += 4;
+	}
+	c->outmon = calloc(2*n_mon+1, sizeof(int));
+}
+
+static void start_run(void);
+
+static void got_reply(struct bconn *c, const char *line, struct timeval *now)
+{
+	struct pend *p;
+
+	if (c->p_tail == c->p_head) {
+		fprintf(stderr, "conn %d: unexpected reply: %s\n", c->idx, line);
+		return;
+	}
+	p = &c->pend[c->p_tail++ % PEND_MAX];
+	switch(p->typ) {
+	case P_SETUP:
+	case P_OUTMON:
+		if (*line == '?')
+			fprintf(stderr, "conn %d: setup failed: %s\n", c->idx, line);
+		else if (p->typ == P_OUTMON && line[0] == '!')
+			c->outmon[c->n_outmon++] = atoi(line+2);
+		if (--n_setup_left == 0)
+			start_run();
+		break;
+	case P_CMD:
+		c->done++;
+		if (*line == '?')
+			c->errors++;
+		sample_add(&rtt, tv_usec(&p->sent,now));
+		if (running && rate == 0)
+			send_random(c);
+		break;
+	case P_CLEANUP:
+		break;
+	}
+}
+
+static void got_line(struct bconn *c, const char *line)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	if (c->in_multi) {
+		if (line[0] == '.' && line[1] == 0) {
+			c->in_multi = 0;
+			got_reply(c, "=", &now);
+		}
+		return;
+	}
+	switch(line[0]) {
+	case '*':
+		if (!c->ready) {
+			c->ready = 1;
+			if (++n_ready == n_conn) {
+				int i;
+				for(i = 0; i < n_conn; i++)
+					setup_conn(&conns[i]);
+				if (n_setup_left == 0)
+					start_run();
+			}
+		}
+		break;
+	case '=':
+		c->in_multi = 1;
+		break;
+	case '+':
+	case '?':
+		got_reply(c, line, &now);
+		break;
+	case '!':
+		if (line[1] == '+') {
+			got_reply(c, line, &now);
+			break;
+		} else if (line[1] == '-')
+			break;
+		c->events++;
+		{
+			char *sp = strchr(line, ' ');
+			if (sp && edge_dly > 0 && toggles && sp[2] == 0 &&
+					((sp[1] == 'H' && edge_state) || (sp[1] == 'L' && !edge_state)))
+				sample_add(&edge, tv_usec(&t_edge,&now));
+		}
+		break;
+	default:
+		fprintf(stderr, "conn %d: unknown line: %s\n", c->idx, line);
+		break;
+	}
+}
+
+static void read_cb(struct bufferevent *bev, void *user_data)
+{
+	struct bconn *c = user_data;
+	struct evbuffer *buf = bufferevent_get_input(bev);
+
+	while(1) {
+		char *line;
+		size_t len;
+
+		line = evbuffer_readln(buf, &len, EVBUFFER_EOL_CRLF);
+		if (line == NULL)
+			break;
+		if (c)
+			got_line(c, line);
+		free(line);
+	}
+}
+
+static void event_cb(struct bufferevent *bev, short events, void *user_data)
+{
+	struct bconn *c = user_data;
+
+	if (events & BEV_EVENT_CONNECTED)
+		return;
+	fprintf(stderr, "conn %d: %s\n", c ? c->idx : -1,
+		(events & BEV_EVENT_EOF) ? "closed" : strerror(EVUTIL_SOCKET_ERROR()));
+	exit(1);
+}
+
+static void tick_cb(evutil_socket_t fd, short events, void *user_data)
+{
+	struct bconn *c = user_data;
+	static int per_tick = 0;
+
+	if (!per_tick) {
+		per_tick = rate/1000;
+		if (per_tick < 1)
+			per_tick = 1;
+	}
+	if (running) {
+		int i;
+		for(i = 0; i < per_tick; i++)
+			send_random(c);
+	}
+}
+
+static void edge_cb(evutil_socket_t fd, short events, void *user_data)
+{
+	if (!running)
+		return;
+	edge_state = !edge_state;
+	toggles++;
+	gettimeofday(&t_edge, NULL);
+	evbuffer_add_printf(bufferevent_get_output(ctl), "D%c\n", edge_state ? 's' : 'c');
+}
+
+static void report(void)
+{
+	unsigned long sent = 0, done = 0, errors = 0, events = 0;
+	double secs = tv_usec(&t_start,&t_stop)/1000000.;
+	int i;
+
+	for(i = 0; i < n_conn; i++) {
+		sent += conns[i].sent;
+		done += conns[i].done;
+		errors += conns[i].errors;
+		events += conns[i].events;
+	}
+	printf("{\"config\": {\"host\": \"%s\", \"port\": %d, \"conns\": %d, \"mons\": %d, \"rate\": %g, \"edge\": %g, \"mix\": \"%s\"},\n",
+		host,port, n_conn,n_mon, rate,edge_dly, mix);
+	printf(" \"duration\": %.3f,\n", secs);
+	printf(" \"commands\": {\"sent\": %lu, \"completed\": %lu, \"errors\": %lu, \"per_sec\": %.1f},\n",
+		sent,done,errors, secs > 0 ? done/secs : 0);
+	printf(" ");
+	sample_json("rtt_usec", &rtt);
+	printf(",\n \"events\": {\"received\": %lu, \"per_sec\": %.1f, \"toggles\": %lu, ",
+		events, secs > 0 ? events/secs : 0, toggles);
+	sample_json("edge_usec", &edge);
+	printf("}}\n");
+}
+
+static void stop_cb(evutil_socket_t fd, short events, void *user_data)
+{
+	struct timeval dly = {1,0};
+	int i,j;
+
+	if (stopping) {
+		/* pending replies are given up on at this point */
+		report();
+		event_base_loopbreak(base);
+		return;
+	}
+	running = 0;
+	stopping = 1;
+	gettimeofday(&t_stop, NULL);
+
+	/* output monitors survive disconnects, so delete them */
+	for(i = 0; i < n_conn; i++)
+		for(j = 0; j < conns[i].n_outmon; j++)
+			send_cmd(&conns[i], P_CLEANUP, "m- %d\n", conns[i].outmon[j]);
+	event_add(stop_event, &dly);
+}
+
+static void start_run(void)
+{
+	struct timeval tv;
+	int i;
+
+	if (rate > 0) {
+		float iv = 1/rate;
+		if (iv < 0.001)
+			iv = 0.001;
+		tv.tv_sec = (int)iv;
+		tv.tv_usec = (int)((iv-tv.tv_sec)*1000000);
+		for(i = 0; i < n_conn; i++) {
+			conns[i].tick = event_new(base, -1, EV_TIMEOUT|EV_PERSIST, tick_cb, &conns[i]);
+			event_add(conns[i].tick, &tv);
+		}
+	}
+	if (edge_dly > 0) {
+		tv.tv_sec = (int)edge_dly;
+		tv.tv_usec = (int)((edge_dly-tv.tv_sec)*1000000);
+		edge_event = event_new(base, -1, EV_TIMEOUT|EV_PERSIST, edge_cb, NULL);
+		event_add(edge_event, &tv);
+	}
+	tv.tv_sec = (int)duration;
+	tv.tv_usec = (int)((duration-tv.tv_sec)*1000000);
+	stop_event = event_new(base, -1, EV_TIMEOUT, stop_cb, NULL);
+	event_add(stop_event, &tv);
+
+	running = 1;
+	gettimeofday(&t_start, NULL);
+	if (rate == 0)
+		for(i = 0; i < n_conn; i++)
+			send_random(&conns[i]);
+}
+
+static struct bufferevent *do_connect(struct sockaddr_in *sin, struct bconn *c)
+{
+	struct bufferevent *bev;
+
+	bev = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE);
+	if (bev == NULL)
+		return NULL;
+	bufferevent_setcb(bev, read_cb, NULL, event_cb, c);
+	bufferevent_enable(bev, EV_READ|EV_WRITE);
+	if (bufferevent_socket_connect(bev, (struct sockaddr *)sin, sizeof(*sin)) < 0) {
+		bufferevent_free(bev);
+		return NULL;
+	}
+	return bev;
+}
+
+static int parse_slot(const char *arg, int *slot, int *bits)
+{
+	return (sscanf(arg, "%d:%d", slot,bits) == 2 && *slot > 0 && *bits > 0) ? 0 : -1;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct sockaddr_in sin;
+	int i, opt;
+
+	static struct option long_options[] = {
+		{"host", 1, 0, 'H'},
+		{"port", 1, 0, 'p'},
+		{"conns", 1, 0, 'n'},
+		{"mons", 1, 0, 'm'},
+		{"rate", 1, 0, 'r'},
+		{"time", 1, 0, 't'},
+		{"edge", 1, 0, 'e'},
+		{"mix", 1, 0, 'x'},
+		{"in", 1, 0, 'i'},
+		{"out", 1, 0, 'o'},
+		{"help", 0, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+	while((opt = getopt_long(argc, argv, "H:p:n:m:r:t:e:x:i:o:h", long_options, NULL)) >= 0) {
+		switch(opt) {
+		case 'H': host = optarg; break;
+		case 'p': port = atoi(optarg); break;
+		case 'n': n_conn = atoi(optarg); break;
+		case 'm': n_mon = atoi(optarg); break;
+		case 'r': rate = atof(optarg); break;
+		case 't': duration = atof(optarg); break;
+		case 'e': edge_dly = atof(optarg); break;
+		case 'x': mix = optarg; break;
+		case 'i':
+			if (parse_slot(optarg, &in_slot,&in_bits) < 0)
+				usage(1);
+			break;
+		case 'o':
+			if (parse_slot(optarg, &out_slot,&out_bits) < 0)
+				usage(1);
+			break;
+		case 'h': usage(0);
+		default: usage(1);
+		}
+	}
+	if (n_conn < 1 || n_mon < 0 || rate < 0 || duration <= 0 || port <= 0 || parse_mix(mix) < 0)
+		usage(1);
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	if (inet_pton(AF_INET, host, &sin.sin_addr) != 1) {
+		fprintf(stderr, "'%s' is not an IPv4 address.\n", host);
+		exit(1);
+	}
+
+	base = event_base_new();
+	if (!base) {
+		fprintf(stderr, "Could not initialize libevent: %s\n",strerror(errno));
+		return 1;
+	}
+
+	/* The control connection makes simulated reads deterministic
+	   and lets output monitors run without interference. */
+	ctl = do_connect(&sin, NULL);
+	if (ctl == NULL) {
+		fprintf(stderr, "Could not connect: %s\n",strerror(errno));
+		return 1;
+	}
+	evbuffer_add_printf(bufferevent_get_output(ctl), "Dr\nDc\nDI\n");
+
+	conns = calloc(n_conn, sizeof(*conns));
+	if (conns == NULL)
+		return 1;
+	for(i = 0; i < n_conn; i++) {
+		conns[i].idx = i;
+		conns[i].bev = do_connect(&sin, &conns[i]);
+		if (conns[i].bev == NULL) {
+			fprintf(stderr, "Could not connect: %s\n",strerror(errno));
+			return 1;
+		}
+	}
+
+	event_base_dispatch(base);
+	return 0;
+}
@@ -0,0 +1,167 @@
+/*
+  Decode a change log written by wago (-L).
+
+  It is available under the GNU General Public license, version 3.
+*/
+
+#include "datalog.h"
+#include "bus.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+static struct dlog_slot *slots = NULL;
+static unsigned long *value = NULL;
+static unsigned int n_slots = 0;
+
+static const char *fname;
+
+static void print_change(uint64_t t, unsigned int slot)
+{
+	char tbuf[30];
+	time_t sec = t/1000000;
+
+	strftime(tbuf,sizeof(tbuf),"%Y-%m-%d %H:%M:%S",localtime(&sec));
+	printf("%s.%06u %d %s %lx\n", tbuf, (unsigned int)(t%1000000), slots[slot].id,
+		slots[slot].typ == BUS_BITS_IN ? "in" : "out", value[slot]);
+}
+
+static int get_varint(const unsigned char **p, const unsigned char *end, uint64_t *v)
+{
+	int shift = 0;
+
+	*v = 0;
+	while(*p < end && shift < 64) {
+		unsigned char c = *(*p)++;
+		*v |= (uint64_t)(c & 0x7F) << shift;
+		if (!(c & 0x80))
+			return 0;
+		shift += 7;
+	}
+	return -1;
+}
+
+static int read_header(FILE *f, struct dlog_hdr *hdr)
+{
+	char tbuf[30];
+	time_t t;
+	unsigned int i;
+
+	if (hdr->version != DLOG_VERSION) {
+		fprintf(stderr,"%s: unsupported version %d\n", fname, hdr->version);
+		return -1;
+	}
+	n_slots = hdr->n_slots;
+	slots = realloc(slots, (n_slots+1)*sizeof(*slots));
+	value = realloc(value, (n_slots+1)*sizeof(*value));
+	if (slots == NULL || value == NULL || fread(slots,sizeof(*slots),n_slots,f) != n_slots) {
+		fprintf(stderr,"%s: truncated header\n", fname);
+		return -1;
+	}
+	memset(value,0,n_slots*sizeof(*value));
+	t = hdr->time;
+	strftime(tbuf,sizeof(tbuf),"%Y-%m-%d %H:%M:%S",localtime(&t));
+	printf("# log started %s, %u slots:", tbuf, n_slots);
+	for(i = 0; i < n_slots; i++)
+		printf(" %d %s %d", slots[i].id, slots[i].typ == BUS_BITS_IN ? "in" : "out", slots[i].bits);
+	printf("\n");
+	return 0;
+}
+
+static int read_block(FILE *f, struct dlog_blk *hdr, int first)
+{
+	unsigned char buf[DLOG_BLOCK];
+	const unsigned char *p = buf, *end = buf+hdr->len;
+	uint64_t t = hdr->t0, v, dt = 0, x = 0;
+	unsigned int i, slot = 0;
+
+	if (hdr->len > sizeof(buf) || fread(buf,1,hdr->len,f) != hdr->len) {
+		fprintf(stderr,"%s: bad or truncated block\n", fname);
+		return -1;
+	}
+	for(i = 0; i < n_slots; i++) {
+		if (get_varint(&p,end,&v) < 0)
+			goto bad;
+		/* the key frame should match what we have; if not, data is missing */
+		if (first || value[i] != v) {
+			value[i] = v;
+			print_change(t, i);
+		}
+	}
+	while(p < end) {
+		if (get_varint(&p,end,&v) < 0 || (v>>1) >= n_slots)
+			goto bad;
+		if (v & 1) {
+			/* repeat the last record */
+			uint64_t n;
+			if ((v>>1) != slot || get_varint(&p,end,&n) < 0)
+				goto bad;
+			while(n--) {
+				t += dt;
+				value[slot] ^= x;
+				print_change(t, slot);
+			}
+			continue;
+		}
+		slot = v>>1;
+		if (get_varint(&p,end,&dt) < 0 || get_varint(&p,end,&x) < 0)
+			goto bad;
+		t += dt;
+		value[slot] ^= x;
+		print_change(t, slot);
+	}
+	return 0;
+bad:
+	fprintf(stderr,"%s: bad record\n", fname);
+	return -1;
+}
+
+int
+main(int argc, char **argv)
+{
+	union {
+		char magic[4];
+		struct dlog_hdr hdr;
+		struct dlog_blk blk;
+	} u;
+	FILE *f;
+	int i, first = 0, res = 0;
+
+	if (argc < 2) {
+		fprintf(stderr,"Usage: %s LOGFILE...\n", argv[0]);
+		exit(2);
+	}
+	for(i = 1; i < argc; i++) {
+		fname = argv[i];
+		f = fopen(fname,"r");
+		if (f == NULL) {
+			fprintf(stderr,"%s: %s\n", fname, strerror(errno));
+			exit(1);
+		}
+		n_slots = 0;
+		while(fread(u.magic,sizeof(u.magic),1,f) == 1) {
+			if (!memcmp(u.magic,DLOG_MAGIC,sizeof(u.magic))) {
+				if (fread(u.magic+4,sizeof(u.hdr)-4,1,f) != 1 || read_header(f,&u.hdr) < 0) {
+					res = 1;
+					break;
+				}
+				first = 1;
+			} else if (!memcmp(u.magic,DLOG_BLK_MAGIC,sizeof(u.magic)) && slots) {
+				if (fread(u.magic+4,sizeof(u.blk)-4,1,f) != 1 || read_block(f,&u.blk,first) < 0) {
+					res = 1;
+					break;
+				}
+				first = 0;
+			} else {
+				fprintf(stderr,"%s: not a log file\n", fname);
+				res = 1;
+				break;
+			}
+		}
+		fclose(f);
+	}
+	return res;
+}
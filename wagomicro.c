@@ -0,0 +1,328 @@
+/*
+  Microbenchmarks for the daemon's hot paths.
+
+  This links the bus, monitor and command code directly, without
+  sockets, and reports time and heap allocations per operation for
+  bit lookup, mon_sync, command parsing and port list formatting.
+
+  Build with "make bench" (DEMO build: the bus is simulated).
+
+  It is available under the GNU General Public license, version 3.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "wago.h"
+#include "bus.h"
+#include "mon.h"
+#include "cmd.h"
+#include "trace.h"
+
+#include <event2/bufferevent.h>
+#include <event2/buffer.h>
+#include <event2/event.h>
+
+/* What wago.c would otherwise provide */
+struct event_base *base = NULL;
+char debug = 0;
+char demo_rand = 0;
+char demo_state_r = 0;
+char demo_state_w = 0;
+char demo_state_skip = 0;
+struct timeval loop_dly = {3,0};
+char *trace_file = "/dev/null";
+
+int change_loop_timer(float d)
+{
+	loop_dly.tv_sec = (int)d;
+	loop_dly.tv_usec = (int)((d-loop_dly.tv_sec)*1000000);
+	return 0;
+}
+
+/* Allocation counting. Our objects are linked with --wrap=malloc etc.;
+   libevent gets the same functions via event_set_mem_functions(). */
+static unsigned long allocs = 0;
+
+void *__real_malloc(size_t);
+void *__real_calloc(size_t, size_t);
+void *__real_realloc(void *, size_t);
+void __real_free(void *);
+
+void *__wrap_malloc(size_t sz) { allocs++; return __real_malloc(sz); }
+void *__wrap_calloc(size_t n, size_t sz) { allocs++; return __real_calloc(n,sz); }
+void *__wrap_realloc(void *p, size_t sz) { allocs++; return __real_realloc(p,sz); }
+void __wrap_free(void *p) { __real_free(p); }
+
+/* Benchmark state */
+static float min_time = 0.2;
+static const char *filter = NULL;
+static const char *cmd_file = NULL;
+static char tmpl[] = "/tmp/wagomicro.XXXXXX";
+static struct bufferevent *bev;
+
+#define N_LOOKUP 1024
+static unsigned short lookup_port[N_LOOKUP], lookup_bit[N_LOOKUP];
+static int n_in_bits = 0;
+
+static char **cmds = NULL;
+static int n_cmds = 0;
+
+static const char *default_cmds[] = {
+	"i 1 1", "i 1 5", "I 2 3", "s 2 3", "c 2 3", "i 3 2", "I 4 16",
+	"s 2 3", "c 2 3", "m", "d", "i 99 1", "s 1 1", "x", "hm", "Dp",
+};
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static void drain(void)
+{
+	struct evbuffer *out = bufferevent_get_output(bev);
+	evbuffer_drain(out, evbuffer_get_length(out));
+}
+
+/* Run FN with increasing iteration counts until it takes long enough. */
+typedef void (*bench_fn)(unsigned long n, int arg);
+static void run(const char *name, bench_fn fn, int arg)
+{
+	unsigned long n = 1;
+	unsigned long a;
+	double t;
+
+	if (filter && !strstr(name, filter))
+		return;
+	while(1) {
+		a = allocs;
+		t = now();
+		(*fn)(n, arg);
+		t = now()-t;
+		a = allocs-a;
+		if (t >= min_time || n >= (1UL<<30))
+			break;
+		if (t < min_time/100)
+			n *= 10;
+		else
+			n = n*min_time*1.2/t + 1;
+	}
+	printf("%-32s %10lu %12.1f ns/op %10.2f allocs/op\n", name, n, t*1e9/n, (double)a/n);
+	fflush(stdout);
+}
+
+/* Write a rack with N modules, alternating 8-bit inputs and 16-bit outputs,
+   and load it. */
+static int load_rack(int n)
+{
+	FILE *f;
+	int fd, i;
+	int roff = 0, woff = 0;
+
+	bus_free_data();
+	fd = mkstemp(tmpl);
+	if (fd < 0)
+		return -1;
+	f = fdopen(fd, "w");
+	for(i = 1; i <= n; i++) {
+		if (i & 1) {
+			fprintf(f, "%d 750-4xx 0 8 n 0 0 0 %d 0 8\n", i, roff);
+			roff += 1;
+		} else {
+			fprintf(f, "%d 750-5xx 0 16 n %d 0 16 0 0 0\n", i, woff);
+			woff += 2;
+		}
+	}
+	fclose(f);
+	i = bus_init_data(tmpl);
+	unlink(tmpl);
+	strcpy(tmpl+strlen(tmpl)-6, "XXXXXX");
+	if (i < 0)
+		return i;
+
+	/* random input bits to look up */
+	n_in_bits = 8*((n+1)/2);
+	for(i = 0; i < N_LOOKUP; i++) {
+		lookup_port[i] = 1 + 2*(rand() % ((n+1)/2));
+		lookup_bit[i] = 1 + rand() % 8;
+	}
+	return 0;
+}
+
+static void bench_find_bit(unsigned long n, int arg)
+{
+	unsigned long i;
+	unsigned short p,o;
+
+	for(i = 0; i < n; i++) {
+		p = lookup_port[i & (N_LOOKUP-1)];
+		o = lookup_bit[i & (N_LOOKUP-1)];
+		_bus_find_bit(&p,&o, BUS_BITS_IN);
+	}
+}
+
+/* arg: 0 no changes, 1 random (DEMO: 10% chance per read), 2 every bit changes */
+static void bench_mon_sync(unsigned long n, int arg)
+{
+	unsigned long i;
+
+	demo_rand = (arg == 1);
+	for(i = 0; i < n; i++) {
+		if (arg == 2)
+			demo_state_r = !demo_state_r;
+		mon_sync();
+		drain();
+	}
+	demo_rand = 0;
+}
+
+static void bench_parse(unsigned long n, int arg)
+{
+	unsigned long i;
+
+	for(i = 0; i < n; i++) {
+		parse_input(bev, cmds[i % n_cmds]);
+		drain();
+	}
+}
+
+static void bench_report_bus(unsigned long n, int arg)
+{
+	unsigned long i;
+	struct evbuffer *out = bufferevent_get_output(bev);
+
+	for(i = 0; i < n; i++) {
+		bus_enum(report_bus, out);
+		drain();
+	}
+}
+
+static int load_cmds(const char *fn)
+{
+	char buf[200];
+	FILE *f;
+
+	if (fn == NULL) {
+		cmds = (char **)default_cmds;
+		n_cmds = sizeof(default_cmds)/sizeof(*default_cmds);
+		return 0;
+	}
+	f = fopen(fn, "r");
+	if (f == NULL)
+		return -1;
+	while(fgets(buf,sizeof(buf),f)) {
+		char *nl = strchr(buf,'\n');
+		if (nl) *nl = 0;
+		if (!*buf)
+			continue;
+		cmds = realloc(cmds, (n_cmds+1)*sizeof(*cmds));
+		cmds[n_cmds++] = strdup(buf);
+	}
+	fclose(f);
+	return n_cmds ? 0 : -1;
+}
+
+static void usage(int err)
+{
+	fprintf(err ? stderr : stdout, "\
+Usage: wagomicro OPTION ...\n\
+Options:\n\
+-t|--time #     Run each benchmark for at least # seconds (default %g)\n\
+-f|--file #     Read the command stream for parse_input from # (one per line)\n\
+-b|--bench #    Only run benchmarks whose name contains #\n\
+-h|--help       Print this message\n\
+", min_time);
+	exit(err);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const int racks[] = { 8, 32, 64 };
+	static const int mons[] = { 10, 100, 1000, 10000 };
+	static const char *rates[] = { "none", "rand", "all" };
+	char name[50];
+	int i,j,k, opt;
+
+	static struct option long_options[] = {
+		{"time", 1, 0, 't'},
+		{"file", 1, 0, 'f'},
+		{"bench", 1, 0, 'b'},
+		{"help", 0, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+	while((opt = getopt_long(argc, argv, "t:f:b:h", long_options, NULL)) >= 0) {
+		switch(opt) {
+		case 't': min_time = atof(optarg); break;
+		case 'f': cmd_file = optarg; break;
+		case 'b': filter = optarg; break;
+		case 'h': usage(0);
+		default: usage(1);
+		}
+	}
+	if (min_time <= 0)
+		usage(1);
+	if (load_cmds(cmd_file) < 0) {
+		fprintf(stderr, "Could not read commands from %s\n", cmd_file);
+		return 1;
+	}
+
+	event_set_mem_functions(__wrap_malloc, __wrap_realloc, __wrap_free);
+	base = event_base_new();
+	bev = bufferevent_socket_new(base, -1, 0);
+	if (base == NULL || bev == NULL) {
+		fprintf(stderr, "Could not initialize libevent: %s\n",strerror(errno));
+		return 1;
+	}
+	trace_on = 0;
+	printf("%-32s %10s %12s       %10s\n", "# benchmark", "iterations", "time", "allocs");
+
+	for(i = 0; i < sizeof(racks)/sizeof(*racks); i++) {
+		if (load_rack(racks[i]) < 0) {
+			fprintf(stderr, "Could not set up the bus: %s\n",strerror(errno));
+			return 1;
+		}
+		sprintf(name, "find_bit/%d", racks[i]);
+		run(name, bench_find_bit, 0);
+	}
+
+	/* load_rack() left the largest rack in place. Report monitors on
+	   the same bit share a watcher; count monitors are polled one by one. */
+	for(i = 0; i < 2*sizeof(mons)/sizeof(*mons); i++) {
+		int count = (i >= sizeof(mons)/sizeof(*mons));
+		int n_mon = mons[i % (sizeof(mons)/sizeof(*mons))];
+
+		for(k = 0; k < n_mon; k++) {
+			int b = k % n_in_bits;
+			if (mon_new(count ? MON_COUNT : MON_REPORT, 1+2*(b/8), 1+b%8, bev, count ? 1000 : 0,0) < 0) {
+				fprintf(stderr, "Could not create monitor: %s\n",strerror(errno));
+				return 1;
+			}
+		}
+		for(j = 0; j < sizeof(rates)/sizeof(*rates); j++) {
+			sprintf(name, "mon_sync/%s%d/%s", count ? "count/" : "", n_mon, rates[j]);
+			run(name, bench_mon_sync, j);
+		}
+		mon_delbuf(bev);
+		drain();
+	}
+
+	run("parse_input", bench_parse, 0);
+
+	trace_on = 1;
+	run("parse_input/trace", bench_parse, 0);
+	trace_on = 0;
+
+	run("report_bus/64", bench_report_bus, 0);
+
+	bufferevent_free(bev);
+	event_base_free(base);
+	return 0;
+}
@@ -0,0 +1,109 @@
+#ifndef WAGOSHM_H
+#define WAGOSHM_H
+
+/*
+  Shared-memory process image, published by wago (-S NAME) after every
+  bus update. This header is all a local reader needs:
+
+	struct wago_shm *shm = wago_shm_open("/wago");
+	struct wago_shm_data d;
+	wago_shm_read(shm, &d);
+
+  or, without copying,
+
+	do {
+		seq = wago_shm_begin(shm);
+		v = shm->d.slot[3].value;
+	} while (wago_shm_retry(shm, seq));
+
+  Link with -lrt. It is available under the GNU General Public license, version 3.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define WAGO_SHM_MAGIC 0x4D485357 /* "WSHM" */
+#define WAGO_SHM_VERSION 1
+#define WAGO_SHM_SLOTS 64
+
+struct wago_shm_slot {
+	uint8_t id;
+	uint8_t typ; /* 1: digital input, 2: digital output */
+	uint8_t bits;
+	uint8_t _pad;
+	uint32_t value; /* bit 0 is position 1 */
+};
+
+struct wago_shm_data {
+	uint64_t updates; /* bus updates */
+	uint64_t cycles; /* poll cycles */
+	uint64_t time; /* wall clock of the update, usec since the epoch */
+	uint32_t kbus_usec; /* how long the update took */
+	uint16_t n_slots;
+	uint16_t _pad;
+	struct wago_shm_slot slot[WAGO_SHM_SLOTS];
+};
+
+struct wago_shm {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t size; /* sizeof(struct wago_shm) */
+	volatile uint32_t seq; /* odd while the writer is busy */
+	uint32_t _pad;
+	struct wago_shm_data d;
+};
+
+static inline struct wago_shm *wago_shm_open(const char *name)
+{
+	struct wago_shm *shm;
+	int fd = shm_open(name, O_RDONLY, 0);
+
+	if (fd < 0)
+		return NULL;
+	shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED)
+		return NULL;
+	if (shm->magic != WAGO_SHM_MAGIC || shm->version != WAGO_SHM_VERSION || shm->size != sizeof(*shm)) {
+		munmap(shm, sizeof(*shm));
+		return NULL;
+	}
+	return shm;
+}
+
+static inline void wago_shm_close(struct wago_shm *shm)
+{
+	munmap(shm, sizeof(*shm));
+}
+
+/* Seqlock read side */
+static inline uint32_t wago_shm_begin(const struct wago_shm *shm)
+{
+	uint32_t seq;
+
+	while((seq = shm->seq) & 1)
+		;
+	__sync_synchronize();
+	return seq;
+}
+
+static inline int wago_shm_retry(const struct wago_shm *shm, uint32_t seq)
+{
+	__sync_synchronize();
+	return shm->seq != seq;
+}
+
+static inline void wago_shm_read(const struct wago_shm *shm, struct wago_shm_data *d)
+{
+	uint32_t seq;
+
+	do {
+		seq = wago_shm_begin(shm);
+		memcpy(d, (const void *)&shm->d, sizeof(*d));
+	} while (wago_shm_retry(shm, seq));
+}
+
+#endif
@@ -0,0 +1,57 @@
+/*
+  Decode a trace file written by wago (on SIGUSR1 or via 'tw').
+
+  It is available under the GNU General Public license, version 3.
+*/
+
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+int
+main(int argc, char **argv)
+{
+	struct trace_hdr hdr;
+	struct trace_rec rec;
+	char buf[100];
+	char tbuf[30];
+	time_t t;
+	FILE *f;
+	uint32_t n;
+
+	if (argc != 2) {
+		fprintf(stderr,"Usage: %s TRACEFILE\n", argv[0]);
+		exit(2);
+	}
+	f = fopen(argv[1],"r");
+	if (f == NULL) {
+		fprintf(stderr,"%s: %s\n", argv[1], strerror(errno));
+		exit(1);
+	}
+	if (fread(&hdr,sizeof(hdr),1,f) != 1 || memcmp(hdr.magic,TRACE_MAGIC,sizeof(hdr.magic))) {
+		fprintf(stderr,"%s: not a trace file\n", argv[1]);
+		exit(1);
+	}
+	if (hdr.version != 1 || hdr.recsize != sizeof(rec)) {
+		fprintf(stderr,"%s: unsupported version %d, record size %d\n", argv[1], hdr.version,hdr.recsize);
+		exit(1);
+	}
+
+	t = hdr.time;
+	strftime(tbuf,sizeof(tbuf),"%Y-%m-%d %H:%M:%S",localtime(&t));
+	printf("# %u records, written %s; times are relative to that.\n", hdr.count, tbuf);
+	for(n = 0; n < hdr.count; n++) {
+		if (fread(&rec,sizeof(rec),1,f) != 1) {
+			fprintf(stderr,"%s: truncated after %u records\n", argv[1], n);
+			exit(1);
+		}
+		trace_decode(&rec, hdr.now, buf,sizeof(buf));
+		printf("%s\n", buf);
+	}
+	fclose(f);
+	return 0;
+}